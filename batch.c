@@ -0,0 +1,448 @@
+/*
+  Translating whole jobs ahead of time.
+
+  pinmap_translate() does one code word while the machine waits for it.
+  A job is known before casting starts, though, so it can be translated
+  all at once instead (batch_translate()), into:
+
+  payloads - every distinct register payload once: the values of the
+             output registers the pin map uses (2 per chip, in output word
+             order), "registers" bytes each, padded with zeros to "stride"
+             (a multiple of 8) so they're compared 8 bytes at a time.
+             A job uses far fewer distinct codes than it has words,
+             so this stays small.
+  index    - for every code word, which payload it is
+  changed  - for every code word, a bit per register: set if it differs
+             from the previous word's (all set for the first one)
+
+  send_payload() (interface.c) then sends a word straight from these:
+  only the changed registers of its output word are touched.
+
+  Translating uses SIMD, when the CPU has it. Every output bit is a lane:
+  the code word's bytes are shuffled so that each lane gets the byte
+  holding its signal, tested against the signal's bit, and the lanes are
+  packed back into bits - 8 lanes, one register. Which byte and which
+  bit for each lane comes from the pin map, worked out once:
+
+  AVX2  (x86) - 32 lanes: 4 registers per shuffle/test/movemask
+  SSSE3 (x86) - 16 lanes: 2 registers
+  NEON  (64-bit ARM, like a Pi 3 or newer on a 64-bit OS) - 16 lanes,
+                packed by adding up the lanes' bit weights
+  scalar      - pinmap_translate(), for anything else
+
+  batch_method picks one (BATCH_AUTO - the best this CPU can do).
+  The x86 ones are compiled for their instruction set function by function,
+  so the program still runs on CPUs without them.
+
+  Include this after pinmap.c.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BATCH_X86
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define BATCH_REGISTERS PINMAP_SIGNALS  // a signal each at most
+#define BATCH_GROUPS (BATCH_REGISTERS / 4)
+#define BATCH_CHUNK 256                 // code words translated between dedup passes
+#define BATCH_SLOTS 4096                // initial hash table size, a power of two
+
+#define BATCH_AUTO -1
+#define BATCH_SCALAR 0
+#define BATCH_SSSE3 1
+#define BATCH_AVX2 2
+#define BATCH_NEON 3
+
+const char *batch_method_names[] = { "scalar", "ssse3", "avx2", "neon" };
+int batch_method = BATCH_AUTO;
+
+struct payload_batch {
+  int registers;                        // bytes per payload
+  int stride;                           // ...padded to a multiple of 8
+  uint8_t target[BATCH_REGISTERS];      // register r's place in an output word: chip * 2 + bank
+  int method;                           // what batch_translate() used
+
+// Lanes, 4 registers (32 lanes) per group:
+  int groups;
+  uint8_t shuffle[BATCH_GROUPS][32];    // the code word byte with the lane's signal
+  uint8_t bits[BATCH_GROUPS][32];       // the signal's bit in it, 0 - not wired
+  uint32_t wired[BATCH_GROUPS];         // lanes with a signal
+
+  uint32_t count;                       // code words
+  uint32_t unique;                      // distinct payloads
+  uint8_t *payloads;
+  uint32_t *index;
+  uint32_t *changed;
+
+// Finding payloads we already have:
+  uint32_t *slots;                      // payload number + 1, 0 - empty
+  uint32_t slot_mask;
+  uint32_t capacity;                    // payloads allocated
+};
+
+
+void batch_prepare(struct payload_batch *batch, const struct pin_map *map) {
+// Find the registers the map uses, and where each lane's signal is
+  int signal, r, lane;
+
+  memset(batch, 0, sizeof(*batch));
+  for (r = 0; r < MAX_CHIPS * 2 && batch->registers < BATCH_REGISTERS; r++) {
+    for (signal = 0; signal < PINMAP_SIGNALS; signal++) {
+      if (map->output[signal] != PINMAP_UNUSED && map->output[signal] / 8 == r) {
+        batch->target[batch->registers++] = r;
+        break;
+      }
+    }
+  }
+  batch->groups = (batch->registers + 3) / 4;
+  batch->stride = (batch->registers + 7) / 8 * 8;
+
+  for (r = 0; r < batch->registers; r++) {
+    for (signal = 0; signal < PINMAP_SIGNALS; signal++) {
+      if (map->output[signal] == PINMAP_UNUSED || map->output[signal] / 8 != batch->target[r]) {
+        continue;
+      }
+      lane = r % 4 * 8 + map->output[signal] % 8;
+      batch->shuffle[r / 4][lane] = signal / 8;
+      batch->bits[r / 4][lane] = 1 << signal % 8;
+      batch->wired[r / 4] |= 1u << lane;
+    }
+  }
+}
+
+
+/*
+  The translators: count code words to payloads, stride bytes each,
+  one after another. They leave the padding alone - keep it zeroed.
+*/
+
+void batch_scalar(const struct payload_batch *batch, const struct pin_map *map,
+                  const uint32_t *codes, int count, uint8_t *out) {
+  static struct output_word word;
+  int i, r;
+
+  for (i = 0; i < count; i++) {
+    pinmap_translate(map, codes[i], &word);
+    for (r = 0; r < batch->registers; r++) {
+      out[r] = (&word.value[0][0])[batch->target[r]];
+    }
+    out += batch->stride;
+  }
+}
+
+
+#ifdef BATCH_X86
+__attribute__((target("avx2")))
+void batch_avx2(const struct payload_batch *batch, const struct pin_map *map,
+                const uint32_t *codes, int count, uint8_t *out) {
+/*
+  The code word in every 4 bytes of both 128-bit halves (vpshufb only
+  shuffles within a half), the lanes' bytes picked, their bits tested,
+  and vpmovmskb takes the result, one bit per lane: 4 registers.
+*/
+  __m256i shuffle[BATCH_GROUPS], bits[BATCH_GROUPS], code, lanes;
+  uint32_t packed;
+  int i, g;
+
+  for (g = 0; g < batch->groups; g++) {
+    shuffle[g] = _mm256_loadu_si256((const __m256i *) batch->shuffle[g]);
+    bits[g] = _mm256_loadu_si256((const __m256i *) batch->bits[g]);
+  }
+  for (i = 0; i < count; i++) {
+    code = _mm256_set1_epi32(codes[i]);
+    for (g = 0; g < batch->groups; g++) {
+      lanes = _mm256_and_si256(_mm256_shuffle_epi8(code, shuffle[g]), bits[g]);
+      packed = _mm256_movemask_epi8(_mm256_cmpeq_epi8(lanes, bits[g])) & batch->wired[g];
+      memcpy(out + g * 4, &packed, 4);
+    }
+    out += batch->stride;
+  }
+}
+
+
+__attribute__((target("ssse3")))
+void batch_ssse3(const struct payload_batch *batch, const struct pin_map *map,
+                 const uint32_t *codes, int count, uint8_t *out) {
+// The same with 16 lanes: 2 registers at a time
+  __m128i shuffle[BATCH_GROUPS * 2], bits[BATCH_GROUPS * 2], code, lanes;
+  uint16_t packed;
+  int i, h, halves = (batch->registers + 1) / 2;
+
+  for (h = 0; h < batch->groups * 2; h++) {
+    shuffle[h] = _mm_loadu_si128((const __m128i *) &batch->shuffle[h / 2][h % 2 * 16]);
+    bits[h] = _mm_loadu_si128((const __m128i *) &batch->bits[h / 2][h % 2 * 16]);
+  }
+  for (i = 0; i < count; i++) {
+    code = _mm_set1_epi32(codes[i]);
+    for (h = 0; h < halves; h++) {
+      lanes = _mm_and_si128(_mm_shuffle_epi8(code, shuffle[h]), bits[h]);
+      packed = _mm_movemask_epi8(_mm_cmpeq_epi8(lanes, bits[h]))
+               & batch->wired[h / 2] >> (h % 2 * 16);
+      memcpy(out + h * 2, &packed, 2);
+    }
+    out += batch->stride;
+  }
+}
+#endif
+
+
+#if defined(__aarch64__)
+void batch_neon(const struct payload_batch *batch, const struct pin_map *map,
+                const uint32_t *codes, int count, uint8_t *out) {
+/*
+  NEON has no movemask: the tested lanes (0xff or 0) keep their bit's
+  weight (1, 2, 4...128), and three pairwise additions add up every 8 lanes
+  into a byte - 2 registers per 16 lanes.
+*/
+  static const uint8_t weight_bytes[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+  uint8x16_t shuffle[BATCH_GROUPS * 2], bits[BATCH_GROUPS * 2], weights, code, lanes;
+  int i, h, halves = (batch->registers + 1) / 2;
+
+  weights = vld1q_u8(weight_bytes);
+  for (h = 0; h < batch->groups * 2; h++) {
+    shuffle[h] = vld1q_u8(&batch->shuffle[h / 2][h % 2 * 16]);
+    bits[h] = vld1q_u8(&batch->bits[h / 2][h % 2 * 16]);
+  }
+  for (i = 0; i < count; i++) {
+    code = vreinterpretq_u8_u32(vdupq_n_u32(codes[i]));
+    for (h = 0; h < halves; h++) {
+      lanes = vandq_u8(vtstq_u8(vqtbl1q_u8(code, shuffle[h]), bits[h]), weights);
+      lanes = vpaddq_u8(lanes, lanes);
+      lanes = vpaddq_u8(lanes, lanes);
+      lanes = vpaddq_u8(lanes, lanes);
+      vst1q_lane_u16((uint16_t *) (out + h * 2), vreinterpretq_u16_u8(lanes), 0);
+    }
+    out += batch->stride;
+  }
+}
+#endif
+
+
+int batch_best_method(void) {
+// The fastest translator this CPU can run
+#ifdef BATCH_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return BATCH_AVX2;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return BATCH_SSSE3;
+  }
+#endif
+#if defined(__aarch64__)
+  return BATCH_NEON;
+#endif
+  return BATCH_SCALAR;
+}
+
+
+int batch_method_available(int method) {
+  if (method == BATCH_SCALAR) {
+    return 1;
+  }
+#ifdef BATCH_X86
+  if (method == BATCH_AVX2) {
+    return __builtin_cpu_supports("avx2");
+  }
+  if (method == BATCH_SSSE3) {
+    return __builtin_cpu_supports("ssse3");
+  }
+#endif
+#if defined(__aarch64__)
+  if (method == BATCH_NEON) {
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+
+void batch_run(const struct payload_batch *batch, const struct pin_map *map,
+               const uint32_t *codes, int count, uint8_t *out) {
+// Translate with the method the batch has picked
+  switch (batch->method) {
+#ifdef BATCH_X86
+  case BATCH_AVX2:
+    batch_avx2(batch, map, codes, count, out);
+    return;
+  case BATCH_SSSE3:
+    batch_ssse3(batch, map, codes, count, out);
+    return;
+#endif
+#if defined(__aarch64__)
+  case BATCH_NEON:
+    batch_neon(batch, map, codes, count, out);
+    return;
+#endif
+  default:
+    batch_scalar(batch, map, codes, count, out);
+  }
+}
+
+
+static inline uint64_t batch_load(const uint8_t *bytes) {
+// 8 payload bytes as a number, byte 0 the lowest
+  uint64_t value;
+
+  memcpy(&value, bytes, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap64(value);
+#endif
+  return value;
+}
+
+
+static inline uint64_t batch_hash(const struct payload_batch *batch, const uint8_t *payload) {
+  uint64_t hash = 0;
+  int i;
+
+  for (i = 0; i < batch->stride; i += 8) {
+    hash = (hash ^ batch_load(payload + i)) * 0x9e3779b97f4a7c15ull;
+  }
+// The low bits pick the slot - mix the high ones in (MurmurHash3's finalizer):
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  return hash ^ hash >> 33;
+}
+
+
+static inline int batch_same(const struct payload_batch *batch, const uint8_t *a, const uint8_t *b) {
+  int i;
+
+  for (i = 0; i < batch->stride; i += 8) {
+    if (batch_load(a + i) != batch_load(b + i)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+static inline uint32_t batch_changed(const struct payload_batch *batch, const uint8_t *a, const uint8_t *b) {
+/*
+  A bit per register that differs: the XOR of 8 bytes folded into bit 0
+  of each byte, and the 8 bits gathered into one byte by a multiplication.
+*/
+  uint64_t diff;
+  uint32_t changed = 0;
+  int i;
+
+  for (i = 0; i < batch->stride; i += 8) {
+    diff = batch_load(a + i) ^ batch_load(b + i);
+    diff |= diff >> 4;
+    diff |= diff >> 2;
+    diff |= diff >> 1;
+    changed |= (uint32_t) ((diff & 0x0101010101010101ull) * 0x0102040810204080ull >> 56) << i;
+  }
+  return changed;
+}
+
+
+int batch_grow(struct payload_batch *batch) {
+// Twice the hash table, rehashed; room for as many payloads. Returns 0 or -1.
+  uint32_t *slots, mask = batch->slot_mask ? batch->slot_mask * 2 + 1 : BATCH_SLOTS - 1;
+  uint8_t *payloads;
+  uint32_t p, slot;
+
+  slots = calloc(mask + 1, sizeof(*slots));
+  payloads = realloc(batch->payloads, (size_t) (mask + 1) / 2 * batch->stride);
+  if (slots == NULL || payloads == NULL) {
+    free(slots);
+    if (payloads != NULL) {
+      batch->payloads = payloads;
+    }
+    return -1;
+  }
+  batch->payloads = payloads;
+  for (p = 0; p < batch->unique; p++) {
+    slot = batch_hash(batch, payloads + (size_t) p * batch->stride) & mask;
+    while (slots[slot]) {
+      slot = (slot + 1) & mask;
+    }
+    slots[slot] = p + 1;
+  }
+  free(batch->slots);
+  batch->slots = slots;
+  batch->slot_mask = mask;
+  batch->capacity = (mask + 1) / 2;
+  return 0;
+}
+
+
+int batch_find(struct payload_batch *batch, const uint8_t *payload) {
+// The payload's number - added if it's new. Returns -1 if out of memory.
+  uint32_t slot, p;
+
+  if (batch->unique == batch->capacity && batch_grow(batch) < 0) {
+    return -1;
+  }
+  slot = batch_hash(batch, payload) & batch->slot_mask;
+  while ((p = batch->slots[slot]) != 0) {
+    if (batch_same(batch, batch->payloads + (size_t) (p - 1) * batch->stride, payload)) {
+      return p - 1;
+    }
+    slot = (slot + 1) & batch->slot_mask;
+  }
+  memcpy(batch->payloads + (size_t) batch->unique * batch->stride, payload, batch->stride);
+  batch->slots[slot] = batch->unique + 1;
+  return batch->unique++;
+}
+
+
+int batch_translate(struct payload_batch *batch, const struct pin_map *map,
+                    const uint32_t *codes, uint32_t count) {
+/*
+  Translate a job: count code words to payloads, index and changed
+  (see above). Call batch_prepare() first. Returns 0, or -1 if out of memory.
+*/
+  uint8_t chunk[BATCH_CHUNK * BATCH_REGISTERS] = { 0 };
+  const uint8_t *payload, *previous = NULL;
+  uint32_t i, done;
+  int n, p = -1;
+
+  batch->method = batch_method == BATCH_AUTO || !batch_method_available(batch_method)
+                  ? batch_best_method() : batch_method;
+  batch->count = count;
+  batch->index = malloc((size_t) count * sizeof(uint32_t));
+  batch->changed = malloc((size_t) count * sizeof(uint32_t));
+  if (batch->index == NULL || batch->changed == NULL || batch_grow(batch) < 0) {
+    return -1;
+  }
+
+  for (done = 0; done < count; done += n) {
+    n = count - done < BATCH_CHUNK ? count - done : BATCH_CHUNK;
+    batch_run(batch, map, codes + done, n, chunk);
+    for (i = 0; i < (uint32_t) n; i++) {
+      payload = chunk + i * batch->stride;
+      if (p < 0) {
+        batch->changed[done + i] = (1ull << batch->registers) - 1;
+      }
+      else {
+        batch->changed[done + i] = batch_changed(batch, payload, previous);
+        if (batch->changed[done + i] == 0) {
+          batch->index[done + i] = p;           // the same as the last one
+          continue;
+        }
+      }
+      p = batch_find(batch, payload);
+      if (p < 0) {
+        return -1;
+      }
+      batch->index[done + i] = p;
+      previous = batch->payloads + (size_t) p * batch->stride;
+    }
+  }
+  return 0;
+}
+
+
+void batch_free(struct payload_batch *batch) {
+  free(batch->payloads);
+  free(batch->index);
+  free(batch->changed);
+  free(batch->slots);
+  batch->payloads = NULL;
+  batch->index = batch->changed = batch->slots = NULL;
+}
@@ -0,0 +1,423 @@
+/*
+  Benchmark suite - every way this project has (or could have) of getting
+  a code word to the chips, measured the same way on the same targets.
+
+  Strategies:
+
+  i2cset    - system("i2cset ...") per register, like system-calls.c
+              (only on a kernel bus, and only if i2cset is installed)
+  single    - one write() per register, like simple-on-off.c used to
+  gated     - the interface.c path: wait for the input edge (simulated),
+              then write - so this one includes the edge wakeup
+  burst     - one sequential write per chip
+  rdwr      - all chips in one I2C_RDWR ioctl
+  smbus     - one SMBus "I2C block write" ioctl per chip
+  auto      - whichever of the above the adapter does best, as picked
+              by devices.c when the bus is opened
+
+  Targets:
+
+  sim       - simulated chips on a 400 kHz bus (see bus.c)
+  stub      - the kernel's i2c-stub module, if it's loaded:
+              sudo modprobe i2c-stub chip_addr=0x20,0x21
+              The bus is found by its name in /sys/bus/i2c/devices,
+              or given with MCP23017_STUB (e.g. MCP23017_STUB=11).
+
+  An update is a code word followed by all_off(), with the shadow register
+  cache off - so every strategy sends the same registers. For each one
+  the suite reports updates per second, syscalls, I2C messages, payload
+  bytes and bus clocks per update, and percentiles of the update time.
+
+  The results go to standard output as a table, and as JSON to a file
+  if one is given - to keep and compare between releases:
+
+  gcc benchmark-suite.c -o benchmark-suite -lpthread
+  ./benchmark-suite [updates] [results.json]
+*/
+
+#include "./interface.c"
+
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+
+#define SUITE_UPDATES 2000
+#define SUITE_SIM "sim:400k"
+
+struct suite_result {
+  char target[64];
+  const char *strategy;
+  const char *skipped;          // why it wasn't run, or NULL
+  char method[16];              // the write mode that was used
+  int updates;
+  double updates_per_s;
+  double syscalls, messages, bytes, wire_bits, wire_us;   // per update
+  double p50, p90, p99, p999, max;                        // update time, us
+};
+
+#define SUITE_RESULTS 32
+
+struct suite_result results[SUITE_RESULTS];
+int result_count;
+struct latency update_time;
+
+// For the gated strategy - the generator thread plays the input:
+atomic_int gated_done;
+int gated_updates;
+
+
+struct suite_result *new_result(const char *target, const char *strategy) {
+  struct suite_result *result = &results[result_count++];
+
+  memset(result, 0, sizeof(*result));
+  snprintf(result->target, sizeof(result->target), "%s", target);
+  result->strategy = strategy;
+  return result;
+}
+
+
+int find_stub(char *spec, int size) {
+// Find the i2c-stub bus: MCP23017_STUB, or the adapter named "SMBus stub driver"
+  const char *setting = getenv("MCP23017_STUB");
+  char path[300], name[64];
+  struct dirent *entry;
+  FILE *file;
+  DIR *dir;
+  int found = 0;
+
+  if (setting != NULL && *setting) {
+    snprintf(spec, size, "stub:%s", setting);
+    return 1;
+  }
+  dir = opendir("/sys/bus/i2c/devices");
+  if (dir == NULL) {
+    return 0;
+  }
+  while (!found && (entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "i2c-", 4) != 0) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/sys/bus/i2c/devices/%s/name", entry->d_name);
+    file = fopen(path, "r");
+    if (file == NULL) {
+      continue;
+    }
+    if (fgets(name, sizeof(name), file) && strncmp(name, "SMBus stub driver", 17) == 0) {
+      snprintf(spec, size, "stub:%s", entry->d_name + 4);
+      found = 1;
+    }
+    fclose(file);
+  }
+  closedir(dir);
+  return found;
+}
+
+
+void make_word(int i, uint8_t *word) {
+// The same code words for everybody: one or two bytes of four turned on
+  memset(word, 0, 4);
+  word[i % 4] = 1 << (i % 8);
+  if (i % 3 == 0) {
+    word[(i + 1) % 4] = 0x80 >> (i % 8);
+  }
+}
+
+
+void finish_result(struct suite_result *result, int updates, uint64_t elapsed) {
+// Fill in the rates and percentiles from the bus statistics and update_time
+  struct bus_stats stats;
+
+  devices_stats(&stats);
+  result->updates = updates;
+  result->updates_per_s = updates * 1e9 / elapsed;
+  result->syscalls = (double) stats.syscalls / updates;
+  result->messages = (double) stats.messages / updates;
+  result->bytes = (double) stats.bytes / updates;
+  result->wire_bits = (double) stats.wire_bits / updates;
+  result->wire_us = stats.wire_ns / 1e3 / updates;
+  result->max = update_time.max / 1e3;
+  result->p50 = latency_percentile(&update_time, 50) / 1e3;
+  result->p90 = latency_percentile(&update_time, 90) / 1e3;
+  result->p99 = latency_percentile(&update_time, 99) / 1e3;
+  result->p999 = latency_percentile(&update_time, 99.9) / 1e3;
+}
+
+
+void reset_measurement(void) {
+  devices_reset_stats();
+  update_time.count = 0;
+  update_time.min = UINT64_MAX;
+  update_time.max = update_time.sum = 0;
+}
+
+
+void run_writes(struct suite_result *result, int mode, int updates) {
+// single, burst, rdwr, smbus: set_outputs() and all_off() in a write mode
+  uint8_t word[4];
+  uint64_t start, begin;
+  int i;
+
+  write_mode = mode;
+  shadow_enabled = 0;
+  snprintf(result->method, sizeof(result->method), "%s", devices_write_method(0));
+  reset_measurement();
+
+  start = monotonic_ns();
+  for (i = 0; i < updates; i++) {
+    make_word(i, word);
+    begin = monotonic_ns();
+    set_outputs(word[0], word[1], word[2], word[3]);
+    all_off();
+    latency_add(&update_time, monotonic_ns() - begin);
+  }
+  finish_result(result, updates, monotonic_ns() - start);
+}
+
+
+int i2cset_write(int bus_number, int address, int reg, int value) {
+  char command[64];
+  int status;
+
+  snprintf(command, sizeof(command), "i2cset -y %d %d %d %d", bus_number, address, reg, value);
+  status = system(command);
+  return status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ? -1 : 0;
+}
+
+
+void run_i2cset(struct suite_result *result, const char *device, int updates) {
+/*
+  A shell and an i2cset process per register - eight per update.
+  The syscalls and bytes are counted as i2cset would make them:
+  one ioctl for the address and one write per register.
+*/
+  static const int addresses[2] = { MCP0_ADDR, MCP1_ADDR };
+  uint8_t word[4];
+  uint64_t start, begin;
+  int bus_number, i, c, bank, value;
+  struct bus_stats *stats = &devices.bus[0].bus.stats;
+  unsigned long bits;
+  struct i2c_msg message = { 0, 0, 2, NULL };
+
+  if (strncmp(device, "/dev/i2c-", 9) != 0 || system("command -v i2cset > /dev/null 2>&1") != 0) {
+    result->skipped = "i2cset not installed";
+    return;
+  }
+  bus_number = atoi(device + 9);
+  reset_measurement();
+
+  start = monotonic_ns();
+  for (i = 0; i < updates; i++) {
+    make_word(i, word);
+    begin = monotonic_ns();
+    for (value = 0; value < 2; value++) {
+      for (c = 0; c < 2; c++) {
+        for (bank = 0; bank < 2; bank++) {
+          if (i2cset_write(bus_number, addresses[c], GPIOA + bank, value ? 0 : word[2 * c + bank]) < 0) {
+            result->skipped = "i2cset failed";
+            return;
+          }
+          stats->syscalls += 2;
+          stats->messages++;
+          stats->bytes += 2;
+          stats->wire_ns += transfer_ns(&devices.bus[0].bus, &message, 1, &bits);
+          stats->wire_bits += bits;
+        }
+      }
+    }
+    latency_add(&update_time, monotonic_ns() - begin);
+  }
+  finish_result(result, updates, monotonic_ns() - start);
+}
+
+
+void *gated_input(void *nothing) {
+// The "machine": an on-off cycle as soon as the previous one has been answered
+  int i;
+
+  for (i = 0; i < gated_updates; i++) {
+    edge_inject(&edge, 1);
+    edge_inject(&edge, 0);
+    while (atomic_load(&gated_done) <= i) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+
+void run_gated(struct suite_result *result, int updates) {
+/*
+  The send_codes() loop, fed by simulated edges: wait for the rising edge,
+  set the outputs, wait for the falling edge, turn them off. The update
+  time runs from the rising edge's timestamp to the outputs being off,
+  so it includes waking up on the edge.
+*/
+  struct edge_event event;
+  pthread_t generator;
+  uint8_t word[4];
+  uint64_t start, rising_ns;
+  int i, failed = 0;
+
+  write_mode = WRITE_AUTO;
+  shadow_enabled = 0;
+  snprintf(result->method, sizeof(result->method), "%s", devices_write_method(0));
+  edge.debounce_ns = 0;
+  if (edge_open(&edge, "sim") < 0) {
+    result->skipped = "no simulated edge source";
+    return;
+  }
+  reset_measurement();
+  gated_updates = updates;
+  atomic_store(&gated_done, 0);
+
+  start = monotonic_ns();
+  pthread_create(&generator, NULL, gated_input, NULL);
+  for (i = 0; i < updates; i++) {
+    make_word(i, word);
+    do {
+      failed = wait_for_edge(&event) < 0;
+    } while (!failed && !event.rising);
+    if (!failed) {
+      rising_ns = event.timestamp_ns;
+      set_outputs(word[0], word[1], word[2], word[3]);
+      failed = wait_for_edge(&event) < 0;
+    }
+    all_off();
+    if (failed) {
+// Let the generator go, and don't count a run that didn't happen:
+      atomic_store(&gated_done, updates);
+      pthread_join(generator, NULL);
+      edge_close(&edge);
+      result->skipped = "the simulated edge source failed";
+      return;
+    }
+    latency_add(&update_time, monotonic_ns() - rising_ns);
+    atomic_fetch_add(&gated_done, 1);
+  }
+  pthread_join(generator, NULL);
+  finish_result(result, updates, monotonic_ns() - start);
+  edge_close(&edge);
+}
+
+
+void run_target(const char *spec, int updates) {
+// All the strategies on one bus, with the chips at 0x20 and 0x21
+  static const int modes[] = { WRITE_SINGLE, WRITE_BURST, WRITE_RDWR, WRITE_SMBUS };
+  static const char *names[] = { "single", "burst", "rdwr", "smbus" };
+  char table[128];
+  int m;
+
+  devices_close();
+  snprintf(table, sizeof(table), "%s@0x20,0x21", spec);
+  if (devices_configure(table) < 0 || mcp_init() < 0) {
+    new_result(spec, "all")->skipped = "can't open the bus";
+    devices_close();
+    return;
+  }
+
+  if (devices.bus[0].bus.backend == &sim_backend) {
+    new_result(spec, "i2cset")->skipped = "needs a kernel bus";
+  }
+  else {
+    run_i2cset(new_result(spec, "i2cset"), devices.bus[0].bus.device, updates / 20 + 1);
+  }
+  for (m = 0; m < 4; m++) {
+    run_writes(new_result(spec, names[m]), modes[m], updates);
+  }
+  run_writes(new_result(spec, "auto"), WRITE_AUTO, updates);
+  run_gated(new_result(spec, "gated"), updates);
+  all_off();
+}
+
+
+void print_results(FILE *out) {
+  struct suite_result *r;
+  int i;
+
+  fprintf(out, "%-12s %-7s %10s %9s %9s %8s %9s %9s %9s %9s %9s\n",
+          "target", "mode", "updates/s", "syscalls", "messages", "bytes",
+          "clocks", "p50 us", "p99 us", "p99.9 us", "max us");
+  for (i = 0; i < result_count; i++) {
+    r = &results[i];
+    if (r->skipped) {
+      fprintf(out, "%-12s %-7s skipped: %s\n", r->target, r->strategy, r->skipped);
+      continue;
+    }
+    fprintf(out, "%-12s %-7s %10.1f %9.2f %9.2f %8.2f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+            r->target, r->strategy, r->updates_per_s, r->syscalls, r->messages, r->bytes,
+            r->wire_bits, r->p50, r->p99, r->p999, r->max);
+  }
+}
+
+
+void write_json(FILE *out) {
+// One object per run - strategies that were skipped say why
+  struct suite_result *r;
+  struct utsname system;
+  int i;
+
+  uname(&system);
+  fprintf(out, "{\n  \"suite\": \"mcp23017\",\n  \"version\": 1,\n");
+  fprintf(out, "  \"time\": %ld,\n  \"host\": \"%s\",\n  \"kernel\": \"%s\",\n  \"machine\": \"%s\",\n",
+          (long) time(NULL), system.nodename, system.release, system.machine);
+  fprintf(out, "  \"cache\": false,\n  \"results\": [\n");
+  for (i = 0; i < result_count; i++) {
+    r = &results[i];
+    fprintf(out, "    {\"target\": \"%s\", \"strategy\": \"%s\", ", r->target, r->strategy);
+    if (r->method[0]) {
+      fprintf(out, "\"method\": \"%s\", ", r->method);
+    }
+    if (r->skipped) {
+      fprintf(out, "\"skipped\": \"%s\"}", r->skipped);
+    }
+    else {
+      fprintf(out, "\"updates\": %d, \"updates_per_s\": %.1f, "
+              "\"syscalls_per_update\": %.3f, \"messages_per_update\": %.3f, "
+              "\"bytes_per_update\": %.3f, \"wire_clocks_per_update\": %.1f, \"wire_us_per_update\": %.2f, "
+              "\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}}",
+              r->updates, r->updates_per_s, r->syscalls, r->messages, r->bytes, r->wire_bits, r->wire_us,
+              r->p50, r->p90, r->p99, r->p999, r->max);
+    }
+    fprintf(out, "%s\n", i + 1 < result_count ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+}
+
+
+int main(int argc, char **argv) {
+  char stub[64];
+  FILE *json;
+  int updates = SUITE_UPDATES;
+
+  if (argc > 1) {
+    updates = atoi(argv[1]);
+  }
+  if (updates <= 0 || argc > 3) {
+    fprintf(stderr, "usage: %s [updates] [results.json]\n", argv[0]);
+    return 1;
+  }
+  if (latency_init(&update_time, updates) < 0) {
+    perror("latency_init");
+    return 1;
+  }
+
+  run_target(SUITE_SIM, updates);
+  if (find_stub(stub, sizeof(stub))) {
+    run_target(stub, updates);
+  }
+  else {
+    new_result("stub", "all")->skipped = "i2c-stub not loaded";
+  }
+
+  print_results(stdout);
+  if (argc > 2) {
+    json = fopen(argv[2], "w");
+    if (json == NULL) {
+      perror(argv[2]);
+      return 1;
+    }
+    write_json(json);
+    fclose(json);
+  }
+  return 0;
+}
@@ -0,0 +1,1369 @@
+/*
+  Benchmark for the output paths in interface.c.
+
+  It initializes the chips, then sends a number of code words
+  (alternating with all_off, just like a real on-off cycle does)
+  in each of the write modes, with the shadow register cache
+  turned off and on, and reports:
+
+  - wall-clock time per update (one code word and all_off),
+  - syscalls per update,
+  - I2C messages and bytes per update,
+  - register writes elided by the cache per update,
+  - time on wire per update at the bus clock speed.
+
+  Like in real jobs, each code word turns on one or two of the four bytes.
+
+  Run it on a Raspberry Pi with the chips attached, just like the demos:
+
+  gcc benchmark.c -o benchmark
+  ./benchmark [number_of_updates]
+
+  or anywhere else, with simulated chips (see bus.c):
+
+  MCP23017_BUS=sim:400k ./benchmark
+
+  "benchmark buses" measures how the update rate scales with the number
+  of buses: 1, 2 and 4 buses with 8 chips each, every chip changing on
+  every update. Each bus is written by its own thread (see devices.c).
+  The buses are simulated at 400 kHz unless another bus spec is given:
+
+  ./benchmark buses [number_of_updates] [bus_spec]
+
+  "benchmark verify" measures what error checking costs: code words and
+  all_off in WRITE_RDWR mode with the cache on, reading the outputs back
+  never, every 16th and every update (see verify_every in devices.c).
+  By default the bus is simulated and troubled: every 200th transfer
+  fails, and chip 0x21 suffers a brown-out reset every 1000 updates.
+  The retries and the readback put all that right - the report shows
+  how much of it there was and what it took:
+
+  ./benchmark verify [number_of_updates] [bus_spec]
+
+  "benchmark startup" measures how long mcp_init() takes to set up
+  2, 8 and 16 simulated chips (16 - on two buses), done the usual way
+  ("cold") and with warm attach (see devices.c):
+
+  power-on - the chips are fresh from reset, all pins inputs
+  restart  - a program has set the chips up, turned some outputs on
+             and gone; the next one starts
+
+  and how many output ports changed on the way (cold init turns
+  everything off; warm attach should leave it all alone):
+
+  ./benchmark startup
+
+  "benchmark pinmap" measures how fast code words are translated from
+  logical signals to register values (see pinmap.c): the compiled pin map
+  against the obvious loop over the signals, for the default map, one with
+  the chips swapped, and two wirings that are all over the place. No bus
+  is involved:
+
+  ./benchmark pinmap [number_of_words]
+
+  "benchmark batch" translates a whole job at once (see batch.c), with
+  every translator this CPU can run: words/s for the translation alone,
+  and with the payloads deduplicated and the changed banks marked:
+
+  ./benchmark batch [number_of_words]
+
+  "benchmark skew" measures how far apart the outputs of an update change
+  - from the first output to the last, as the simulated chips see it,
+  with every output changing every time: two chips written a register at
+  a time, a chip at a time and in one transaction, then 8 chips on 1, 2
+  and 4 buses - normally and in low skew mode (see devices.c). At 100 kHz
+  and 400 kHz, unless another bus spec is given (it has to be sim):
+
+  ./benchmark skew [number_of_updates] [bus_spec]
+
+  "benchmark cycles" runs the output loop (send_word(), with a different
+  word every cycle) off a free-running timer instead of a machine (see
+  the timer edge source in edge.c), and ramps the rate up - by a quarter
+  each step - until more than one cycle in a hundred goes wrong, three
+  tries out of three: a deadline is missed, a word isn't written, or
+  isn't all out before the input turns off again. (Without real-time
+  mode, the odd stall of the machine will do that; with it, on a Pi,
+  expect nothing to go wrong below the highest rate.)
+  For every bus it reports the highest rate without any of that, and the
+  timer's jitter there (deadline to wake-up) and edge-to-last-byte
+  latency. Two chips on simulated buses at 100 kHz, 400 kHz and 1 MHz
+  and one that doesn't wait for the transfers (the CPU alone) - or on
+  the buses given; an i2c-stub bus too, if MCP23017_STUB gives its number:
+
+  ./benchmark cycles [duty_percent] [bus_spec...]
+
+  "benchmark trace" measures what tracing costs (see trace.c): a single
+  event recorded with tracing off and on, then updates on two simulated
+  chips without and with it - and writes the trace of those updates out,
+  to open in https://ui.perfetto.dev:
+
+  ./benchmark trace [number_of_updates] [file.json]
+
+  "benchmark record" does the same for the recorder (see record.c):
+  a 3-byte register write recorded with recording off and on, then the
+  updates without and with it - the recording is left in the file:
+
+  ./benchmark record [number_of_updates] [file]
+
+  "benchmark uring" compares a write() per register and per chip with
+  all of an update's chip writes submitted through io_uring at once
+  (WRITE_URING, see devices.c): syscalls, wall-clock and CPU time per
+  update, every chip changing every time, on 2 and 8 chips whose file
+  descriptors are pipes or files (the mock bus, see bus.c) - and on an
+  i2c-stub bus too, if MCP23017_STUB gives its number:
+
+  ./benchmark uring [number_of_updates]
+
+  "benchmark pins" has 1, 4 and 8 threads turning outputs on and off,
+  each its own four, a change every 50 us or so (see the pin API at the
+  end of interface.c): with a lock around the outputs and an update for
+  every change, then with the atomic changes and a flusher thread writing
+  them out - a deadline after the first change, and on every rising edge
+  of a simulated 1 ms machine cycle. It reports changes/s, I2C messages
+  per change and how many changes each flush took along - and checks
+  that the outputs ended up as the last changes left them. A deadline of
+  0 runs the per-cycle flusher alone. Two chips on a simulated 400 kHz
+  bus, unless another bus spec is given:
+
+  ./benchmark pins [changes_per_thread] [deadline_us] [bus_spec]
+
+  "benchmark interfaces" runs 1, 8 and 32 interfaces - each with its own
+  simulated input and two chips on a bus of its own - from one thread
+  with an epoll loop (see eventloop.c). All the inputs turn on and off
+  together, every cycle_us: the worst case. It reports the cycles served,
+  the loop thread's CPU time, and edge-to-last-byte latency over all the
+  interfaces. The buses don't wait for the simulated transfers unless
+  another bus spec is given:
+
+  ./benchmark interfaces [cycles] [cycle_us] [bus_spec]
+*/
+
+#include "./interface.c"
+
+static const char *mode_names[] = { "single", "burst", "rdwr", "smbus" };
+
+
+void run_mode(int mode, int cache, int updates) {
+  uint8_t word[4];
+  uint64_t start, elapsed;
+  struct bus_stats stats;
+  int i;
+
+  write_mode = mode;
+  shadow_enabled = cache;
+  shadow_invalidate();
+  all_off();
+  devices_reset_stats();
+
+  start = monotonic_ns();
+  for (i = 0; i < updates; i++) {
+    memset(word, 0, sizeof(word));
+    word[i % 4] = 1 << (i % 8);
+    if (i % 3 == 0) {
+      word[(i + 1) % 4] = 0x80 >> (i % 8);
+    }
+    set_outputs(word[0], word[1], word[2], word[3]);
+    all_off();
+  }
+  elapsed = monotonic_ns() - start;
+  devices_stats(&stats);
+
+  printf("%-8s %-5s %10.2f %10.2f %10.2f %10.2f %10.2f %10.1f\n",
+         mode_names[mode],
+         cache ? "on" : "off",
+         elapsed / 1e3 / updates,
+         (double) stats.syscalls / updates,
+         (double) stats.messages / updates,
+         (double) stats.bytes / updates,
+         (double) stats.elided / updates,
+         stats.wire_ns / 1e3 / updates);
+}
+
+
+void run_buses(int buses, const char *bus_spec, int updates) {
+// Updates per second with a number of full buses, 8 chips each
+  static struct output_word word;
+  char table[512] = "";
+  uint64_t start, elapsed;
+  int b, c, i;
+
+  devices_close();
+  for (b = 0; b < buses; b++) {
+    snprintf(table + strlen(table), sizeof(table) - strlen(table), "%s%s@0x20-0x27",
+             b ? ";" : "", bus_spec);
+  }
+  if (devices_configure(table) < 0 || mcp_init() < 0) {
+    exit(1);
+  }
+
+  start = monotonic_ns();
+  for (i = 0; i < updates; i++) {
+    for (c = 0; c < devices.chips; c++) {
+      word.value[c][0] = i + c;
+      word.value[c][1] = ~(i + c);
+    }
+    set_outputs_word(&word);
+  }
+  elapsed = monotonic_ns() - start;
+
+  printf("%5d %6d %12.1f %14.1f %12.2f\n", buses, devices.chips,
+         updates * 1e9 / elapsed,
+         (double) updates * devices.chips * 1e9 / elapsed,
+         elapsed / 1e3 / updates);
+}
+
+
+void run_skew(const char *name, const char *bus_spec, int buses, int chips, int mode, int skew, int updates) {
+// First to last output change of every update, and how long until the last one
+  static struct output_word word;
+  struct latency spread, last;
+  struct mcp23017_model *sim;
+  char table[512] = "";
+  uint64_t start, first_ns, last_ns;
+  int b, c, i, bank;
+
+  devices_close();
+  for (b = 0; b < buses; b++) {
+    snprintf(table + strlen(table), sizeof(table) - strlen(table), "%s%s@0x20-0x%02x",
+             b ? ";" : "", bus_spec, 0x20 + chips / buses - 1);
+  }
+  write_mode = WRITE_AUTO;
+  low_skew = 0;
+  if (devices_configure(table) < 0 || mcp_init() < 0) {
+    exit(1);
+  }
+  write_mode = mode;
+  low_skew = skew;
+  latency_init(&spread, updates);
+  latency_init(&last, updates);
+
+  for (i = 0; i < updates; i++) {
+    for (c = 0; c < devices.chips; c++) {
+      word.value[c][0] = i + c;
+      word.value[c][1] = ~(i + c);
+    }
+    start = monotonic_ns();
+    set_outputs_word(&word);
+    first_ns = UINT64_MAX;
+    last_ns = 0;
+    for (b = 0; b < devices.buses; b++) {
+      for (c = 0; c < devices.bus[b].chips; c++) {
+        sim = &devices.bus[b].bus.sim[devices.bus[b].chip[c].address - SIM_FIRST_ADDR];
+        for (bank = 0; bank < 2; bank++) {
+          if (sim->changed_ns[bank] >= start && sim->changed_ns[bank] < first_ns) {
+            first_ns = sim->changed_ns[bank];
+          }
+          if (sim->changed_ns[bank] >= start && sim->changed_ns[bank] > last_ns) {
+            last_ns = sim->changed_ns[bank];
+          }
+        }
+      }
+    }
+    if (last_ns) {
+      latency_add(&spread, last_ns - first_ns);
+      latency_add(&last, last_ns - start);
+    }
+  }
+
+  printf("%-22s %5d %5d %10.1f %10.1f %10.1f %10.1f\n", name, buses, devices.chips,
+         latency_percentile(&spread, 50) / 1e3, latency_percentile(&spread, 99) / 1e3,
+         spread.max / 1e3, (double) last.sum / last.count / 1e3);
+  free(spread.samples);
+  free(last.samples);
+  write_mode = WRITE_AUTO;
+  low_skew = 0;
+}
+
+
+struct cycles_result {
+  double rate;
+  unsigned long missed, lost, late;
+  uint64_t jitter_p50, jitter_p99, jitter_max, latency_p99;
+};
+
+
+int run_cycles_at(double rate, int duty, int cycles, struct cycles_result *result) {
+// Cycles at this rate off the timer - returns 1 if no more than one in a hundred went wrong
+  static struct output_word word;
+  char spec[64];
+  uint64_t on_ns;
+  unsigned long i, kept;
+
+  edge_close(&edge);
+  snprintf(spec, sizeof(spec), "timer:%g:%d", rate, duty);
+  if (edge_open(&edge, spec) < 0) {
+    exit(1);
+  }
+  on_ns = edge.on_ns;
+  free(wakeup_latency.samples);
+  free(output_latency.samples);
+  latency_init(&wakeup_latency, cycles * 2);
+  latency_init(&output_latency, cycles);
+
+  for (i = 0; i < (unsigned long) cycles; i++) {
+    word.value[0][0] = i;
+    word.value[0][1] = ~i;
+    word.value[1][0] = i >> 8;
+    word.value[1][1] = 1 << (i % 8);
+    send_word(&word);
+  }
+
+  result->rate = rate;
+  result->missed = edge.missed;
+  result->lost = cycles - output_latency.count;
+  result->late = 0;
+  kept = output_latency.count < output_latency.capacity ? output_latency.count : output_latency.capacity;
+  for (i = 0; i < kept; i++) {
+    result->late += output_latency.samples[i] >= on_ns;
+  }
+  result->jitter_p50 = latency_percentile(&wakeup_latency, 50);
+  result->jitter_p99 = latency_percentile(&wakeup_latency, 99);
+  result->jitter_max = wakeup_latency.max;
+  result->latency_p99 = latency_percentile(&output_latency, 99);
+  return (result->missed + result->lost + result->late) * 100 <= (unsigned long) cycles;
+}
+
+
+void run_cycles(const char *bus_spec, int duty) {
+// Ramp the rate up until a cycle goes wrong, on two chips on this bus
+  struct cycles_result result, best;
+  char table[128];
+  double rate;
+  int cycles, tries;
+
+  devices_close();
+  snprintf(table, sizeof(table), "%s@0x20,0x21", bus_spec);
+  if (devices_configure(table) < 0 || mcp_init() < 0) {
+    exit(1);
+  }
+  memset(&best, 0, sizeof(best));
+  for (rate = 100; rate <= 200000; rate *= 1.25) {
+/*
+    Half a second's worth at each rate - no fewer than 200 cycles, no more
+    than 5000 - best of three tries. A machine that isn't real-time stalls
+    for milliseconds once in a while, whatever the rate: that's what the
+    one cycle in a hundred allowed to go wrong is for.
+*/
+    cycles = rate / 2 < 200 ? 200 : rate / 2 > 5000 ? 5000 : rate / 2;
+    for (tries = 0; tries < 3 && !run_cycles_at(rate, duty, cycles, &result); tries++) {
+    }
+    if (tries == 3) {
+      break;
+    }
+    best = result;
+  }
+  printf("%-18s %10.0f %8.1f %8.1f %8.1f %10.1f   %.0f/s: %lu missed, %lu not written, %lu late\n",
+         bus_spec, best.rate, best.jitter_p50 / 1e3, best.jitter_p99 / 1e3, best.jitter_max / 1e3,
+         best.latency_p99 / 1e3, result.rate, result.missed, result.lost, result.late);
+}
+
+
+void run_verify(int every, const char *bus_spec, int updates) {
+// Update cost with readback every Nth update, on a bus that makes mistakes
+  char table[256];
+  uint64_t start, elapsed;
+  struct bus_stats stats;
+  unsigned long mismatches = 0;
+  int c, i;
+
+  devices_close();
+  snprintf(table, sizeof(table), "%s@0x20,0x21", bus_spec);
+  if (devices_configure(table) < 0 || mcp_init() < 0) {
+    exit(1);
+  }
+  write_mode = WRITE_RDWR;
+  shadow_enabled = 1;
+  verify_every = every;
+  devices_reset_stats();
+
+  start = monotonic_ns();
+  for (i = 0; i < updates; i++) {
+    if (devices.bus[0].bus.sim != NULL && i % 1000 == 999) {
+      sim_reset(&devices.bus[0].bus.sim[1]);    // chip 0x21 browns out
+    }
+    set_outputs(1 << (i % 8), 0, i & 0x10 ? 0x80 >> (i % 8) : 0, 0);
+    all_off();
+  }
+  elapsed = monotonic_ns() - start;
+  devices_stats(&stats);
+  for (c = 0; c < devices.bus[0].chips; c++) {
+    mismatches += devices.bus[0].chip[c].mismatches;
+  }
+
+  printf("%-6s %10.2f %10.1f %8lu %8lu %8lu %10lu\n",
+         every ? (every == 1 ? "all" : "1/16") : "never",
+         elapsed / 1e3 / updates, stats.wire_ns / 1e3 / updates,
+         stats.errors, stats.retries, stats.failures, mismatches);
+  verify_every = 0;
+}
+
+
+struct startup_result {
+  double us;                            // mcp_init() time
+  struct bus_stats stats;
+  int changed;                          // output ports that changed during mcp_init()
+};
+
+
+void startup_once(const char *table, int warm, int restart, struct startup_result *result) {
+/*
+  Time mcp_init() on simulated chips. For a restart, the chips are set up
+  and some outputs turned on first; the buses are then closed and opened
+  again, and the chips' state carried over - like chips that stay powered
+  while programs come and go.
+*/
+  static struct mcp23017_model saved[MAX_BUSES][SIM_CHIPS];
+  static struct output_word word;
+  uint64_t before[MAX_BUSES][SIM_CHIPS][2];
+  uint64_t start;
+  int b, i, c, bank;
+
+  devices_close();
+  if (devices_configure(table) < 0) {
+    exit(1);
+  }
+  if (restart) {
+    warm_attach = 0;
+    if (mcp_init() < 0) {
+      exit(1);
+    }
+    for (c = 0; c < devices.chips; c++) {
+      word.value[c][0] = 0x11 << (c % 4);
+      word.value[c][1] = c & 1 ? 0x80 : 0;
+    }
+    set_outputs_word(&word);
+    for (b = 0; b < devices.buses; b++) {
+      memcpy(saved[b], devices.bus[b].bus.sim, sizeof(saved[b]));
+    }
+    devices_close();
+    devices_configure(table);
+  }
+  if (devices_open() < 0) {
+    exit(1);
+  }
+  for (b = 0; b < devices.buses; b++) {
+    if (restart) {
+      memcpy(devices.bus[b].bus.sim, saved[b], sizeof(saved[b]));
+    }
+    for (i = 0; i < SIM_CHIPS; i++) {
+      for (bank = 0; bank < 2; bank++) {
+        before[b][i][bank] = devices.bus[b].bus.sim[i].changed_ns[bank];
+      }
+    }
+  }
+  devices_reset_stats();
+  warm_attach = warm;
+
+  start = monotonic_ns();
+  if (mcp_init() < 0) {
+    exit(1);
+  }
+  result->us = (monotonic_ns() - start) / 1e3;
+  devices_stats(&result->stats);
+
+  result->changed = 0;
+  for (b = 0; b < devices.buses; b++) {
+    for (i = 0; i < SIM_CHIPS; i++) {
+      for (bank = 0; bank < 2; bank++) {
+        result->changed += devices.bus[b].bus.sim[i].changed_ns[bank] != before[b][i][bank];
+      }
+    }
+  }
+  warm_attach = 0;
+}
+
+
+void run_startup(const char *table) {
+// Cold and warm, from power-on and on a restart, best of a few tries
+  static const char *scenarios[] = { "power-on", "restart" };
+  struct startup_result result, best;
+  int restart, warm, i;
+
+  for (restart = 0; restart < 2; restart++) {
+    for (warm = 0; warm < 2; warm++) {
+      memset(&best, 0, sizeof(best));
+      best.us = 1e12;
+      for (i = 0; i < 5; i++) {
+        startup_once(table, warm, restart, &result);
+        if (result.us < best.us) {
+          best = result;
+        }
+      }
+      printf("%6d %-9s %-5s %10.1f %9lu %9lu %9lu %9d\n",
+             devices.chips, scenarios[restart], warm ? "warm" : "cold", best.us,
+             best.stats.syscalls, best.stats.messages, best.stats.bytes, best.changed);
+    }
+  }
+}
+
+
+void pinmap_by_bits(const struct pin_map *map, uint32_t code, struct output_word *word) {
+// The naive way, for comparison: look at every signal
+  uint8_t *out = &word->value[0][0];
+  int signal, output;
+
+  for (signal = 0; signal < PINMAP_SIGNALS; signal++) {
+    output = map->output[signal];
+    if (output == PINMAP_UNUSED) {
+      continue;
+    }
+    if (code & (1u << signal)) {
+      out[output / 8] |= 1 << (output % 8);
+    }
+    else {
+      out[output / 8] &= ~(1 << (output % 8));
+    }
+  }
+}
+
+
+void run_pinmap(const char *name, const char *spec, const uint32_t *codes, int words) {
+// Translate the codes both ways, check they agree, and time them
+  static struct output_word compiled, naive;
+  static struct pin_map map;
+  uint64_t start, compiled_ns, naive_ns;
+  unsigned int sum = 0;
+  int i, c;
+
+  memset(&compiled, 0, sizeof(compiled));
+  memset(&naive, 0, sizeof(naive));
+  if (spec == NULL) {
+    pinmap_default(&map);
+  }
+  else if (pinmap_parse(&map, spec) < 0) {
+    exit(1);
+  }
+  pinmap_compile(&map);
+
+  for (i = 0; i < words; i++) {
+    pinmap_translate(&map, codes[i], &compiled);
+    pinmap_by_bits(&map, codes[i], &naive);
+    if (memcmp(&compiled, &naive, sizeof(compiled)) != 0) {
+      fprintf(stderr, "%s: code 0x%08x translated wrong\n", name, codes[i]);
+      exit(1);
+    }
+  }
+
+  start = monotonic_ns();
+  for (i = 0; i < words; i++) {
+    pinmap_by_bits(&map, codes[i], &naive);
+    for (c = 0; c < map.chips; c++) {
+      sum += naive.value[c][0] + naive.value[c][1];
+    }
+  }
+  naive_ns = monotonic_ns() - start;
+
+  start = monotonic_ns();
+  for (i = 0; i < words; i++) {
+    pinmap_translate(&map, codes[i], &compiled);
+    for (c = 0; c < map.chips; c++) {
+      sum += compiled.value[c][0] + compiled.value[c][1];
+    }
+  }
+  compiled_ns = monotonic_ns() - start;
+
+  printf("%-10s %5d %5d %6d %12.2f %12.2f %12.1f %8.1fx  (%x)\n",
+         name, map.chips, map.steps, map.table_count,
+         (double) naive_ns / words, (double) compiled_ns / words,
+         words * 1e3 / compiled_ns, (double) naive_ns / compiled_ns, sum & 0xf);
+}
+
+
+uint32_t *ribbon_codes(int words) {
+// Like ribbon codes: one to three of the 31 signals on
+  uint32_t *codes, random = 2463534242u;
+  int i;
+
+  codes = malloc(words * sizeof(*codes));
+  if (codes == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for (i = 0; i < words; i++) {
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    codes[i] = 1u << (random % 31) | (random & 0x100 ? 1u << (random >> 9) % 31 : 0)
+               | (random & 0x200 ? 1u << (random >> 14) % 31 : 0);
+  }
+  return codes;
+}
+
+
+void run_batch(const char *name, const char *spec, const uint32_t *codes, int words) {
+// Every translator on the same job: check them against scalar, then time them
+  static struct pin_map map;
+  struct payload_batch batch, reference;
+  uint8_t *out, *expected;
+  uint64_t start, translate_ns, full_ns;
+  uint32_t changed;
+  int method, done, n, i, r;
+
+  if (spec == NULL) {
+    pinmap_default(&map);
+  }
+  else if (pinmap_parse(&map, spec) < 0) {
+    exit(1);
+  }
+  pinmap_compile(&map);
+
+  batch_prepare(&reference, &map);
+  reference.method = BATCH_SCALAR;
+  out = calloc(words, reference.stride);
+  expected = calloc(words, reference.stride);
+  if (out == NULL || expected == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  batch_run(&reference, &map, codes, words, expected);
+
+  for (method = BATCH_SCALAR; method <= BATCH_NEON; method++) {
+    if (!batch_method_available(method)) {
+      continue;
+    }
+    batch_prepare(&batch, &map);
+    batch.method = method;
+    start = monotonic_ns();
+    for (done = 0; done < words; done += n) {
+      n = words - done < BATCH_CHUNK ? words - done : BATCH_CHUNK;
+      batch_run(&batch, &map, codes + done, n, out + (size_t) done * batch.stride);
+    }
+    translate_ns = monotonic_ns() - start;
+    if (memcmp(out, expected, (size_t) words * batch.stride) != 0) {
+      fprintf(stderr, "%s, %s: translated wrong\n", name, batch_method_names[method]);
+      exit(1);
+    }
+
+    batch_method = method;
+    start = monotonic_ns();
+    if (batch_translate(&batch, &map, codes, words) < 0) {
+      perror("batch_translate");
+      exit(1);
+    }
+    full_ns = monotonic_ns() - start;
+    batch_method = BATCH_AUTO;
+    for (i = 0; i < words; i++) {
+      changed = 0;
+      for (r = 0; r < batch.registers; r++) {
+        changed |= (uint32_t) (i == 0 || expected[i * batch.stride + r] != expected[(i - 1) * batch.stride + r]) << r;
+      }
+      if (memcmp(batch.payloads + (size_t) batch.index[i] * batch.stride, expected + (size_t) i * batch.stride,
+                 batch.stride) != 0 || batch.changed[i] != changed) {
+        fprintf(stderr, "%s, %s: word %d staged wrong\n", name, batch_method_names[method], i);
+        exit(1);
+      }
+    }
+
+    printf("%-10s %-7s %9d %9.2f %12.1f %9.2f %12.1f %8u\n",
+           name, batch_method_names[method], batch.registers,
+           (double) translate_ns / words, words * 1e3 / translate_ns,
+           (double) full_ns / words, words * 1e3 / full_ns, batch.unique);
+    batch_free(&batch);
+  }
+  free(out);
+  free(expected);
+}
+
+
+void run_trace(int updates, const char *file) {
+// The cost of an event, and of tracing the updates - then the trace itself
+  static struct output_word word;
+  struct trace_ring *ring;
+  uint64_t start, off_ns, on_ns, update_ns[2];
+  unsigned long before;
+  int events = 10000000, enabled, i, count;
+
+  trace_enabled = 0;
+  start = monotonic_ns();
+  for (i = 0; i < events; i++) {
+    trace(TRACE_WAKEUP, i, 0);
+  }
+  off_ns = monotonic_ns() - start;
+
+  trace_enabled = 1;
+  ring = trace_thread();
+  if (ring == NULL) {
+    perror("trace_thread");
+    exit(1);
+  }
+  start = monotonic_ns();
+  for (i = 0; i < events; i++) {
+    trace(TRACE_WAKEUP, i, 0);
+  }
+  on_ns = monotonic_ns() - start;
+  printf("one event: %.2f ns with tracing off, %.2f ns with it on\n",
+         (double) off_ns / events, (double) on_ns / events);
+
+  devices_close();
+  if (devices_configure("sim:400k@0x20,0x21") < 0 || mcp_init() < 0) {
+    exit(1);
+  }
+  for (enabled = 0; enabled < 2; enabled++) {
+    trace_enabled = enabled;
+    atomic_store(&ring->head, 0);
+    before = atomic_load(&ring->head);
+    start = monotonic_ns();
+    for (i = 0; i < updates; i++) {
+      word.value[0][0] = 1 << (i % 8);
+      word.value[1][1] = i & 0x10 ? 0x80 >> (i % 8) : 0;
+      set_outputs_word(&word);
+      all_off();
+    }
+    update_ns[enabled] = monotonic_ns() - start;
+    printf("tracing %-3s %10.2f us/update %10.1f events/update\n", enabled ? "on" : "off",
+           update_ns[enabled] / 1e3 / updates, (double) (atomic_load(&ring->head) - before) / updates);
+  }
+  trace_enabled = 0;
+  printf("tracing adds %.2f%% to an update\n",
+         100.0 * ((double) update_ns[1] - update_ns[0]) / update_ns[0]);
+
+  count = trace_dump(file);
+  if (count < 0) {
+    perror(file);
+    exit(1);
+  }
+  printf("%d events written to %s\n", count, file);
+}
+
+
+void run_record(int updates, const char *file) {
+// The cost of recording a write message, and of recording the updates
+  static struct output_word word;
+  static const uint8_t message[3] = { GPIOA, 0x55, 0xaa };
+  uint64_t start, off_ns, on_ns, update_ns[2], before;
+  int messages = 1000000, enabled, i;
+
+  if (record_open(file, RECORD_DEFAULT_MB) < 0) {
+    perror(file);
+    exit(1);
+  }
+  atomic_store(&recorder.enabled, 0);
+  start = monotonic_ns();
+  for (i = 0; i < messages; i++) {
+    record_message(MCP0_ADDR, message, sizeof(message));
+  }
+  off_ns = monotonic_ns() - start;
+
+  atomic_store(&recorder.enabled, 1);
+  start = monotonic_ns();
+  for (i = 0; i < messages; i++) {
+    record_message(MCP0_ADDR, message, sizeof(message));
+  }
+  on_ns = monotonic_ns() - start;
+  printf("one 3-byte write: %.2f ns with recording off, %.2f ns with it on (first time through the pages)\n",
+         (double) off_ns / messages, (double) on_ns / messages);
+
+  devices_close();
+  if (devices_configure("sim:400k@0x20,0x21") < 0 || mcp_init() < 0) {
+    exit(1);
+  }
+  for (enabled = 0; enabled < 2; enabled++) {
+    atomic_store(&recorder.enabled, enabled);
+    atomic_store(&recorder.count, 0);
+    before = atomic_load(&recorder.count);
+    start = monotonic_ns();
+    for (i = 0; i < updates; i++) {
+      word.value[0][0] = 1 << (i % 8);
+      word.value[1][1] = i & 0x10 ? 0x80 >> (i % 8) : 0;
+      set_outputs_word(&word);
+      all_off();
+    }
+    update_ns[enabled] = monotonic_ns() - start;
+    printf("recording %-3s %10.2f us/update %10.1f records/update\n", enabled ? "on" : "off",
+           update_ns[enabled] / 1e3 / updates, (double) (atomic_load(&recorder.count) - before) / updates);
+  }
+  printf("recording adds %.2f%% to an update\n",
+         100.0 * ((double) update_ns[1] - update_ns[0]) / update_ns[0]);
+  record_close();
+  printf("%d updates recorded to %s\n", updates, file);
+}
+
+
+void run_uring(const char *name, const char *bus_spec, int chips, int mode, int updates) {
+// One bus, every chip written on every update - plain write()s or io_uring
+  static struct output_word word;
+  struct rusage usage_before, usage_after;
+  struct bus_stats stats;
+  char table[512];
+  uint64_t start, elapsed, cpu_us;
+  int c, i;
+
+  devices_close();
+  snprintf(table, sizeof(table), "%s@0x20-0x%02x", bus_spec, 0x20 + chips - 1);
+  write_mode = mode;
+  if (devices_configure(table) < 0 || mcp_init() < 0) {
+    exit(1);
+  }
+  devices_reset_stats();
+
+  getrusage(RUSAGE_SELF, &usage_before);
+  start = monotonic_ns();
+  for (i = 0; i < updates; i++) {
+    for (c = 0; c < devices.chips; c++) {
+      word.value[c][0] = i + c;
+      word.value[c][1] = ~(i + c);
+    }
+    set_outputs_word(&word);
+  }
+  elapsed = monotonic_ns() - start;
+  getrusage(RUSAGE_SELF, &usage_after);
+  devices_stats(&stats);
+  devices_close();
+  cpu_us = (usage_after.ru_utime.tv_sec - usage_before.ru_utime.tv_sec) * 1000000
+           + (usage_after.ru_stime.tv_sec - usage_before.ru_stime.tv_sec) * 1000000
+           + usage_after.ru_utime.tv_usec - usage_before.ru_utime.tv_usec
+           + usage_after.ru_stime.tv_usec - usage_before.ru_stime.tv_usec;
+
+  printf("%-6s %5d %-7s %10.2f %10.2f %10.2f %8lu\n", name, chips, write_mode_names[mode],
+         (double) stats.syscalls / updates, elapsed / 1e3 / updates, (double) cpu_us / updates,
+         stats.errors);
+  write_mode = WRITE_AUTO;
+}
+
+
+struct interfaces_run {
+  struct interface_context *contexts;
+  int count;
+  int cycles;                           // per interface
+  int cycle_us;
+  atomic_int running;
+};
+
+
+int counted_word(struct interface_context *context, struct output_word *word) {
+// The words for benchmark interfaces: a different one every cycle, cycles of them
+  struct interfaces_run *run = context->user;
+  unsigned long n = context->cycles;
+
+  if (n >= (unsigned long) run->cycles) {
+    return 0;
+  }
+  word->value[0][0] = 1 << (n % 8);
+  word->value[0][1] = n;
+  word->value[1][0] = 0x80 >> (n % 8);
+  word->value[1][1] = ~n;
+  return 1;
+}
+
+
+void *interfaces_generator(void *argument) {
+// All the machines, in step: inputs on for half a cycle, off for the other half
+  struct interfaces_run *run = argument;
+  struct timespec deadline;
+  int i, n;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  for (i = 0; atomic_load(&run->running); i++) {
+    deadline.tv_nsec += run->cycle_us * 500;
+    while (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_nsec -= 1000000000;
+      deadline.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    for (n = 0; n < run->count; n++) {
+      edge_inject(&run->contexts[n].edge, !(i & 1));
+    }
+  }
+  return NULL;
+}
+
+
+void run_interfaces(int count, int cycles, int cycle_us, const char *bus_spec) {
+// count interfaces, one thread: how far behind the edges does it get?
+  static const int addresses[2] = { 0x20, 0x21 };
+  struct interfaces_run run;
+  struct event_loop loop;
+  struct latency latency;
+  struct rusage usage_before, usage_after;
+  pthread_t generator;
+  uint64_t start, elapsed, cpu_us;
+  unsigned long served = 0;
+  int n;
+
+  run.contexts = calloc(count, sizeof(struct interface_context));
+  run.count = count;
+  run.cycles = cycles;
+  run.cycle_us = cycle_us;
+  atomic_init(&run.running, 1);
+  if (run.contexts == NULL || latency_init(&latency, (unsigned long) count * cycles) < 0
+      || loop_init(&loop) < 0) {
+    perror("run_interfaces");
+    exit(1);
+  }
+  for (n = 0; n < count; n++) {
+    run.contexts[n].edge.debounce_ns = cycle_us * 250;
+    if (interface_open(&run.contexts[n], bus_spec, addresses, 2, "sim") < 0) {
+      exit(1);
+    }
+    run.contexts[n].next_word = counted_word;
+    run.contexts[n].user = &run;
+    run.contexts[n].latency = &latency;
+    loop_add(&loop, &run.contexts[n]);
+  }
+
+  getrusage(RUSAGE_THREAD, &usage_before);
+  start = monotonic_ns();
+  pthread_create(&generator, NULL, interfaces_generator, &run);
+  loop_run(&loop);
+  elapsed = monotonic_ns() - start;
+  getrusage(RUSAGE_THREAD, &usage_after);
+  atomic_store(&run.running, 0);
+  pthread_join(generator, NULL);
+
+  cpu_us = (usage_after.ru_utime.tv_sec - usage_before.ru_utime.tv_sec) * 1000000
+           + (usage_after.ru_stime.tv_sec - usage_before.ru_stime.tv_sec) * 1000000
+           + usage_after.ru_utime.tv_usec - usage_before.ru_utime.tv_usec
+           + usage_after.ru_stime.tv_usec - usage_before.ru_stime.tv_usec;
+  for (n = 0; n < count; n++) {
+    served += run.contexts[n].cycles;
+    interface_close(&run.contexts[n]);
+  }
+  printf("%10d %10lu %10.0f %9.1f%% %10.3f %8.1f %8.1f %8.1f\n",
+         count, served, served * 1e9 / elapsed, 100.0 * cpu_us * 1000 / elapsed,
+         (double) loop.wakeups / served,
+         latency_percentile(&latency, 50) / 1e3, latency_percentile(&latency, 99) / 1e3,
+         latency.max / 1e3);
+  loop_free(&loop);
+  free(latency.samples);
+  free(run.contexts);
+}
+
+
+#define PINS_GAP_US 50                  // between a thread's changes - they come spread out, like a machine's
+#define PINS_CYCLE_US 1000              // the simulated machine cycle, for flushing once per cycle
+
+// How the outputs are written:
+#define PINS_LOCKED 0                   // a lock around them, an update for every change
+#define PINS_DEADLINE 1                 // atomic changes, flushed a deadline after the first
+#define PINS_CYCLE 2                    // atomic changes, flushed on every rising edge
+
+struct pins_worker {
+  pthread_t thread;
+  int first_pin;                        // this thread's four outputs
+  int changes;
+  int locked;
+};
+
+pthread_mutex_t pins_lock = PTHREAD_MUTEX_INITIALIZER;
+struct output_word pins_word;           // with the lock: the outputs, as they should be
+atomic_int pins_machine_running;
+
+
+void *pins_toggler(void *argument) {
+/*
+  Turn this thread's outputs on and off, changes times in all: each of
+  the four on, one after another, then each of them off, and so on.
+*/
+  struct pins_worker *worker = argument;
+  int i, pin, chip, bank, bit;
+
+  for (i = 0; i < worker->changes; i++) {
+    pin = worker->first_pin + i % 4;
+    if (!worker->locked) {
+      if (i / 4 % 2) {
+        pin_off(pin);
+      }
+      else {
+        pin_on(pin);
+      }
+      usleep(PINS_GAP_US);
+      continue;
+    }
+    chip = pin >> 4;
+    bank = pin >> 3 & 1;
+    bit = 1 << (pin & 7);
+    pthread_mutex_lock(&pins_lock);
+    if (i / 4 % 2) {
+      pins_word.value[chip][bank] &= ~bit;
+    }
+    else {
+      pins_word.value[chip][bank] |= bit;
+    }
+    set_outputs_word(&pins_word);
+    pthread_mutex_unlock(&pins_lock);
+    usleep(PINS_GAP_US);
+  }
+  return NULL;
+}
+
+
+void pins_expected(int threads, int changes, struct output_word *word) {
+// The outputs as the threads' last changes left them
+  int t, k, last, pin;
+
+  memset(word, 0, sizeof(*word));
+  for (t = 0; t < threads; t++) {
+    for (k = 0; k < 4 && k < changes; k++) {
+      last = k + (changes - 1 - k) / 4 * 4;       // this output's last change
+      pin = t * 4 + k;
+      if (last / 4 % 2 == 0) {
+        word->value[pin >> 4][pin >> 3 & 1] |= 1 << (pin & 7);
+      }
+    }
+  }
+}
+
+
+void *pins_machine(void *nothing) {
+// The input, on for half a cycle and off for the other half, until told to stop
+  struct timespec deadline;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  for (i = 0; atomic_load(&pins_machine_running); i++) {
+    deadline.tv_nsec += PINS_CYCLE_US * 500;
+    while (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_nsec -= 1000000000;
+      deadline.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    edge_inject(&edge, !(i & 1));
+  }
+  return NULL;
+}
+
+
+void run_pins(const char *name, int threads, int changes, int how, unsigned long deadline_us) {
+// Threads changing outputs, written as how says - and did the outputs end up right?
+  static struct pins_worker workers[8];
+  struct output_word outputs, expected;
+  struct bus_stats stats;
+  uint64_t start, elapsed;
+  pthread_t machine;
+  int t, c, wrong = 0;
+
+  all_off();
+  memset(&pins_word, 0, sizeof(pins_word));
+  devices_reset_stats();
+  if (how == PINS_CYCLE) {
+    atomic_store(&pins_machine_running, 1);
+    pthread_create(&machine, NULL, pins_machine, NULL);
+  }
+  if (how != PINS_LOCKED && pins_start(how == PINS_CYCLE ? 0 : deadline_us) < 0) {
+    perror("pins_start");
+    exit(1);
+  }
+
+  start = monotonic_ns();
+  for (t = 0; t < threads; t++) {
+    workers[t].first_pin = t * 4;
+    workers[t].changes = changes;
+    workers[t].locked = how == PINS_LOCKED;
+    pthread_create(&workers[t].thread, NULL, pins_toggler, &workers[t]);
+  }
+  for (t = 0; t < threads; t++) {
+    pthread_join(workers[t].thread, NULL);
+  }
+  pins_stop();
+  elapsed = monotonic_ns() - start;
+  devices_stats(&stats);
+  if (how == PINS_CYCLE) {
+    atomic_store(&pins_machine_running, 0);
+    pthread_join(machine, NULL);
+  }
+
+  devices_outputs(&outputs);
+  pins_expected(threads, changes, &expected);
+  for (c = 0; c < devices.chips; c++) {
+    wrong += outputs.value[c][0] != expected.value[c][0] || outputs.value[c][1] != expected.value[c][1];
+  }
+  printf("%-10s %7d %12.0f %12.3f %12.1f %s\n", name, threads,
+         (double) threads * changes * 1e9 / elapsed,
+         (double) stats.messages / (threads * changes),
+         how == PINS_LOCKED ? 1.0 : (double) atomic_load(&pins.changes) / (pins.flushes ? pins.flushes : 1),
+         wrong ? "OUTPUTS WRONG" : "ok");
+}
+
+
+int main(int argc, char **argv) {
+  int updates = 10000;
+
+  if (argc > 1 && strcmp(argv[1], "pins") == 0) {
+    unsigned long deadline_us = argc > 3 ? atol(argv[3]) : 200;
+    int threads[] = { 1, 4, 8 }, n, changes;
+
+    changes = argc > 2 ? atoi(argv[2]) : 2000;
+    if (changes <= 0) {
+      changes = 2000;
+    }
+// The flusher's input - a simulated machine, whatever MCP23017_EDGE says:
+    edge_close(&edge);
+    edge.debounce_ns = 0;
+    if (edge_open(&edge, "sim") < 0 || devices_configure(argc > 4 ? argv[4] : "sim:400k@0x20,0x21") < 0
+        || mcp_init() < 0) {
+      return 1;
+    }
+    printf("%d changes per thread, four outputs each; flushed ", changes);
+    if (argc <= 3) {
+      printf("%lu us after the first change, and every %d us cycle\n", deadline_us, PINS_CYCLE_US);
+    }
+    else if (deadline_us) {
+      printf("%lu us after the first change\n", deadline_us);
+    }
+    else {
+      printf("every %d us cycle\n", PINS_CYCLE_US);
+    }
+    printf("%-10s %7s %12s %12s %12s\n", "outputs", "threads", "changes/s", "messages", "per flush");
+    for (n = 0; n < 3; n++) {
+      run_pins("locked", threads[n], changes, PINS_LOCKED, 0);
+      if (deadline_us) {
+        run_pins("deadline", threads[n], changes, PINS_DEADLINE, deadline_us);
+      }
+      if (argc <= 3 || deadline_us == 0) {
+        run_pins("per cycle", threads[n], changes, PINS_CYCLE, 0);
+      }
+    }
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "interfaces") == 0) {
+    int cycles = argc > 2 ? atoi(argv[2]) : 1000;
+    int cycle_us = argc > 3 ? atoi(argv[3]) : 2000;
+    const char *bus_spec = argc > 4 ? argv[4] : "sim:400k:nowait";
+
+    if (cycles <= 0 || cycle_us <= 0) {
+      fprintf(stderr, "usage: %s interfaces [cycles] [cycle_us] [bus_spec]\n", argv[0]);
+      return 1;
+    }
+    printf("%d cycles of %d us per interface, 2 chips each on %s, one thread\n", cycles, cycle_us, bus_spec);
+    printf("%10s %10s %10s %10s %10s %8s %8s %8s\n", "interfaces", "cycles", "cycles/s", "loop CPU",
+           "wakeups/c", "p50 us", "p99 us", "max us");
+    run_interfaces(1, cycles, cycle_us, bus_spec);
+    run_interfaces(8, cycles, cycle_us, bus_spec);
+    run_interfaces(32, cycles, cycle_us, bus_spec);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "uring") == 0) {
+    static const int modes[] = { WRITE_SINGLE, WRITE_BURST, WRITE_URING };
+    char directory[] = "/tmp/mcp23017-uring-XXXXXX", spec[64], stub[64];
+    const char *setting = getenv("MCP23017_STUB");
+    int chips, m;
+
+    updates = argc > 2 ? atoi(argv[2]) : 10000;
+    if (updates <= 0 || updates > 50000) {
+      updates = 10000;                  // a pipe holds 1 MB, and nobody reads it
+    }
+    if (mkdtemp(directory) == NULL) {
+      perror(directory);
+      return 1;
+    }
+    printf("%d updates, all chips changing every time\n", updates);
+    printf("%-6s %5s %-7s %10s %10s %10s %8s\n", "fds", "chips", "mode", "syscalls", "us/update",
+           "CPU us", "errors");
+    for (chips = 2; chips <= 8; chips += 6) {
+      for (m = 0; m < 3; m++) {
+        run_uring("pipe", "mock:pipe", chips, modes[m], updates);
+      }
+      snprintf(spec, sizeof(spec), "mock:%s", directory);
+      for (m = 0; m < 3; m++) {
+        run_uring("file", spec, chips, modes[m], updates);
+      }
+      if (setting != NULL && *setting) {
+        snprintf(stub, sizeof(stub), "stub:%s", setting);
+        for (m = 0; m < 3; m++) {
+          run_uring("stub", stub, chips, modes[m], updates);
+        }
+      }
+    }
+    for (chips = 0x20; chips < 0x28; chips++) {
+      snprintf(spec, sizeof(spec), "%s/0x%02x", directory, chips);
+      unlink(spec);
+    }
+    rmdir(directory);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "trace") == 0) {
+    updates = argc > 2 ? atoi(argv[2]) : 2000;
+    if (updates <= 0) {
+      updates = 2000;
+    }
+    run_trace(updates, argc > 3 ? argv[3] : "trace.json");
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "record") == 0) {
+    updates = argc > 2 ? atoi(argv[2]) : 2000;
+    if (updates <= 0) {
+      updates = 2000;
+    }
+    run_record(updates, argc > 3 ? argv[3] : "benchmark.rec");
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+    int words = argc > 2 ? atoi(argv[2]) : 1000000;
+    uint32_t *codes;
+
+    if (words <= 0) {
+      words = 1000000;
+    }
+    codes = ribbon_codes(words);
+    printf("%d code words, best translator here: %s\n", words, batch_method_names[batch_best_method()]);
+    printf("%-10s %-7s %9s %9s %12s %9s %12s %8s\n", "map", "method", "registers",
+           "ns/word", "Mwords/s", "+dedup", "Mwords/s", "distinct");
+    run_batch("default", NULL, codes, words);
+    run_batch("scattered",
+              "0A3 2B1 1A0 3A7 0B5 1B2 2A6 3B0 0A0 1A7 2B4 3A2 0B1 1B6 2A3 3B5 "
+              "0A6 1A2 2B7 3A4 0B3 1B0 2A0 3B2 0A5 1A5 2B2 3A1 0B7 1B4 2A5", codes, words);
+    free(codes);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "pinmap") == 0) {
+    int words = argc > 2 ? atoi(argv[2]) : 1000000;
+    uint32_t *codes;
+
+    if (words <= 0) {
+      words = 1000000;
+    }
+    codes = ribbon_codes(words);
+    printf("%d code words, ns per word\n", words);
+    printf("%-10s %5s %5s %6s %12s %12s %12s %9s\n",
+           "map", "chips", "steps", "tables", "per signal", "compiled", "Mwords/s", "speedup");
+    run_pinmap("default", NULL, codes, words);
+// The chips swapped, and signal 0 not wired:
+    run_pinmap("swapped",
+               "- 1A1 1A2 1A3 1A4 1A5 1A6 1A7 1B0 1B1 1B2 1B3 1B4 1B5 1B6 1B7 "
+               "0A0 0A1 0A2 0A3 0A4 0A5 0A6 0A7 0B0 0B1 0B2 0B3 0B4 0B5 0B6", codes, words);
+// Both chips, bank by bank, but each bank wired back to front:
+    run_pinmap("reversed",
+               "0A7 0A6 0A5 0A4 0A3 0A2 0A1 0A0 0B7 0B6 0B5 0B4 0B3 0B2 0B1 0B0 "
+               "1A7 1A6 1A5 1A4 1A3 1A2 1A1 1A0 1B7 1B6 1B5 1B4 1B3 1B2 1B1", codes, words);
+// Signals dealt out over four chips, like a harness patched over the years:
+    run_pinmap("scattered",
+               "0A3 2B1 1A0 3A7 0B5 1B2 2A6 3B0 0A0 1A7 2B4 3A2 0B1 1B6 2A3 3B5 "
+               "0A6 1A2 2B7 3A4 0B3 1B0 2A0 3B2 0A5 1A5 2B2 3A1 0B7 1B4 2A5", codes, words);
+    free(codes);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "startup") == 0) {
+    printf("mcp_init() on simulated chips at 400 kHz, best of 5\n");
+    printf("%6s %-9s %-5s %10s %9s %9s %9s %9s\n",
+           "chips", "chips are", "init", "us", "syscalls", "messages", "bytes", "changed");
+    run_startup("sim:400k@0x20,0x21");
+    run_startup("sim:400k@0x20-0x27");
+    run_startup("sim:400k@0x20-0x27;sim:400k@0x20-0x27");
+    devices_close();
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "verify") == 0) {
+    updates = argc > 2 ? atoi(argv[2]) : 5000;
+    if (updates <= 0) {
+      updates = 5000;
+    }
+    printf("%d updates, RDWR with the cache on, bus %s\n", updates, argc > 3 ? argv[3] : "sim:400k:nak=200");
+    printf("%-6s %10s %10s %8s %8s %8s %10s\n",
+           "verify", "us/update", "wire us", "errors", "retries", "failed", "mismatches");
+    run_verify(0, argc > 3 ? argv[3] : "sim:400k:nak=200", updates);
+    run_verify(16, argc > 3 ? argv[3] : "sim:400k:nak=200", updates);
+    run_verify(1, argc > 3 ? argv[3] : "sim:400k:nak=200", updates);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "cycles") == 0) {
+    static const char *buses[] = { "sim:100k", "sim:400k", "sim:1M", "sim:400k:nowait" };
+    const char *setting = getenv("MCP23017_STUB");
+    char stub[64];
+    int duty = argc > 2 ? atoi(argv[2]) : 50;
+    int b;
+
+    if (duty <= 0 || duty >= 100) {
+      fprintf(stderr, "usage: %s cycles [duty_percent] [bus_spec...]\n", argv[0]);
+      return 1;
+    }
+    measure_wakeups = 1;
+    printf("two chips, a different word every cycle, on %d%% of the cycle; jitter: deadline to wake-up\n", duty);
+    printf("%-18s %10s %8s %8s %8s %10s   %s\n", "bus", "cycles/s", "jit p50", "p99", "max",
+           "latency p99", "the next step up");
+    if (argc > 3) {
+      for (b = 3; b < argc; b++) {
+        run_cycles(argv[b], duty);
+      }
+      return 0;
+    }
+    for (b = 0; b < 4; b++) {
+      run_cycles(buses[b], duty);
+    }
+    if (setting != NULL && *setting) {
+      snprintf(stub, sizeof(stub), "stub:%s", setting);
+      run_cycles(stub, duty);
+    }
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "skew") == 0) {
+    static const char *speeds[] = { "sim:100k", "sim:400k" };
+    const char *spec;
+    int n;
+
+    updates = argc > 2 ? atoi(argv[2]) : 200;
+    if (updates <= 0) {
+      updates = 200;
+    }
+    printf("%d updates, all outputs changing every time; first to last output change, us\n", updates);
+    for (n = 0; n < 2; n++) {
+      spec = argc > 3 ? argv[3] : speeds[n];
+      printf("%s\n%-22s %5s %5s %10s %10s %10s %10s\n", spec, "mode", "buses", "chips",
+             "skew p50", "p99", "max", "last, mean");
+      run_skew("single", spec, 1, 2, WRITE_SINGLE, 0, updates);
+      run_skew("burst", spec, 1, 2, WRITE_BURST, 0, updates);
+      run_skew("rdwr", spec, 1, 2, WRITE_RDWR, 0, updates);
+      run_skew("rdwr", spec, 1, 8, WRITE_RDWR, 0, updates);
+      run_skew("picked", spec, 2, 8, WRITE_AUTO, 0, updates);
+      run_skew("low skew", spec, 2, 8, WRITE_AUTO, 1, updates);
+      run_skew("picked", spec, 4, 8, WRITE_AUTO, 0, updates);
+      run_skew("low skew", spec, 4, 8, WRITE_AUTO, 1, updates);
+      if (argc > 3) {
+        break;
+      }
+    }
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "buses") == 0) {
+    updates = argc > 2 ? atoi(argv[2]) : 2000;
+    if (updates <= 0) {
+      updates = 2000;
+    }
+    printf("%d updates, all chips changing every time\n", updates);
+    printf("%5s %6s %12s %14s %12s\n", "buses", "chips", "updates/s", "chip writes/s", "us/update");
+    run_buses(1, argc > 3 ? argv[3] : "sim:400k", updates);
+    run_buses(2, argc > 3 ? argv[3] : "sim:400k", updates);
+    run_buses(4, argc > 3 ? argv[3] : "sim:400k", updates);
+    return 0;
+  }
+
+  if (argc > 1) {
+    updates = atoi(argv[1]);
+  }
+  if (updates <= 0) {
+    fprintf(stderr, "usage: %s [number_of_updates]\n", argv[0]);
+    return 1;
+  }
+
+  if (mcp_init() < 0) {
+    return 1;
+  }
+
+  printf("%d updates per mode, %d chips on %d buses, first: %s bus %s at %lu Hz\n",
+         updates, devices.chips, devices.buses, devices.bus[0].bus.backend->name,
+         devices.bus[0].bus.device, devices.bus[0].bus.speed_hz);
+  devices_report(stdout);
+  printf("%-8s %-5s %10s %10s %10s %10s %10s %10s\n",
+         "mode", "cache", "us/update", "syscalls", "messages", "bytes", "elided", "wire us");
+  run_mode(WRITE_SINGLE, 0, updates);
+  run_mode(WRITE_BURST, 0, updates);
+  run_mode(WRITE_RDWR, 0, updates);
+  run_mode(WRITE_SMBUS, 0, updates);
+  run_mode(WRITE_SINGLE, 1, updates);
+  run_mode(WRITE_BURST, 1, updates);
+  run_mode(WRITE_RDWR, 1, updates);
+  run_mode(WRITE_SMBUS, 1, updates);
+
+  all_off();
+  return 0;
+}
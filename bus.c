@@ -0,0 +1,854 @@
+/*
+  I2C bus access for the MCP23017 programs.
+
+  Everything the programs send to the chips goes through the functions
+  in this file, so the same code can talk to:
+
+  i2c-dev - the real I2C bus on a Raspberry Pi (/dev/i2c-1).
+            Each chip gets its own file descriptor with ioctl(I2C_SLAVE),
+            single messages go with write(), several messages at once
+            with the I2C_RDWR ioctl.
+  stub    - a bus created by the kernel's i2c-stub module:
+
+              sudo modprobe i2c-stub chip_addr=0x20,0x21
+
+            i2c-stub only understands SMBus transfers (no raw I2C),
+            so messages are sent as SMBus "write byte data" or
+            "I2C block write/read" ioctls. It's useful for checking
+            the kernel side of things on a machine without I2C hardware.
+            The same backend serves any other adapter that can't do plain
+            I2C transfers - bus_open() asks the adapter what it can do
+            (ioctl I2C_FUNCS) and picks it by itself for those.
+  sim     - simulated MCP23017 chips at 0x20...0x27 (see mcp23017-sim.c),
+            with no kernel involved at all. Transfers take as long as
+            they would on a real bus at the chosen clock speed.
+  mock    - no chips at all: every chip's file descriptor is a file
+            or a pipe, and messages are simply written to it. Nothing
+            can be read back. It's for measuring what the syscalls cost
+            (write() against io_uring, say) on a machine without I2C.
+
+  The bus is chosen with a string, given to bus_open() or taken from
+  the MCP23017_BUS environment variable (the default is /dev/i2c-1):
+
+  /dev/i2c-1, i2c-dev:1, 1    - real bus 1
+  stub:/dev/i2c-11, stub:11   - i2c-stub bus 11
+  sim, sim:400k, sim:1.7M     - simulated bus at 100 kHz (default), 400 kHz,
+                                1.7 MHz or any other speed given in Hz
+  sim:400k:nowait             - as above, but don't actually wait for the
+                                simulated transfers (only count their time)
+  sim:400k:nak=100            - make every 100th transfer fail, like a chip
+                                that didn't acknowledge (for testing retries)
+  mock:/tmp/chips             - files /tmp/chips/0x20, /tmp/chips/0x21...
+                                (the directory must exist)
+  mock:pipe                   - a pipe for every chip, 1 MB of room each -
+                                writes fail with EAGAIN once it's full
+
+  Transfers can fail: a chip may not acknowledge (noise, a loose wire,
+  a chip just coming out of a brown-out reset), or the bus may hang.
+  bus_write_retry() and bus_transfer_retry() try again a few times,
+  waiting a little longer every time (bus->retries times at most,
+  BUS_BACKOFF_NS doubled on every attempt), and only then give up.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+
+#include "./mcp23017-sim.c"
+#include "./trace.c"
+#include "./record.c"
+#include "./uring.c"
+
+#define DEFAULT_BUS "/dev/i2c-1"
+#define SIM_FIRST_ADDR 0x20             // simulated chips answer at 0x20...0x27
+#define SIM_CHIPS 8
+#define BUS_RETRIES 3                   // attempts after the first one
+#define BUS_BACKOFF_NS 50000            // wait before the first retry; doubles each time
+
+/*
+  Bus statistics - updated on every transfer, so that the benchmark
+  (and anyone curious) can tell how much work an update really costs.
+  wire_bits counts what the I2C master clocks out: 9 bits (8 data + ACK)
+  per byte including the address byte, plus START and STOP conditions.
+*/
+struct bus_stats {
+  unsigned long syscalls;       // write() or ioctl() calls made (or that would be, on sim)
+  unsigned long messages;       // I2C messages (START ... STOP or repeated START)
+  unsigned long bytes;          // payload bytes, register addresses included
+  unsigned long wire_bits;      // SCL clocks spent on the bus
+  uint64_t wire_ns;             // the same, in time at the bus speed
+  unsigned long elided;         // register writes skipped - the chip already had the value
+  unsigned long errors;         // transfers that failed (retried or not)
+  unsigned long retries;        // transfers attempted again after a failure
+  unsigned long failures;       // transfers that failed for good, retries exhausted
+};
+
+struct bus;
+
+struct bus_backend {
+  const char *name;
+  int (*open)(struct bus *bus, const char *device);
+// Send one message - returns the number of bytes written, or -1 and errno:
+  int (*write)(struct bus *bus, int address, uint8_t *data, int length);
+// Send several messages in one transaction - returns the number of messages, or -1:
+  int (*transfer)(struct bus *bus, struct i2c_msg *messages, int count);
+  void (*close)(struct bus *bus);
+// The chip's own file descriptor, for writing to it directly - or NULL if there's none:
+  int (*chip_fd)(struct bus *bus, int address);
+};
+
+struct bus {
+  const struct bus_backend *backend;
+  char device[64];                      // /dev/i2c-N for i2c-dev and stub
+  int fd;                               // bus file descriptor, for I2C_RDWR
+  int chip_fds[128];                    // per-address descriptors, 0 if not opened yet
+  int pipe_fds[128];                    // mock:pipe - the read ends
+  unsigned long speed_hz;               // SCL frequency, for timing estimates
+  int sim_wait;                         // sim: wait for transfers to finish
+  unsigned long sim_nak_every;          // sim: fail every Nth transfer, 0 - never
+  unsigned long sim_transfers;
+  int retries;                          // how many times a failed transfer is retried
+  unsigned long funcs;                  // what the adapter can do: I2C_FUNC_... bits
+  struct mcp23017_model *sim;           // sim: the chips
+  struct bus_stats stats;
+};
+
+
+uint64_t monotonic_ns(void) {
+// Monotonic time in nanoseconds - not affected by wall clock changes:
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+uint64_t bits_to_ns(struct bus *bus, unsigned long bits) {
+  return (uint64_t) bits * 1000000000 / bus->speed_hz;
+}
+
+
+uint64_t transfer_ns(struct bus *bus, struct i2c_msg *messages, int count, unsigned long *bits) {
+/*
+  How long a transaction takes on the wire: START (or repeated START)
+  and address byte per message, 9 clocks per data byte, one STOP at the end.
+  Above 400 kHz the master first sends the high-speed master code
+  at 400 kHz (8 bits and a NACK) - that's what makes 1.7 MHz less than
+  4 times faster than 400 kHz for short messages.
+*/
+  unsigned long clocks = 1;             // the STOP
+  uint64_t ns = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    clocks += 1 + 9 * (messages[i].len + 1);
+  }
+  if (bus->speed_hz > 400000) {
+    ns += 10 * 1000000000ull / 400000;
+  }
+  *bits = clocks;
+  return ns + bits_to_ns(bus, clocks);
+}
+
+
+void count_transfer(struct bus *bus, struct i2c_msg *messages, int count) {
+  unsigned long bits;
+  int i;
+
+  bus->stats.syscalls++;
+  bus->stats.messages += count;
+  for (i = 0; i < count; i++) {
+    bus->stats.bytes += messages[i].len;
+  }
+  bus->stats.wire_ns += transfer_ns(bus, messages, count, &bits);
+  bus->stats.wire_bits += bits;
+}
+
+
+/*
+  The i2c-dev backend - a real bus.
+*/
+
+int i2cdev_open(struct bus *bus, const char *device) {
+  bus->fd = open(device, O_RDWR);
+  if (bus->fd < 0) {
+    perror(device);
+    return -1;
+  }
+  return 0;
+}
+
+
+int i2cdev_chip_fd(struct bus *bus, int address) {
+/*
+  One file descriptor per chip, bound to its address with ioctl(I2C_SLAVE),
+  like the demos have always done - so that sending a message is only
+  a write(), without an ioctl to switch chips every time.
+*/
+  int fd;
+
+  if (bus->chip_fds[address] > 0) {
+    return bus->chip_fds[address];
+  }
+  fd = open(bus->device, O_RDWR);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ioctl(fd, I2C_SLAVE, address) < 0) {
+    close(fd);
+    return -1;
+  }
+  bus->chip_fds[address] = fd;
+  return fd;
+}
+
+
+int i2cdev_write(struct bus *bus, int address, uint8_t *data, int length) {
+  int fd = i2cdev_chip_fd(bus, address);
+  if (fd < 0) {
+    return -1;
+  }
+  return write(fd, data, length);
+}
+
+
+int i2cdev_transfer(struct bus *bus, struct i2c_msg *messages, int count) {
+  struct i2c_rdwr_ioctl_data transfer;
+
+  transfer.msgs = messages;
+  transfer.nmsgs = count;
+  return ioctl(bus->fd, I2C_RDWR, &transfer);
+}
+
+
+void i2cdev_close(struct bus *bus) {
+  int address;
+
+  for (address = 0; address < 128; address++) {
+    if (bus->chip_fds[address] > 0) {
+      close(bus->chip_fds[address]);
+    }
+  }
+  close(bus->fd);
+}
+
+
+const struct bus_backend i2cdev_backend = {
+  "i2c-dev", i2cdev_open, i2cdev_write, i2cdev_transfer, i2cdev_close, i2cdev_chip_fd
+};
+
+
+/*
+  The i2c-stub backend - the same device files, but SMBus transfers only.
+*/
+
+int smbus_access(int fd, char read_write, uint8_t command, int size, union i2c_smbus_data *data) {
+  struct i2c_smbus_ioctl_data args;
+
+  args.read_write = read_write;
+  args.command = command;
+  args.size = size;
+  args.data = data;
+  return ioctl(fd, I2C_SMBUS, &args);
+}
+
+
+int stub_write(struct bus *bus, int address, uint8_t *data, int length) {
+/*
+  A register write is "write byte data" (register, value);
+  a sequential write is "I2C block write" (register, values...).
+*/
+  union i2c_smbus_data block;
+  int fd = i2cdev_chip_fd(bus, address);
+
+  if (fd < 0) {
+    return -1;
+  }
+  if (length < 2 || length - 1 > I2C_SMBUS_BLOCK_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (length == 2) {
+    block.byte = data[1];
+    if (smbus_access(fd, I2C_SMBUS_WRITE, data[0], I2C_SMBUS_BYTE_DATA, &block) < 0) {
+      return -1;
+    }
+    return length;
+  }
+  block.block[0] = length - 1;
+  memcpy(&block.block[1], &data[1], length - 1);
+  if (smbus_access(fd, I2C_SMBUS_WRITE, data[0], I2C_SMBUS_I2C_BLOCK_DATA, &block) < 0) {
+    return -1;
+  }
+  return length;
+}
+
+
+int stub_transfer(struct bus *bus, struct i2c_msg *messages, int count) {
+/*
+  SMBus has no combined transactions, so the messages go one by one.
+  A register address followed by a read from the same chip
+  becomes an "I2C block read".
+*/
+  union i2c_smbus_data block;
+  int i, fd;
+
+  for (i = 0; i < count; i++) {
+    if (messages[i].flags & I2C_M_RD) {
+      errno = EOPNOTSUPP;               // a read without a register address first
+      return -1;
+    }
+    if (i + 1 < count && (messages[i + 1].flags & I2C_M_RD)
+        && messages[i].len == 1 && messages[i + 1].addr == messages[i].addr) {
+      fd = i2cdev_chip_fd(bus, messages[i].addr);
+      if (fd < 0 || messages[i + 1].len > I2C_SMBUS_BLOCK_MAX) {
+        return -1;
+      }
+      block.block[0] = messages[i + 1].len;
+      if (smbus_access(fd, I2C_SMBUS_READ, messages[i].buf[0], I2C_SMBUS_I2C_BLOCK_DATA, &block) < 0) {
+        return -1;
+      }
+      memcpy(messages[i + 1].buf, &block.block[1], messages[i + 1].len);
+      i++;
+      continue;
+    }
+    if (stub_write(bus, messages[i].addr, messages[i].buf, messages[i].len) < 0) {
+      return -1;
+    }
+  }
+  return count;
+}
+
+
+const struct bus_backend stub_backend = {
+  "stub", i2cdev_open, stub_write, stub_transfer, i2cdev_close, i2cdev_chip_fd
+};
+
+
+/*
+  The sim backend - chips in memory, transfers timed like on a real bus.
+*/
+
+int sim_open(struct bus *bus, const char *device) {
+  int i;
+
+  bus->sim = calloc(SIM_CHIPS, sizeof(struct mcp23017_model));
+  if (bus->sim == NULL) {
+    return -1;
+  }
+  for (i = 0; i < SIM_CHIPS; i++) {
+    sim_reset(&bus->sim[i]);
+  }
+  return 0;
+}
+
+
+void sim_wait_until(uint64_t deadline) {
+// Sleep through most of the wait, then spin for the last bit for accuracy:
+  struct timespec ts;
+  uint64_t now = monotonic_ns();
+
+  if (deadline > now + 200000) {
+    deadline -= 100000;
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    deadline += 100000;
+  }
+  while (monotonic_ns() < deadline) {
+  }
+}
+
+
+int sim_transfer(struct bus *bus, struct i2c_msg *messages, int count) {
+/*
+  Play the messages to the simulated chips. Every byte is stamped with
+  the time its ACK would be clocked on a real bus, so the chips know
+  exactly when their outputs changed.
+*/
+  struct mcp23017_model *chip;
+  unsigned long bits;
+  uint64_t start, end;
+  int i, j;
+
+  for (i = 0; i < count; i++) {
+    if (messages[i].addr < SIM_FIRST_ADDR || messages[i].addr >= SIM_FIRST_ADDR + SIM_CHIPS) {
+      errno = ENXIO;                    // nobody acknowledged the address
+      return -1;
+    }
+  }
+  bus->sim_transfers++;
+  if (bus->sim_nak_every && bus->sim_transfers % bus->sim_nak_every == 0) {
+    errno = EREMOTEIO;                  // a chip didn't acknowledge - nothing got through
+    return -1;
+  }
+
+  start = monotonic_ns();
+  end = start + transfer_ns(bus, messages, count, &bits);
+  if (bus->speed_hz > 400000) {
+    start += 10 * 1000000000ull / 400000;
+  }
+  bits = 0;
+
+  for (i = 0; i < count; i++) {
+    chip = &bus->sim[messages[i].addr - SIM_FIRST_ADDR];
+    bits += 1 + 9;                      // START and address
+    for (j = 0; j < messages[i].len; j++) {
+      bits += 9;
+      if (messages[i].flags & I2C_M_RD) {
+        messages[i].buf[j] = sim_read_byte(chip);
+      }
+      else if (j == 0) {
+        chip->pointer = messages[i].buf[0];
+      }
+      else {
+        sim_write_byte(chip, messages[i].buf[j], start + bits_to_ns(bus, bits));
+      }
+    }
+  }
+
+  if (bus->sim_wait) {
+    sim_wait_until(end);
+  }
+  return count;
+}
+
+
+int sim_write(struct bus *bus, int address, uint8_t *data, int length) {
+  struct i2c_msg message;
+
+  message.addr = address;
+  message.flags = 0;
+  message.len = length;
+  message.buf = data;
+  if (sim_transfer(bus, &message, 1) < 0) {
+    return -1;
+  }
+  return length;
+}
+
+
+void sim_close(struct bus *bus) {
+  free(bus->sim);
+}
+
+
+const struct bus_backend sim_backend = {
+  "sim", sim_open, sim_write, sim_transfer, sim_close, NULL
+};
+
+
+/*
+  The mock backend - files or pipes instead of chips.
+*/
+
+int mock_open(struct bus *bus, const char *device) {
+  return 0;
+}
+
+
+int mock_chip_fd(struct bus *bus, int address) {
+// The chip's file (device is a directory) or pipe (device is "pipe"), made on first use:
+  char name[sizeof(bus->device) + 8];
+  int fds[2];
+
+  if (bus->chip_fds[address] > 0) {
+    return bus->chip_fds[address];
+  }
+  if (strcmp(bus->device, "pipe") == 0) {
+    if (pipe(fds) < 0) {
+      return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+    fcntl(fds[1], F_SETPIPE_SZ, 1 << 20);
+#endif
+    bus->pipe_fds[address] = fds[0];
+    bus->chip_fds[address] = fds[1];
+    return fds[1];
+  }
+  snprintf(name, sizeof(name), "%s/0x%02x", bus->device, address);
+  bus->chip_fds[address] = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  return bus->chip_fds[address] > 0 ? bus->chip_fds[address] : -1;
+}
+
+
+int mock_write(struct bus *bus, int address, uint8_t *data, int length) {
+  int fd = mock_chip_fd(bus, address);
+  if (fd < 0) {
+    return -1;
+  }
+  return write(fd, data, length);
+}
+
+
+int mock_transfer(struct bus *bus, struct i2c_msg *messages, int count) {
+// No combined transactions here - a write() per message, and no reads
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (messages[i].flags & I2C_M_RD) {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+    if (i > 0) {
+      bus->stats.syscalls++;
+    }
+    if (mock_write(bus, messages[i].addr, messages[i].buf, messages[i].len) != messages[i].len) {
+      return -1;
+    }
+  }
+  return count;
+}
+
+
+void mock_close(struct bus *bus) {
+  int address;
+
+  for (address = 0; address < 128; address++) {
+    if (bus->chip_fds[address] > 0) {
+      close(bus->chip_fds[address]);
+    }
+    if (bus->pipe_fds[address] > 0) {
+      close(bus->pipe_fds[address]);
+    }
+  }
+}
+
+
+const struct bus_backend mock_backend = {
+  "mock", mock_open, mock_write, mock_transfer, mock_close, mock_chip_fd
+};
+
+
+/*
+  The functions the programs use:
+*/
+
+unsigned long parse_speed(const char *text) {
+// "100k", "400k", "1.7M" or plain Hz:
+  char *end;
+  double speed = strtod(text, &end);
+
+  if (*end == 'k' || *end == 'K') {
+    speed *= 1000;
+  }
+  else if (*end == 'M' || *end == 'm') {
+    speed *= 1000000;
+  }
+  return speed > 0 ? (unsigned long) speed : 100000;
+}
+
+
+void bus_probe(struct bus *bus) {
+/*
+  Ask the adapter what it can do. Adapters that only speak SMBus
+  (no I2C_FUNC_I2C) can't take plain write()s or I2C_RDWR - they get
+  the SMBus backend, which sends everything as SMBus transfers.
+  The simulated chips can do everything.
+*/
+  if (bus->backend == &sim_backend) {
+    bus->funcs = I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+    return;
+  }
+  if (bus->backend == &mock_backend) {
+    bus->funcs = I2C_FUNC_I2C;          // writes only, no I2C_RDWR of its own
+    return;
+  }
+  if (ioctl(bus->fd, I2C_FUNCS, &bus->funcs) < 0) {
+    bus->funcs = I2C_FUNC_I2C;          // old kernel - let's hope for the best
+  }
+  if (bus->backend == &i2cdev_backend && !(bus->funcs & I2C_FUNC_I2C)) {
+    bus->backend = &stub_backend;
+  }
+  if (bus->backend == &stub_backend) {
+    bus->funcs &= ~I2C_FUNC_I2C;        // never used through this backend
+  }
+}
+
+
+int bus_open(struct bus *bus, const char *spec) {
+/*
+  Open the bus described by spec (see the top of this file).
+  If spec is NULL, use MCP23017_BUS from the environment, or /dev/i2c-1.
+  Returns 0 on success, -1 on failure.
+*/
+  const char *options;
+
+  if (spec == NULL) {
+    spec = getenv("MCP23017_BUS");
+  }
+  if (spec == NULL || *spec == 0) {
+    spec = DEFAULT_BUS;
+  }
+
+  memset(bus, 0, sizeof(*bus));
+  bus->fd = -1;
+  bus->speed_hz = 100000;
+  bus->sim_wait = 1;
+  bus->retries = BUS_RETRIES;
+
+  if (strncmp(spec, "sim", 3) == 0) {
+    bus->backend = &sim_backend;
+    options = spec + 3;
+    if (*options == ':') {
+      bus->speed_hz = parse_speed(options + 1);
+      while ((options = strchr(options + 1, ':')) != NULL) {
+        if (strncmp(options, ":nowait", 7) == 0) {
+          bus->sim_wait = 0;
+        }
+        else if (strncmp(options, ":nak=", 5) == 0) {
+          bus->sim_nak_every = strtoul(options + 5, NULL, 0);
+        }
+      }
+    }
+    strcpy(bus->device, "sim");
+  }
+  else if (strncmp(spec, "mock:", 5) == 0) {
+    bus->backend = &mock_backend;
+    snprintf(bus->device, sizeof(bus->device), "%s", spec + 5);
+  }
+  else {
+    bus->backend = &i2cdev_backend;
+    if (strncmp(spec, "stub:", 5) == 0) {
+      bus->backend = &stub_backend;
+      spec += 5;
+    }
+    else if (strncmp(spec, "i2c-dev:", 8) == 0) {
+      spec += 8;
+    }
+    if (*spec >= '0' && *spec <= '9') {
+      snprintf(bus->device, sizeof(bus->device), "/dev/i2c-%s", spec);
+    }
+    else {
+      snprintf(bus->device, sizeof(bus->device), "%s", spec);
+    }
+  }
+
+  if (bus->backend->open(bus, bus->device) < 0) {
+    bus->backend = NULL;
+    return -1;
+  }
+  bus_probe(bus);
+  return 0;
+}
+
+
+void bus_close(struct bus *bus) {
+  if (bus->backend != NULL) {
+    bus->backend->close(bus);
+    bus->backend = NULL;
+  }
+}
+
+
+static inline void trace_result(int result, int address) {
+// The end of a transfer - and why it failed, if it did (errno left as it is)
+  int error = errno;
+
+  if (trace_enabled) {
+    trace(TRACE_WRITE_END, result, 0);
+    if (result < 0) {
+      trace(TRACE_ERRNO, error, address);
+    }
+    errno = error;
+  }
+}
+
+
+int bus_write(struct bus *bus, int address, uint8_t *data, int length) {
+// Write one I2C message to a chip. Returns the number of bytes written, or -1:
+  struct i2c_msg message;
+  int result;
+
+  message.addr = address;
+  message.flags = 0;
+  message.len = length;
+  message.buf = data;
+  count_transfer(bus, &message, 1);
+
+  if (bus->backend == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  trace(TRACE_WRITE_BEGIN, address | TRACE_KIND_WRITE << 8, length);
+  result = bus->backend->write(bus, address, data, length);
+  trace_result(result, address);
+  if (result == length) {
+    record_message(address, data, length);
+  }
+  return result;
+}
+
+
+int bus_transfer(struct bus *bus, struct i2c_msg *messages, int count) {
+/*
+  Send several I2C messages in one transaction. The adapter issues a repeated
+  START between messages and a single STOP at the end.
+  Returns the number of messages sent, or -1.
+*/
+  int result, i;
+
+  count_transfer(bus, messages, count);
+
+  if (bus->backend == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  trace(TRACE_WRITE_BEGIN, messages[0].addr | TRACE_KIND_TRANSFER << 8, count);
+  result = bus->backend->transfer(bus, messages, count);
+  trace_result(result, messages[0].addr);
+  if (result == count && atomic_load_explicit(&recorder.enabled, memory_order_relaxed)) {
+    for (i = 0; i < count; i++) {
+      if (!(messages[i].flags & I2C_M_RD)) {
+        record_message(messages[i].addr, messages[i].buf, messages[i].len);
+      }
+    }
+  }
+  return result;
+}
+
+
+int bus_write_smbus(struct bus *bus, int address, uint8_t *data, int length) {
+/*
+  Write one message as an SMBus transfer - "write byte data" or
+  "I2C block write" - instead of a raw I2C write. On the wire it's the same;
+  it's for adapters that only do SMBus (like i2c-stub, whose backend does
+  this anyway). The simulated chips don't care either way.
+  Returns the number of bytes written, or -1.
+*/
+  struct i2c_msg message;
+  int result;
+
+  message.addr = address;
+  message.flags = 0;
+  message.len = length;
+  message.buf = data;
+  count_transfer(bus, &message, 1);
+
+  if (bus->backend == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  trace(TRACE_WRITE_BEGIN, address | TRACE_KIND_SMBUS << 8, length);
+  if (bus->backend == &sim_backend || bus->backend == &mock_backend) {
+    result = bus->backend->write(bus, address, data, length);
+  }
+  else {
+    result = stub_write(bus, address, data, length);
+  }
+  trace_result(result, address);
+  if (result == length) {
+    record_message(address, data, length);
+  }
+  return result;
+}
+
+
+int bus_read(struct bus *bus, int address, uint8_t reg, uint8_t *data, int length) {
+/*
+  Read consecutive registers: write the register address, then read
+  with a repeated START. Returns the number of bytes read, or -1.
+*/
+  struct i2c_msg messages[2];
+
+  messages[0].addr = address;
+  messages[0].flags = 0;
+  messages[0].len = 1;
+  messages[0].buf = &reg;
+  messages[1].addr = address;
+  messages[1].flags = I2C_M_RD;
+  messages[1].len = length;
+  messages[1].buf = data;
+
+  if (bus_transfer(bus, messages, 2) != 2) {
+    return -1;
+  }
+  return length;
+}
+
+
+int bus_retryable(int error) {
+// Failures that may well go away if we try again:
+  return error == EREMOTEIO             // no ACK from the chip (i2c-bcm2835 and others)
+         || error == ENXIO              // no ACK for the address
+         || error == EIO
+         || error == ETIMEDOUT          // the bus was stuck - the adapter has reset it
+         || error == EAGAIN;            // lost arbitration, or the adapter was busy
+}
+
+
+int bus_backoff(struct bus *bus, int attempt, int result, int expected) {
+/*
+  After a transfer: count a failure and decide whether to try again.
+  Returns 1 to retry (having waited for the backoff), 0 to stop.
+*/
+  struct timespec wait;
+  uint64_t ns;
+
+  if (result == expected) {
+    return 0;
+  }
+  bus->stats.errors++;
+  if (result >= 0) {
+    errno = EIO;                        // a short transfer
+  }
+  if (attempt >= bus->retries || !bus_retryable(errno)) {
+    bus->stats.failures++;
+    return 0;
+  }
+  bus->stats.retries++;
+  ns = (uint64_t) BUS_BACKOFF_NS << attempt;
+  wait.tv_sec = ns / 1000000000;
+  wait.tv_nsec = ns % 1000000000;
+  nanosleep(&wait, NULL);
+  return 1;
+}
+
+
+int bus_write_retry(struct bus *bus, int address, uint8_t *data, int length) {
+// bus_write(), tried again after transient failures. Returns length or -1:
+  int attempt, result;
+
+  for (attempt = 0; ; attempt++) {
+    result = bus_write(bus, address, data, length);
+    if (!bus_backoff(bus, attempt, result, length)) {
+      return result == length ? length : -1;
+    }
+  }
+}
+
+
+int bus_write_smbus_retry(struct bus *bus, int address, uint8_t *data, int length) {
+// bus_write_smbus(), tried again after transient failures. Returns length or -1:
+  int attempt, result;
+
+  for (attempt = 0; ; attempt++) {
+    result = bus_write_smbus(bus, address, data, length);
+    if (!bus_backoff(bus, attempt, result, length)) {
+      return result == length ? length : -1;
+    }
+  }
+}
+
+
+int bus_transfer_retry(struct bus *bus, struct i2c_msg *messages, int count) {
+// bus_transfer(), tried again after transient failures. Returns count or -1:
+  int attempt, result;
+
+  for (attempt = 0; ; attempt++) {
+    result = bus_transfer(bus, messages, count);
+    if (!bus_backoff(bus, attempt, result, count)) {
+      return result == count ? count : -1;
+    }
+  }
+}
@@ -0,0 +1,238 @@
+/*
+  Input capture with the MCP23017's own interrupt-on-change logic.
+
+  Instead of reading one Pi GPIO per input, pins of the expanders can be
+  inputs: the chip watches them and, when one changes, pulls its INT
+  output down and remembers which pin it was (INTF) and what all the pins
+  looked like at that moment (INTCAP). We wait for the INT line with the
+  GPIO character device (see edge.c), then read INTFA, INTFB, INTCAPA
+  and INTCAPB - four consecutive registers - in one combined transaction:
+  register address, repeated START, four bytes read. Reading INTCAP
+  clears the interrupt. So up to 16 inputs per chip cost one bus read
+  per event, and no polling at all while nothing happens.
+
+  How the chips are set up (one sequential write per chip, IODIRA...GPPUB):
+
+  IODIR   - 1 for inputs, as given; the rest stay outputs
+  GPINTEN - interrupt-on-change enabled for every input
+  INTCON  - 0: interrupt on any change, 1: interrupt when the pin differs
+            from DEFVAL (give "compare" and "defval" for those pins)
+  GPPU    - pull-ups on the inputs, so that switches to GND just work
+  IOCON   - MIRROR: INTA and INTB are tied together, one INT pin per chip;
+            ODR: the INT pin is open-drain (active low), so the INT pins
+            of several chips can share one Pi GPIO with a pull-up
+
+  The INT line is a clean logic signal, so it isn't debounced - the raw
+  edges are used, and only the falling ones (INT asserted) matter.
+  In case an edge is ever missed while INT stays low, capture_wait()
+  also reads the chips after CAPTURE_SWEEP_MS of quiet.
+
+  Include this after bus.c, edge.c and latency.c.
+*/
+
+#include <poll.h>
+
+#define CAPTURE_CHIPS 8
+#define CAPTURE_SWEEP_MS 100
+#define CAPTURE_SAMPLES 65536
+
+// Register numbers (IOCON.BANK = 0) and IOCON bits used here:
+#define IODIRA_REG 0x00
+#define INTFA_REG 0x0e
+#define IOCON_ODR 0x04
+#define IOCON_MIRROR_BIT 0x40
+
+struct input_chip {
+  int address;
+  uint16_t inputs;              // bit 0...7 - GPA0...7, bit 8...15 - GPB0...7
+  uint16_t compare;             // pins compared against defval instead of their last state
+  uint16_t defval;
+};
+
+struct input_event {
+  uint64_t timestamp_ns;        // when INT went down, from the kernel
+  int address;                  // which chip
+  uint16_t flags;               // INTF - the pins that caused the interrupt
+  uint16_t captured;            // INTCAP - all the pins at that moment
+};
+
+struct capture {
+  struct bus *bus;
+  struct edge_source irq;       // the INT line
+  int chips;
+  struct input_chip chip[CAPTURE_CHIPS];
+  uint8_t registers[CAPTURE_CHIPS][4];          // INTFA, INTFB, INTCAPA, INTCAPB
+  unsigned long interrupts;     // INT edges (and sweeps) handled
+  unsigned long events;         // chips that had something to report
+  unsigned long spurious;       // interrupts with no flags on any chip
+  unsigned long sweeps;         // reads after CAPTURE_SWEEP_MS without an edge
+  struct latency latency;       // INT edge to the registers read
+};
+
+
+int capture_configure(struct capture *capture, struct input_chip *chip) {
+// Set a chip up for interrupt-on-change - one 15-byte write:
+  uint8_t message[15];
+
+  message[0] = IODIRA_REG;
+  message[1] = chip->inputs;                    // IODIRA
+  message[2] = chip->inputs >> 8;               // IODIRB
+  message[3] = 0;                               // IPOLA
+  message[4] = 0;                               // IPOLB
+  message[5] = chip->inputs;                    // GPINTENA
+  message[6] = chip->inputs >> 8;               // GPINTENB
+  message[7] = chip->defval;                    // DEFVALA
+  message[8] = chip->defval >> 8;               // DEFVALB
+  message[9] = chip->compare;                   // INTCONA
+  message[10] = chip->compare >> 8;             // INTCONB
+  message[11] = IOCON_MIRROR_BIT | IOCON_ODR;   // IOCON
+  message[12] = IOCON_MIRROR_BIT | IOCON_ODR;   // IOCON, again at 0x0b
+  message[13] = chip->inputs;                   // GPPUA
+  message[14] = chip->inputs >> 8;              // GPPUB
+
+  if (bus_write(capture->bus, chip->address, message, sizeof(message)) != sizeof(message)) {
+    perror("capture: configuring the chip");
+    return -1;
+  }
+  return 0;
+}
+
+
+int capture_read(struct capture *capture) {
+/*
+  Read INTF and INTCAP of both banks, from all the chips,
+  in one I2C_RDWR transaction: for every chip the register address,
+  then a repeated START and four bytes read.
+*/
+  struct i2c_msg messages[2 * CAPTURE_CHIPS];
+  static uint8_t reg = INTFA_REG;
+  int c;
+
+  for (c = 0; c < capture->chips; c++) {
+    messages[2 * c].addr = capture->chip[c].address;
+    messages[2 * c].flags = 0;
+    messages[2 * c].len = 1;
+    messages[2 * c].buf = &reg;
+    messages[2 * c + 1].addr = capture->chip[c].address;
+    messages[2 * c + 1].flags = I2C_M_RD;
+    messages[2 * c + 1].len = 4;
+    messages[2 * c + 1].buf = capture->registers[c];
+  }
+  if (bus_transfer(capture->bus, messages, 2 * capture->chips) != 2 * capture->chips) {
+    return -1;
+  }
+  return 0;
+}
+
+
+int capture_open(struct capture *capture, struct bus *bus, const char *irq_spec) {
+/*
+  Configure the chips already listed in capture->chip and open the INT line
+  (an edge source spec, see edge.c). The previous pin states are read,
+  so that any interrupt pending from before is cleared.
+  Returns 0 or -1.
+*/
+  int c;
+
+  capture->bus = bus;
+  capture->interrupts = capture->events = capture->spurious = capture->sweeps = 0;
+  if (capture->chips < 1 || capture->chips > CAPTURE_CHIPS) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (c = 0; c < capture->chips; c++) {
+    if (capture_configure(capture, &capture->chip[c]) < 0) {
+      return -1;
+    }
+  }
+  capture->irq.debounce_ns = 0;
+  if (edge_open(&capture->irq, irq_spec) < 0) {
+    return -1;
+  }
+  if (latency_init(&capture->latency, CAPTURE_SAMPLES) < 0 || capture_read(capture) < 0) {
+    edge_close(&capture->irq);
+    return -1;
+  }
+  return 0;
+}
+
+
+void capture_close(struct capture *capture) {
+  edge_close(&capture->irq);
+  free(capture->latency.samples);
+  capture->latency.samples = NULL;
+}
+
+
+int capture_wait(struct capture *capture, struct input_event *events) {
+/*
+  Wait for the INT line to go down, then read the chips.
+  Fills in one event per chip with flags set (events must have room for
+  capture->chips of them) and returns how many there are,
+  0 if the interrupt was spurious, or -1 on error.
+*/
+  struct edge_event edge_event;
+  struct pollfd waiting;
+  uint64_t timestamp_ns = 0;
+  int c, count, result, swept = 0;
+
+  waiting.fd = capture->irq.fd;
+  waiting.events = POLLIN;
+
+  while (timestamp_ns == 0) {
+// Take the raw edges - no debouncing, the rising ones (INT released) don't matter:
+    while ((result = capture->irq.backend->read(&capture->irq, &edge_event)) == 1) {
+      if (!edge_event.rising && timestamp_ns == 0) {
+        timestamp_ns = edge_event.timestamp_ns;
+      }
+    }
+    if (result < 0) {
+      return -1;
+    }
+    if (timestamp_ns) {
+      break;
+    }
+    result = poll(&waiting, 1, CAPTURE_SWEEP_MS);
+    if (result < 0 && errno != EINTR) {
+      return -1;
+    }
+    if (result == 0) {
+      capture->sweeps++;
+      swept = 1;
+      timestamp_ns = monotonic_ns();
+    }
+  }
+
+  if (capture_read(capture) < 0) {
+    return -1;
+  }
+  capture->interrupts++;
+
+  count = 0;
+  for (c = 0; c < capture->chips; c++) {
+    uint8_t *registers = capture->registers[c];
+    if (registers[0] == 0 && registers[1] == 0) {
+      continue;
+    }
+    events[count].timestamp_ns = timestamp_ns;
+    events[count].address = capture->chip[c].address;
+    events[count].flags = registers[0] | registers[1] << 8;
+    events[count].captured = registers[2] | registers[3] << 8;
+    count++;
+  }
+  if (count && !swept) {
+    latency_add(&capture->latency, monotonic_ns() - timestamp_ns);
+  }
+  else if (!swept) {
+    capture->spurious++;
+  }
+  capture->events += count;
+  return count;
+}
+
+
+void capture_report(struct capture *capture, FILE *out) {
+  fprintf(out, "capture: %lu interrupts, %lu chip events, %lu spurious, %lu sweeps\n",
+          capture->interrupts, capture->events, capture->spurious, capture->sweeps);
+  latency_print(&capture->latency, "INT edge to INTF/INTCAP read", out);
+}
@@ -1,6 +1,11 @@
 #include "./interface.c"
 
-void main(void) {
+int main(int argc, char **argv) {
+/*
+  Run it with "-m" to measure how quickly send_codes
+  wakes up on an edge, and how much CPU it takes.
+*/
+  measure_wakeups = argc > 1 && strcmp(argv[1], "-m") == 0;
 /*
   In the main loop of your program, you need to
   call the interface_setup() function to get it
@@ -29,4 +34,9 @@ void main(void) {
   send_codes(0x22, 42, 0265, 0b01010101);
   send_codes(0x11, 53, 0144, 0b10101010);
   send_codes(0x22, 42, 0265, 0b01010101);
+
+  if (measure_wakeups) {
+    wakeup_report(stdout);
+  }
+  return 0;
 }
@@ -0,0 +1,236 @@
+/*
+  The output daemon (mcp23017d) and its clients - what they share.
+
+  The daemon owns the buses and the chips: it sets them up once, keeps
+  the output state, and every other program sends it output words
+  instead of opening /dev/i2c-1 and running mcp_init() by itself.
+  So programs start instantly, don't turn off each other's outputs,
+  and can run at the same time.
+
+  Two ways to talk to the daemon:
+
+  control - a Unix socket (MCP23017_DAEMON, or DAEMON_SOCKET), one text
+            command per message: "attach" (get a slot in shared memory),
+            "stats", "off". Slow, but only used for setting up.
+  outputs - shared memory (DAEMON_SHM): every attached client has its own
+            slot with a ring of commands - one producer (the client),
+            one consumer (the daemon), no locks. The client copies a command
+            into the ring and rings the doorbell; the daemon sleeps on the
+            doorbell with a futex, so ringing it is a syscall only when
+            the daemon is actually asleep.
+
+  A command says which output bits the client sets (mask) and to what
+  (value); the other bits stay as they are - so clients can share chips,
+  each driving its own outputs. The daemon takes all the commands waiting
+  in all the rings, applies them in order, and writes the result in one
+  update - several commands, one bus transaction.
+  So the outputs go through every state a client asks for only if it waits
+  for each command to be written (daemon_flush()) before sending the next;
+  otherwise the daemon may skip straight to the latest one.
+
+  Include this after bus.c (or interface.c) - it needs nothing else.
+  The client functions are at the bottom.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+
+#define DAEMON_SOCKET "/tmp/mcp23017d.sock"
+#define DAEMON_SHM "/mcp23017d"
+#define DAEMON_MAGIC 0x4d435044         // "MCPD"
+#define DAEMON_VERSION 1
+#define DAEMON_CLIENTS 16
+#define DAEMON_RING 64                  // commands per client, a power of two
+#define DAEMON_CHIPS 64                 // the same as MAX_CHIPS in devices.c
+#define DAEMON_MESSAGE 1024             // longest control message
+#define DAEMON_FLUSH_CHECK_MS 100       // daemon_flush(): how often to check the daemon is still there
+
+struct daemon_command {
+  uint8_t mask[DAEMON_CHIPS][2];        // 1 - this output is set by the command
+  uint8_t value[DAEMON_CHIPS][2];
+};
+
+/*
+  A client's slot. The ring works like the one in ring.c, but keeps its
+  entries in place - the slot is mapped at different addresses in different
+  processes, so there can't be any pointers in it.
+*/
+struct daemon_slot {
+  _Alignas(64) atomic_ulong head;       // written by the client
+  _Alignas(64) atomic_ulong tail;       // written by the daemon
+  _Alignas(64) atomic_uint done;        // commands the daemon has written out
+  atomic_int flushing;                  // the client is waiting for "done"
+  atomic_int in_use;
+  unsigned long full;                   // client side: times the ring was full
+  struct daemon_command entries[DAEMON_RING];
+};
+
+struct daemon_shm {
+  uint32_t magic;
+  uint32_t version;
+  int chips;                            // chips the daemon drives
+  _Alignas(64) atomic_uint doorbell;    // bumped for every command
+  atomic_int waiting;                   // the daemon is (about to be) asleep
+  struct daemon_slot slot[DAEMON_CLIENTS];
+};
+
+struct daemon_client {
+  int socket;
+  struct daemon_shm *shm;
+  struct daemon_slot *slot;
+  int number;                           // slot number
+  unsigned int submitted;               // commands put in the ring
+};
+
+
+long shm_futex(atomic_uint *word, int operation, unsigned int value, const struct timespec *timeout) {
+// A futex shared between processes - no FUTEX_PRIVATE_FLAG here. timeout: for FUTEX_WAIT, or NULL
+  return syscall(SYS_futex, word, operation, value, timeout, NULL, 0);
+}
+
+
+const char *daemon_socket_path(void) {
+  const char *path = getenv("MCP23017_DAEMON");
+  return path != NULL && *path ? path : DAEMON_SOCKET;
+}
+
+
+/*
+  The client side:
+*/
+
+int daemon_request(struct daemon_client *client, const char *request, char *reply, int size) {
+// Send a control command and get the answer. Returns its length, or -1.
+  int length;
+
+  if (send(client->socket, request, strlen(request), 0) < 0) {
+    return -1;
+  }
+  length = recv(client->socket, reply, size - 1, 0);
+  if (length <= 0) {
+    if (length == 0) {
+      errno = ECONNRESET;
+    }
+    return -1;
+  }
+  reply[length] = 0;
+  return length;
+}
+
+
+int daemon_connect(struct daemon_client *client) {
+/*
+  Connect to the daemon, get a slot and map the shared memory.
+  Returns 0, or -1 (is the daemon running?).
+*/
+  struct sockaddr_un address;
+  char reply[DAEMON_MESSAGE], name[64];
+  int fd;
+
+  memset(client, 0, sizeof(*client));
+  client->socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (client->socket < 0) {
+    return -1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", daemon_socket_path());
+  if (connect(client->socket, (struct sockaddr *) &address, sizeof(address)) < 0
+      || daemon_request(client, "attach", reply, sizeof(reply)) < 0) {
+    close(client->socket);
+    return -1;
+  }
+  if (sscanf(reply, "ok %d %63s", &client->number, name) != 2) {
+    fprintf(stderr, "daemon: %s\n", reply);
+    close(client->socket);
+    errno = EBUSY;
+    return -1;
+  }
+
+  fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    close(client->socket);
+    return -1;
+  }
+  client->shm = mmap(NULL, sizeof(struct daemon_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (client->shm == MAP_FAILED || client->shm->magic != DAEMON_MAGIC
+      || client->shm->version != DAEMON_VERSION) {
+    close(client->socket);
+    errno = EPROTO;
+    return -1;
+  }
+  client->slot = &client->shm->slot[client->number];
+  return 0;
+}
+
+
+void daemon_disconnect(struct daemon_client *client) {
+// The daemon frees the slot when the socket closes
+  munmap(client->shm, sizeof(struct daemon_shm));
+  close(client->socket);
+}
+
+
+int daemon_submit(struct daemon_client *client, const struct daemon_command *command) {
+/*
+  Queue a command and ring the doorbell. Returns 1, or 0 if the ring is full
+  (the daemon is behind - try again a bit later).
+*/
+  struct daemon_slot *slot = client->slot;
+  unsigned long head = atomic_load_explicit(&slot->head, memory_order_relaxed);
+  unsigned long tail = atomic_load_explicit(&slot->tail, memory_order_acquire);
+
+  if (head - tail >= DAEMON_RING) {
+    slot->full++;
+    return 0;
+  }
+  memcpy(&slot->entries[head & (DAEMON_RING - 1)], command, sizeof(*command));
+  atomic_store_explicit(&slot->head, head + 1, memory_order_release);
+  client->submitted++;
+
+// Only wake the daemon if it's asleep (it checks the doorbell before sleeping):
+  atomic_fetch_add(&client->shm->doorbell, 1);
+  if (atomic_load(&client->shm->waiting)) {
+    shm_futex(&client->shm->doorbell, FUTEX_WAKE, 1, NULL);
+  }
+  return 1;
+}
+
+
+int daemon_flush(struct daemon_client *client) {
+/*
+  Wait until everything submitted so far has been written to the chips.
+  Returns 0, or -1 (ECONNRESET) if the daemon has gone away meanwhile -
+  its socket tells us, and we look every DAEMON_FLUSH_CHECK_MS.
+*/
+  static const struct timespec check = { 0, DAEMON_FLUSH_CHECK_MS * 1000000L };
+  struct daemon_slot *slot = client->slot;
+  struct pollfd gone = { client->socket, 0, 0 };
+  unsigned int done;
+
+  atomic_store(&slot->flushing, 1);
+  while ((int) ((done = atomic_load(&slot->done)) - client->submitted) < 0) {
+    if (shm_futex(&slot->done, FUTEX_WAIT, done, &check) < 0 && errno == ETIMEDOUT
+        && poll(&gone, 1, 0) > 0 && gone.revents & (POLLHUP | POLLERR)) {
+      atomic_store(&slot->flushing, 0);
+      errno = ECONNRESET;
+      return -1;
+    }
+  }
+  atomic_store(&slot->flushing, 0);
+  return 0;
+}
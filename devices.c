@@ -0,0 +1,1118 @@
+/*
+  The device table - which MCP23017 chips we drive, and on which buses.
+
+  One I2C bus takes up to 8 chips (addresses 0x20...0x27), 16 outputs each.
+  Newer Raspberry Pis have several buses, so the table can hold up to
+  8 buses with up to 8 chips each. The chips are numbered in table order:
+  the first bus's chips first, then the next bus's, and so on.
+  An output_word holds a byte for bank A and bank B of every chip.
+
+  The table comes from the MCP23017_DEVICES environment variable:
+  bus specs (see bus.c), each followed by "@" and the chip addresses,
+  separated by ";":
+
+  MCP23017_DEVICES="/dev/i2c-1@0x20,0x21"                    - the default
+  MCP23017_DEVICES="/dev/i2c-1@0x20-0x27;/dev/i2c-3@0x20-0x27" - 256 outputs
+  MCP23017_DEVICES="sim:400k@0x20-0x27;sim:400k@0x20-0x27"   - simulated
+
+  Without MCP23017_DEVICES, it's chips 0x20 and 0x21 on the MCP23017_BUS bus.
+  Addresses go from 0x20 to 0x27, each at most once on a bus.
+
+  Every bus beyond the first gets a worker thread. An update hands each
+  worker the word, writes the first bus's chips itself, then waits until
+  all workers are done - so the buses are written in parallel, and an
+  update takes as long as the slowest bus, not all of them added up.
+
+  Writes are checked: failed transfers are retried (see bus.c), and
+  a chip that still can't be written gets its error count bumped and its
+  shadow registers forgotten, so the next update rewrites it in full.
+
+  Every verify_every-th update (0 - never; MCP23017_VERIFY sets it)
+  is verified as well: each chip's output latches (OLATA, OLATB) and
+  directions (IODIRA, IODIRB) are read back in the same I2C_RDWR
+  transaction as the write, after a repeated START. A chip that holds
+  something else than we wrote - say, it has been reset by a brown-out
+  and all its pins are inputs again - counts a mismatch and is set up
+  again (IODIR, then the outputs).
+
+  Each bus is written in the cheapest way its adapter supports, picked
+  when it's opened (see pick_write_mode()), unless write_mode says
+  otherwise. devices_report() tells what was picked.
+
+  With write_mode = WRITE_URING, each bus has an io_uring (see uring.c):
+  an update queues a write for every chip that needs one and submits them
+  all with one syscall, without waiting for them. The results are picked
+  up at the next update - by then the writes are normally long done;
+  if they aren't, that update waits for them first - and so does anything
+  else that uses the bus (readback, a restore, a probe, a write in another
+  mode) - so a chip never gets two writes in the wrong order. A write that failed makes the chip's
+  shadow registers forgotten, so the next update rewrites it in full.
+  Buses without per-chip descriptors (sim) are written as in WRITE_BURST.
+
+  Low skew (low_skew, or MCP23017_SKEW=1): the outputs of an update don't
+  all change at once - each byte changes when its ACK is clocked, chip
+  after chip, so the last one lands a whole transaction after the first
+  (on a 100 kHz bus, two chips written one register at a time: over
+  800 us). To keep that as short as the wiring allows:
+
+  - every bus that can do it is written in one I2C_RDWR transaction
+    (repeated STARTs, no STOP, no syscalls between the chips), even
+    with a single chip; buses that can't keep their picked mode
+  - the buses start together: each one's thread waits for all the others
+    to be ready, then they all go - instead of the first bus starting
+    right away and the others when their workers have woken up.
+    Spread the chips over buses, and the skew is that of the busiest one.
+
+  That costs the first bus the time it takes to wake the workers; the
+  last output lands no later than before. benchmark skew has the numbers.
+
+  The chips of a bus are written in table order, unless MCP23017_PRIORITY
+  (or devices_priority()) names chips - by number, like pin maps do - to
+  go first, in that order: "3,1" writes chip 3 first on its bus, then
+  chip 1 if it's on the same bus, then the rest. Outputs that are the
+  most timing-critical go on the chips written first.
+
+  Warm attach (warm_attach, or MCP23017_WARM=1): a program that starts
+  while the chips are already set up - say, the previous one has just
+  exited, or crashed, leaving some outputs on - doesn't have to set them
+  up again and turn everything off. mcp_init() reads each chip's IODIR,
+  IOCON and OLAT registers back instead (see probe_bus_chips()), takes
+  what it finds as the shadow registers, and writes only what isn't
+  right yet. The outputs stay as they were, and chips that are set up
+  already take no writes at all.
+
+  Include this after the register constants and write modes in interface.c.
+*/
+
+#include <stdatomic.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define MAX_BUSES 8
+#define MAX_CHIPS_PER_BUS 8
+#define MAX_CHIPS (MAX_BUSES * MAX_CHIPS_PER_BUS)
+#define MCP_REGISTERS 0x16
+#define MCP_FIRST_ADDR 0x20             // A2 A1 A0 pick one of eight addresses
+#define MCP_LAST_ADDR 0x27
+
+/*
+  A code word already translated into register values:
+  value[chip][bank], ready to go to GPIOA/GPIOB of each chip.
+  Producers (like the job player) prepare these in advance, so that
+  the output path only has to send them.
+*/
+struct output_word {
+  uint8_t value[MAX_CHIPS][2];
+};
+
+/*
+  Shadow registers - what we last wrote to each chip, so that we don't
+  write the same value again. Every code word is followed by all_off(),
+  and most code words change only one or two of the four bytes,
+  so most of the time there's little or nothing to send.
+  A register is trusted only once it's been written successfully
+  (its bit is set in "known"); mcp_init() starts with nothing known.
+  Set shadow_enabled to 0 to write every register every time.
+*/
+struct mcp_shadow {
+  uint8_t value[MCP_REGISTERS];  // IODIR, GPIO, OLAT... indexed by register address
+  uint32_t known;                // bit n set: value[n] is what the chip holds
+};
+
+struct mcp_chip {
+  int address;
+  struct mcp_shadow shadow;
+  unsigned long errors;                 // writes that failed, retries and all
+  unsigned long mismatches;             // verified registers that didn't hold what we wrote
+};
+
+struct chip_bus {
+  struct bus bus;
+  char spec[64];                        // as given to bus_open()
+  int chips;
+  int first;                            // number of this bus's first chip in output words
+  struct mcp_chip chip[MAX_CHIPS_PER_BUS];
+  pthread_t worker;
+  unsigned int seen;                    // the last update the worker has done
+  unsigned long updates;                // for picking the updates to verify
+  int mode;                             // write mode picked for this bus's adapter
+  int order[MAX_CHIPS_PER_BUS];         // the chips (indices into chip[]) in the order they're written
+  struct uring uring;                   // WRITE_URING: set up on the first update
+  uint8_t uring_bursts[MAX_CHIPS_PER_BUS][3];   // ...the messages it's writing
+};
+
+struct device_table {
+  int buses;
+  int chips;
+  struct chip_bus bus[MAX_BUSES];
+// The job the workers are doing - for an update, task is write_task():
+  void (*task)(struct chip_bus *line);
+  const struct output_word *word;
+  uint8_t reg;
+  atomic_uint generation;               // bumped for every update - workers wait on it
+  atomic_uint pending;                  // workers still busy - the caller waits on it
+  atomic_uint arrived;                  // low skew: buses ready to start the update
+  int stopping;
+  int workers;                          // worker threads running
+  int opened;                           // devices_open() has been done
+} devices;
+
+int write_mode = WRITE_AUTO;            // How set_outputs() talks to the chips
+static const char *write_mode_names[] = { "single", "burst", "rdwr", "smbus", "uring" };
+int shadow_enabled = 1;
+int verify_every = 0;                   // Read back every Nth update, 0 - never
+int warm_attach = 0;                    // mcp_init() keeps what the chips hold
+int low_skew = 0;                       // Buses start together, one transaction each
+
+
+long futex(atomic_uint *word, int operation, unsigned int value) {
+  return syscall(SYS_futex, word, operation, value, NULL, NULL, 0);
+}
+
+
+int shadow_clean(struct mcp_chip *chip, uint8_t reg, uint8_t value) {
+// Does the chip already hold this value in the register?
+  return shadow_enabled
+         && (chip->shadow.known & (1u << reg))
+         && chip->shadow.value[reg] == value;
+}
+
+
+void shadow_store(struct mcp_chip *chip, uint8_t *message, int length, int result) {
+/*
+  Record what a message has written. The first byte is the register address,
+  the next bytes went to consecutive registers. Writing GPIOx sets OLATx too.
+  If the write didn't go through, we don't know the chip state anymore -
+  forget it, so that the next update rewrites everything.
+*/
+  uint8_t reg;
+  int i;
+
+  if (result != length) {
+    chip->shadow.known = 0;
+    return;
+  }
+  for (i = 1; i < length; i++) {
+    reg = message[0] + i - 1;
+    chip->shadow.value[reg] = message[i];
+    chip->shadow.known |= 1u << reg;
+    if (reg == GPIOA || reg == GPIOB) {
+      chip->shadow.value[reg + 2] = message[i];
+      chip->shadow.known |= 1u << (reg + 2);
+    }
+  }
+}
+
+
+void shadow_invalidate(void) {
+// Forget everything we know about the chips' registers:
+  int b, c;
+
+  for (b = 0; b < devices.buses; b++) {
+    for (c = 0; c < devices.bus[b].chips; c++) {
+      memset(&devices.bus[b].chip[c].shadow, 0, sizeof(struct mcp_shadow));
+    }
+  }
+}
+
+
+int prepare_pair(struct chip_bus *line, struct mcp_chip *chip, uint8_t reg,
+                 uint8_t value_a, uint8_t value_b, uint8_t *message) {
+/*
+  Build the shortest message that sets a pair of A/B registers (IODIRA/IODIRB,
+  GPIOA/GPIOB...) on a chip: both dirty - one sequential 3-byte write,
+  one dirty - a 2-byte write, none - nothing at all. Returns the length.
+*/
+  int dirty_a, dirty_b;
+
+  dirty_a = !shadow_clean(chip, reg, value_a);
+  dirty_b = !shadow_clean(chip, reg + 1, value_b);
+  line->bus.stats.elided += !dirty_a + !dirty_b;
+  if (!dirty_a) {
+    trace(TRACE_ELIDED, chip->address, reg);
+  }
+  if (!dirty_b) {
+    trace(TRACE_ELIDED, chip->address, reg + 1);
+  }
+
+  if (dirty_a && dirty_b) {
+    message[0] = reg;
+    message[1] = value_a;
+    message[2] = value_b;
+    return 3;
+  }
+  if (dirty_a) {
+    message[0] = reg;
+    message[1] = value_a;
+    return 2;
+  }
+  if (dirty_b) {
+    message[0] = reg + 1;
+    message[1] = value_b;
+    return 2;
+  }
+  return 0;
+}
+
+
+void uring_done(uint64_t user_data, int result, void *argument);
+
+
+void drain_uring(struct chip_bus *line) {
+/*
+  Before anything else is written to this bus: wait for the io_uring writes
+  still in flight (see write_bus_uring()), so none of them can land after it.
+*/
+  if (line->uring.rings == NULL) {
+    return;
+  }
+  uring_reap(&line->uring, uring_done, line);
+  if (line->uring.inflight) {
+    line->bus.stats.syscalls++;
+    uring_submit(&line->uring, line->uring.inflight);
+    uring_reap(&line->uring, uring_done, line);
+  }
+}
+
+
+void write_bursts_one_by_one(struct chip_bus *line, uint8_t (*bursts)[3], int *lengths) {
+/*
+  A combined transaction failed even after retries - we don't know which
+  chip is to blame, or what got through. Send every chip its message
+  on its own: the chips that answer are up to date, the one that doesn't
+  gets the error counted (and its shadow forgotten).
+*/
+  struct mcp_chip *chip;
+  int i, c, result;
+
+  for (i = 0; i < line->chips; i++) {
+    c = line->order[i];
+    if (lengths[c]) {
+      chip = &line->chip[c];
+      result = bus_write_retry(&line->bus, chip->address, bursts[c], lengths[c]);
+      shadow_store(chip, bursts[c], lengths[c], result);
+      chip->errors += result < 0;
+    }
+  }
+}
+
+
+void restore_chip(struct chip_bus *line, struct mcp_chip *chip, uint8_t reg, const uint8_t *values) {
+// Set a chip up from scratch: all pins outputs, then the pair we wanted to write
+  uint8_t message[3] = { IODIRA, OUTPUT_BYTE, OUTPUT_BYTE };
+  int result;
+
+  drain_uring(line);
+  chip->shadow.known = 0;
+  result = bus_write_retry(&line->bus, chip->address, message, 3);
+  shadow_store(chip, message, 3, result);
+  message[0] = reg;
+  message[1] = values[0];
+  message[2] = values[1];
+  if (result == 3) {
+    result = bus_write_retry(&line->bus, chip->address, message, 3);
+    shadow_store(chip, message, 3, result);
+  }
+  chip->errors += result < 0;
+}
+
+
+void verify_bus_pairs(struct chip_bus *line, uint8_t reg, const struct output_word *word) {
+/*
+  Write a pair of registers like write_bus_pairs() does in WRITE_RDWR mode,
+  and read them back in the same transaction: for every chip, its write
+  (if anything's dirty), then the register address and a 2-byte read.
+  Writing GPIOx sets OLATx, and that's what we read - GPIOx would return
+  the pin levels, which a shorted output could pull the other way.
+  OLAT alone won't tell a chip that has been reset, though: it takes
+  the writes all right, but its pins are inputs - so for the outputs,
+  IODIR is read too (two more messages per chip, 5 bytes on the wire).
+  Chips that don't need writing are read as well: a chip that has been
+  reset behind our back is exactly what we're looking for.
+*/
+  static uint8_t olat_reg = OLATA, iodir_reg = IODIRA;
+  const uint8_t (*values)[2] = &word->value[line->first];
+  uint8_t bursts[MAX_CHIPS_PER_BUS][3];
+  int lengths[MAX_CHIPS_PER_BUS];
+  uint8_t readback[MAX_CHIPS_PER_BUS][2], directions[MAX_CHIPS_PER_BUS][2];
+  uint8_t readback_reg = reg;
+  struct i2c_msg messages[5 * MAX_CHIPS_PER_BUS];
+  struct mcp_chip *chip;
+  int i, c, count = 0, outputs = reg == GPIOA;
+
+  drain_uring(line);
+  for (i = 0; i < line->chips; i++) {
+    c = line->order[i];
+    chip = &line->chip[c];
+    lengths[c] = prepare_pair(line, chip, reg, values[c][0], values[c][1], bursts[c]);
+    if (lengths[c]) {
+      messages[count].addr = chip->address;
+      messages[count].flags = 0;
+      messages[count].len = lengths[c];
+      messages[count].buf = bursts[c];
+      count++;
+    }
+    if (outputs) {
+      messages[count].addr = chip->address;
+      messages[count].flags = 0;
+      messages[count].len = 1;
+      messages[count].buf = &iodir_reg;
+      count++;
+      messages[count].addr = chip->address;
+      messages[count].flags = I2C_M_RD;
+      messages[count].len = 2;
+      messages[count].buf = directions[c];
+      count++;
+    }
+    messages[count].addr = chip->address;
+    messages[count].flags = 0;
+    messages[count].len = 1;
+    messages[count].buf = outputs ? &olat_reg : &readback_reg;
+    count++;
+    messages[count].addr = chip->address;
+    messages[count].flags = I2C_M_RD;
+    messages[count].len = 2;
+    messages[count].buf = readback[c];
+    count++;
+  }
+
+  if (bus_transfer_retry(&line->bus, messages, count) != count) {
+    write_bursts_one_by_one(line, bursts, lengths);
+    return;
+  }
+  for (i = 0; i < line->chips; i++) {
+    c = line->order[i];
+    chip = &line->chip[c];
+    if (lengths[c]) {
+      shadow_store(chip, bursts[c], lengths[c], lengths[c]);
+    }
+    if (readback[c][0] != values[c][0] || readback[c][1] != values[c][1]
+        || (outputs && (directions[c][0] != OUTPUT_BYTE || directions[c][1] != OUTPUT_BYTE))) {
+      chip->mismatches++;
+      restore_chip(line, chip, reg, values[c]);
+    }
+  }
+}
+
+
+void uring_done(uint64_t user_data, int result, void *argument) {
+// A write has completed (user_data: chip number << 8 | length) - did it go through?
+  struct chip_bus *line = argument;
+  struct mcp_chip *chip = &line->chip[user_data >> 8];
+
+  if (result != (int) (user_data & 0xff)) {
+    chip->shadow.known = 0;
+    chip->errors++;
+    line->bus.stats.errors++;
+    line->bus.stats.failures++;
+    trace(TRACE_ERRNO, result < 0 ? -result : EIO, chip->address);
+  }
+}
+
+
+int write_bus_uring(struct chip_bus *line, uint8_t reg, const uint8_t (*values)[2]) {
+/*
+  WRITE_URING: the bursts of WRITE_BURST, submitted with one syscall.
+  The shadow registers are updated right away, as if the writes had
+  gone through; uring_done() puts it right when they haven't.
+  Returns 0, or -1 if this bus can't do it - write it some other way.
+*/
+  struct i2c_msg messages[MAX_CHIPS_PER_BUS];
+  struct mcp_chip *chip;
+  int i, c, fd, length, count = 0;
+
+  if (line->bus.backend->chip_fd == NULL) {
+    return -1;
+  }
+  if (line->uring.rings == NULL && uring_init(&line->uring, 2 * MAX_CHIPS_PER_BUS) < 0) {
+    perror("io_uring");
+    return -1;
+  }
+
+// The last update's writes - done by now, usually; if not, wait:
+  drain_uring(line);
+
+  for (i = 0; i < line->chips; i++) {
+    c = line->order[i];
+    chip = &line->chip[c];
+    length = prepare_pair(line, chip, reg, values[c][0], values[c][1], line->uring_bursts[c]);
+    if (length == 0) {
+      continue;
+    }
+    fd = line->bus.backend->chip_fd(&line->bus, chip->address);
+    if (fd < 0 || uring_write(&line->uring, fd, line->uring_bursts[c], length, c << 8 | length) < 0) {
+      chip->shadow.known = 0;
+      chip->errors++;
+      continue;
+    }
+    shadow_store(chip, line->uring_bursts[c], length, length);
+    messages[count].addr = chip->address;
+    messages[count].flags = 0;
+    messages[count].len = length;
+    messages[count].buf = line->uring_bursts[c];
+    count++;
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  count_transfer(&line->bus, messages, count);
+  trace(TRACE_WRITE_BEGIN, messages[0].addr | TRACE_KIND_TRANSFER << 8, count);
+  if (uring_submit(&line->uring, 0) < 0) {
+// Nothing was submitted - throw the ring away with the writes in it:
+    trace(TRACE_ERRNO, errno, messages[0].addr);
+    perror("io_uring_enter");
+    for (c = 0; c < line->chips; c++) {
+      line->chip[c].shadow.known = 0;
+    }
+    line->bus.stats.errors++;
+    uring_free(&line->uring);
+  }
+  else {
+// Handed to the kernel - that's when they count as written (see uring_done() for failures):
+    for (i = 0; i < count; i++) {
+      record_message(messages[i].addr, messages[i].buf, messages[i].len);
+    }
+  }
+  trace(TRACE_WRITE_END, count, 0);
+  return 0;
+}
+
+
+void write_bus_pairs(struct chip_bus *line, uint8_t reg, const struct output_word *word) {
+/*
+  Write a pair of A/B registers on every chip of one bus, values taken
+  from the word. Registers already holding the value are skipped.
+*/
+  const uint8_t (*values)[2] = &word->value[line->first];
+  uint8_t bursts[MAX_CHIPS_PER_BUS][3];
+  int lengths[MAX_CHIPS_PER_BUS];
+  struct i2c_msg messages[MAX_CHIPS_PER_BUS];
+  struct mcp_chip *chip;
+  uint8_t single[2];
+  int i, c, bank, count, result;
+  int mode = write_mode == WRITE_AUTO ? line->mode : write_mode;
+
+  if (low_skew && (line->bus.funcs & I2C_FUNC_I2C)) {
+    mode = WRITE_RDWR;
+  }
+  if (mode != WRITE_URING) {
+    drain_uring(line);
+  }
+
+  if (verify_every && ++line->updates % verify_every == 0) {
+    verify_bus_pairs(line, reg, word);
+    return;
+  }
+
+  switch (mode) {
+
+  case WRITE_SINGLE:
+// One message per register, like the original demo - but only dirty ones:
+    for (i = 0; i < line->chips; i++) {
+      c = line->order[i];
+      chip = &line->chip[c];
+      for (bank = 0; bank < 2; bank++) {
+        if (shadow_clean(chip, reg + bank, values[c][bank])) {
+          line->bus.stats.elided++;
+          trace(TRACE_ELIDED, chip->address, reg + bank);
+          continue;
+        }
+        single[0] = reg + bank;
+        single[1] = values[c][bank];
+        result = bus_write_retry(&line->bus, chip->address, single, 2);
+        shadow_store(chip, single, 2, result);
+        chip->errors += result < 0;
+      }
+    }
+    break;
+
+  case WRITE_URING:
+    if (write_bus_uring(line, reg, values) == 0) {
+      break;
+    }
+// No io_uring here - plain writes:
+    /* fall through */
+  case WRITE_BURST:
+  case WRITE_SMBUS:
+// Start at bank A, the chip moves on to bank B by itself:
+    for (i = 0; i < line->chips; i++) {
+      c = line->order[i];
+      chip = &line->chip[c];
+      lengths[c] = prepare_pair(line, chip, reg, values[c][0], values[c][1], bursts[c]);
+      if (lengths[c]) {
+        if (mode == WRITE_SMBUS) {
+          result = bus_write_smbus_retry(&line->bus, chip->address, bursts[c], lengths[c]);
+        }
+        else {
+          result = bus_write_retry(&line->bus, chip->address, bursts[c], lengths[c]);
+        }
+        shadow_store(chip, bursts[c], lengths[c], result);
+        chip->errors += result < 0;
+      }
+    }
+    break;
+
+  case WRITE_RDWR:
+// The same bursts as above, but handed to the kernel at once:
+    count = 0;
+    for (i = 0; i < line->chips; i++) {
+      c = line->order[i];
+      chip = &line->chip[c];
+      lengths[c] = prepare_pair(line, chip, reg, values[c][0], values[c][1], bursts[c]);
+      if (lengths[c]) {
+        messages[count].addr = chip->address;
+        messages[count].flags = 0;
+        messages[count].len = lengths[c];
+        messages[count].buf = bursts[c];
+        count++;
+      }
+    }
+    if (count == 0) {
+      break;
+    }
+// The ioctl returns the number of messages sent, all or nothing:
+    if (bus_transfer_retry(&line->bus, messages, count) == count) {
+      for (c = 0; c < line->chips; c++) {
+        if (lengths[c]) {
+          shadow_store(&line->chip[c], bursts[c], lengths[c], lengths[c]);
+        }
+      }
+    }
+    else {
+      write_bursts_one_by_one(line, bursts, lengths);
+    }
+    break;
+  }
+}
+
+
+void start_together(void) {
+/*
+  Low skew: wait until every bus is ready to write, then all go at once.
+  Spins - with sched_yield(), so that the others get to run even on
+  a single CPU.
+*/
+  atomic_fetch_add(&devices.arrived, 1);
+  while (atomic_load(&devices.arrived) <= (unsigned) devices.workers) {
+    sched_yield();
+  }
+}
+
+
+void *bus_worker(void *argument) {
+// A worker thread: wait for a job, do it on this bus's chips, report back
+  struct chip_bus *line = argument;
+  unsigned int now;
+  struct sched_param param;
+
+  if (realtime.enabled) {
+    param.sched_priority = realtime.priority;
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  }
+  if (trace_enabled) {
+    trace_thread();
+  }
+
+  for (;;) {
+    while ((now = atomic_load(&devices.generation)) == line->seen) {
+      futex(&devices.generation, FUTEX_WAIT_PRIVATE, line->seen);
+    }
+    line->seen = now;
+    if (devices.stopping) {
+      return NULL;
+    }
+    if (low_skew) {
+      start_together();
+    }
+    devices.task(line);
+    if (atomic_fetch_sub(&devices.pending, 1) == 1) {
+      futex(&devices.pending, FUTEX_WAKE_PRIVATE, 1);
+    }
+  }
+}
+
+
+void each_bus(void (*task)(struct chip_bus *line)) {
+/*
+  Do a job on every bus and wait until it's done. With one bus, that's
+  done right here; with more, the workers do theirs while we do the first.
+*/
+  unsigned int left;
+
+  if (devices.workers == 0) {
+    task(&devices.bus[0]);
+    return;
+  }
+  devices.task = task;
+  atomic_store(&devices.pending, devices.workers);
+  atomic_store(&devices.arrived, 0);
+  atomic_fetch_add(&devices.generation, 1);
+  futex(&devices.generation, FUTEX_WAKE_PRIVATE, INT_MAX);
+
+  if (low_skew) {
+    start_together();
+  }
+  task(&devices.bus[0]);
+
+  while ((left = atomic_load(&devices.pending)) != 0) {
+    futex(&devices.pending, FUTEX_WAIT_PRIVATE, left);
+  }
+}
+
+
+void write_task(struct chip_bus *line) {
+  write_bus_pairs(line, devices.reg, devices.word);
+}
+
+
+void write_pairs(uint8_t reg, const struct output_word *word) {
+// Write a pair of A/B registers (reg and reg + 1) on all chips of all buses
+  devices.word = word;
+  devices.reg = reg;
+  each_bus(write_task);
+}
+
+
+int probe_chip(struct chip_bus *line, struct mcp_chip *chip) {
+/*
+  Read IODIRA/B, IOCON and OLATA/B back from a chip - one transaction,
+  three register addresses each followed by a read after a repeated START
+  (16 bytes on the wire) - and take them as the chip's shadow registers.
+  Returns 0, or -1 if the chip can't be read or isn't in the register
+  map we use; its shadow is then left empty, so that it's set up in full.
+
+  Every program here keeps IOCON.BANK = 0 (registers of a pair next
+  to each other) and SEQOP = 0 (sequential writes): that's what makes
+  the 3-byte bursts work. A chip that says otherwise is switched back -
+  with BANK = 1, its IOCON is at 0x05, and 0x0A is OLATA. We can only
+  tell that from OLATA's top bit, so BANK = 1 with that output off goes
+  unnoticed - but nothing here sets BANK, and a reset clears it.
+*/
+  static uint8_t iodir_reg = IODIRA, iocon_reg = IOCON, olat_reg = OLATA;
+  uint8_t directions[2], iocon, latches[2], fix[2];
+  struct i2c_msg messages[6] = {
+    { chip->address, 0, 1, &iodir_reg },
+    { chip->address, I2C_M_RD, 2, directions },
+    { chip->address, 0, 1, &iocon_reg },
+    { chip->address, I2C_M_RD, 1, &iocon },
+    { chip->address, 0, 1, &olat_reg },
+    { chip->address, I2C_M_RD, 2, latches }
+  };
+  struct mcp_shadow *shadow = &chip->shadow;
+
+  drain_uring(line);
+  memset(shadow, 0, sizeof(*shadow));
+  if (bus_transfer_retry(&line->bus, messages, 6) != 6) {
+    chip->errors++;
+    return -1;
+  }
+  if (iocon & (IOCON_BANK | IOCON_SEQOP)) {
+    fix[0] = iocon & IOCON_BANK ? IOCON_BANK1 : IOCON;
+    fix[1] = 0;
+    if (bus_write_retry(&line->bus, chip->address, fix, 2) < 0) {
+      chip->errors++;
+    }
+    return -1;
+  }
+
+  shadow->value[IODIRA] = directions[0];
+  shadow->value[IODIRB] = directions[1];
+  shadow->value[IOCON] = iocon;
+  shadow->value[OLATA] = shadow->value[GPIOA] = latches[0];
+  shadow->value[OLATB] = shadow->value[GPIOB] = latches[1];
+  shadow->known = 1u << IODIRA | 1u << IODIRB | 1u << IOCON
+                  | 1u << GPIOA | 1u << GPIOB | 1u << OLATA | 1u << OLATB;
+  return 0;
+}
+
+
+void probe_task(struct chip_bus *line) {
+  int c;
+
+  for (c = 0; c < line->chips; c++) {
+    probe_chip(line, &line->chip[c]);
+  }
+}
+
+
+void probe_bus_chips(struct output_word *outputs) {
+/*
+  Warm attach: read back every chip on every bus (the buses in parallel),
+  and fill outputs with what each chip drives now - its latches for
+  a bank that's all outputs already, 0 (off) for anything else: a bank
+  of inputs drives nothing, so that's the state to keep when it becomes
+  outputs, and a chip that couldn't be read is set up from scratch.
+*/
+  struct mcp_shadow *shadow;
+  int b, c, bank;
+
+  each_bus(probe_task);
+  memset(outputs, ALL_OFF, sizeof(*outputs));
+  for (b = 0; b < devices.buses; b++) {
+    for (c = 0; c < devices.bus[b].chips; c++) {
+      shadow = &devices.bus[b].chip[c].shadow;
+      for (bank = 0; bank < 2; bank++) {
+        if ((shadow->known & (1u << (IODIRA + bank))) && shadow->value[IODIRA + bank] == OUTPUT_BYTE) {
+          outputs->value[devices.bus[b].first + c][bank] = shadow->value[OLATA + bank];
+        }
+      }
+    }
+  }
+}
+
+
+int pick_write_mode(struct chip_bus *line) {
+/*
+  The cheapest way to update this bus, from what the adapter can do:
+
+  plain I2C, several chips - WRITE_RDWR: one ioctl for all of them,
+                             repeated STARTs between the chips
+  plain I2C, one chip      - WRITE_BURST: a write() is all it takes
+  SMBus I2C block writes   - WRITE_SMBUS: one ioctl per chip
+  SMBus byte writes only   - WRITE_SINGLE: one ioctl per register
+                             (the SMBus backend sends them as byte writes)
+
+  Returns the mode, or -1 if the adapter can't write to a register at all.
+*/
+  unsigned long funcs = line->bus.funcs;
+
+  if (funcs & I2C_FUNC_I2C) {
+    return line->chips > 1 ? WRITE_RDWR : WRITE_BURST;
+  }
+  if (funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK) {
+    return WRITE_SMBUS;
+  }
+  if (funcs & I2C_FUNC_SMBUS_WRITE_BYTE_DATA) {
+    return WRITE_SINGLE;
+  }
+  return -1;
+}
+
+
+const char *readback_method(struct chip_bus *line) {
+// How register reads (verification, warm start) go on this bus:
+  if (line->bus.funcs & I2C_FUNC_I2C) {
+    return "I2C_RDWR";
+  }
+  if (line->bus.funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK) {
+    return "SMBus block read";
+  }
+  return "none";
+}
+
+
+int devices_add_bus(const char *spec, const int *addresses, int count) {
+// Add a bus and its chips to the table. Returns the bus number, or -1.
+  struct chip_bus *line;
+  int i, j;
+
+  if (devices.buses == MAX_BUSES || count < 1 || count > MAX_CHIPS_PER_BUS) {
+    fprintf(stderr, "%s: too many buses or chips\n", spec);
+    return -1;
+  }
+// Two entries for one chip would each keep a shadow of their own, and overwrite each other:
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < i; j++) {
+      if (addresses[i] == addresses[j]) {
+        fprintf(stderr, "%s: chip 0x%02x listed twice\n", spec, addresses[i]);
+        return -1;
+      }
+    }
+  }
+  line = &devices.bus[devices.buses];
+  memset(line, 0, sizeof(*line));
+  snprintf(line->spec, sizeof(line->spec), "%s", spec);
+  line->chips = count;
+  line->first = devices.chips;
+  for (i = 0; i < count; i++) {
+    line->chip[i].address = addresses[i];
+    line->order[i] = i;
+  }
+  devices.chips += count;
+  return devices.buses++;
+}
+
+
+int devices_configure(const char *table) {
+/*
+  Fill the table from a string like "/dev/i2c-1@0x20,0x21;sim@0x20-0x27".
+  NULL means: MCP23017_DEVICES, or 0x20 and 0x21 on the MCP23017_BUS bus.
+  Returns 0, or -1 if the string doesn't make sense.
+*/
+  char copy[512], *entry, *save, *at, *range, *save_range, *dash, *end;
+  int addresses[MAX_CHIPS_PER_BUS];
+  long first, last, a;
+  int count;
+  const char *bus_spec;
+
+  if (table == NULL) {
+    table = getenv("MCP23017_DEVICES");
+  }
+  if (table == NULL || *table == 0) {
+    bus_spec = getenv("MCP23017_BUS");
+    addresses[0] = MCP0_ADDR;
+    addresses[1] = MCP1_ADDR;
+    return devices_add_bus(bus_spec && *bus_spec ? bus_spec : DEFAULT_BUS, addresses, 2) < 0 ? -1 : 0;
+  }
+
+  snprintf(copy, sizeof(copy), "%s", table);
+  for (entry = strtok_r(copy, ";", &save); entry; entry = strtok_r(NULL, ";", &save)) {
+    at = strrchr(entry, '@');
+    if (at == NULL) {
+      fprintf(stderr, "%s: expected bus@addresses\n", entry);
+      return -1;
+    }
+    *at = 0;
+    count = 0;
+    for (range = strtok_r(at + 1, ",", &save_range); range; range = strtok_r(NULL, ",", &save_range)) {
+      first = strtol(range, &dash, 0);
+      last = first;
+      end = dash;
+      if (*dash == '-') {
+        last = strtol(dash + 1, &end, 0);
+      }
+      if (dash == range || *end != 0 || (*dash == '-' && end == dash + 1)) {
+        fprintf(stderr, "%s: %s isn't an address or a range of them\n", entry, range);
+        return -1;
+      }
+      if (first < MCP_FIRST_ADDR || last > MCP_LAST_ADDR || first > last) {
+        fprintf(stderr, "%s: %s - chip addresses go up from 0x%02x to 0x%02x\n",
+                entry, range, MCP_FIRST_ADDR, MCP_LAST_ADDR);
+        return -1;
+      }
+      for (a = first; a <= last; a++) {
+        if (count == MAX_CHIPS_PER_BUS) {
+          fprintf(stderr, "%s: more than %d chips\n", entry, MAX_CHIPS_PER_BUS);
+          return -1;
+        }
+        addresses[count++] = a;
+      }
+    }
+    if (count == 0) {
+      fprintf(stderr, "%s: no chip addresses\n", entry);
+      return -1;
+    }
+    if (devices_add_bus(entry, addresses, count) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+int devices_priority(const char *list) {
+/*
+  Write these chips (numbers, most urgent first: "3,1") before the others
+  on their buses; the rest keep table order. NULL - MCP23017_PRIORITY.
+  Returns 0, or -1 if a number isn't a chip in the table.
+*/
+  char copy[256], *item, *save, *end;
+  struct chip_bus *line;
+  int b, c, i, count, number, listed[MAX_CHIPS];
+
+  if (list == NULL) {
+    list = getenv("MCP23017_PRIORITY");
+  }
+  if (list == NULL || *list == 0) {
+    return 0;
+  }
+  memset(listed, 0, sizeof(listed));
+  snprintf(copy, sizeof(copy), "%s", list);
+  count = 0;
+  for (item = strtok_r(copy, ", ", &save); item; item = strtok_r(NULL, ", ", &save)) {
+    number = strtol(item, &end, 0);
+    if (*end || number < 0 || number >= devices.chips || listed[number]) {
+      fprintf(stderr, "priority: %s isn't a chip (0...%d), or it's listed twice\n", item, devices.chips - 1);
+      return -1;
+    }
+    listed[number] = ++count;
+  }
+  for (b = 0; b < devices.buses; b++) {
+    line = &devices.bus[b];
+    i = 0;
+// The listed chips on this bus, in list order, then the others:
+    for (number = 1; number <= count; number++) {
+      for (c = 0; c < line->chips; c++) {
+        if (listed[line->first + c] == number) {
+          line->order[i++] = c;
+        }
+      }
+    }
+    for (c = 0; c < line->chips; c++) {
+      if (!listed[line->first + c]) {
+        line->order[i++] = c;
+      }
+    }
+  }
+  return 0;
+}
+
+
+int devices_open(void) {
+// Open every bus in the table and start the workers. Returns 0 or -1.
+  const char *setting;
+  int b;
+
+  if (devices.opened) {
+    return 0;
+  }
+  if (devices.buses == 0 && devices_configure(NULL) < 0) {
+    return -1;
+  }
+  for (b = 0; b < devices.buses; b++) {
+    if (devices.bus[b].bus.backend == NULL && bus_open(&devices.bus[b].bus, devices.bus[b].spec) < 0) {
+      return -1;
+    }
+    devices.bus[b].mode = pick_write_mode(&devices.bus[b]);
+    if (devices.bus[b].mode < 0) {
+      fprintf(stderr, "%s: the adapter can't write registers (I2C_FUNCS 0x%lx)\n",
+              devices.bus[b].spec, devices.bus[b].bus.funcs);
+      return -1;
+    }
+  }
+  setting = getenv("MCP23017_VERIFY");
+  if (setting != NULL && *setting) {
+    verify_every = atoi(setting);
+  }
+  setting = getenv("MCP23017_WARM");
+  if (setting != NULL && *setting) {
+    warm_attach = atoi(setting);
+  }
+  setting = getenv("MCP23017_SKEW");
+  if (setting != NULL && *setting) {
+    low_skew = atoi(setting);
+  }
+  if (devices_priority(NULL) < 0) {
+    return -1;
+  }
+  devices.stopping = 0;
+  for (b = 1; b < devices.buses; b++) {
+// The worker must not miss an update that comes before it gets going:
+    devices.bus[b].seen = atomic_load(&devices.generation);
+    if (pthread_create(&devices.bus[b].worker, NULL, bus_worker, &devices.bus[b]) != 0) {
+      perror("pthread_create");
+      return -1;
+    }
+    devices.workers++;
+  }
+  devices.opened = 1;
+  return 0;
+}
+
+
+void devices_close(void) {
+// Stop the workers, close the buses and empty the table
+  int b;
+
+  devices.stopping = 1;
+  atomic_fetch_add(&devices.generation, 1);
+  futex(&devices.generation, FUTEX_WAKE_PRIVATE, INT_MAX);
+  for (b = 1; b <= devices.workers; b++) {
+    pthread_join(devices.bus[b].worker, NULL);
+  }
+  devices.workers = 0;
+  for (b = 0; b < devices.buses; b++) {
+    uring_free(&devices.bus[b].uring);
+    bus_close(&devices.bus[b].bus);
+  }
+  devices.buses = 0;
+  devices.chips = 0;
+  devices.opened = 0;
+}
+
+
+void devices_outputs(struct output_word *word) {
+// The outputs as the shadow registers have them - 0 where we don't know
+  struct mcp_shadow *shadow;
+  int b, c, bank;
+
+  memset(word, ALL_OFF, sizeof(*word));
+  for (b = 0; b < devices.buses; b++) {
+    for (c = 0; c < devices.bus[b].chips; c++) {
+      shadow = &devices.bus[b].chip[c].shadow;
+      for (bank = 0; bank < 2; bank++) {
+        if (shadow->known & (1u << (OLATA + bank))) {
+          word->value[devices.bus[b].first + c][bank] = shadow->value[OLATA + bank];
+        }
+      }
+    }
+  }
+}
+
+
+void devices_stats(struct bus_stats *total) {
+// Add up the statistics of all buses
+  int b;
+
+  memset(total, 0, sizeof(*total));
+  for (b = 0; b < devices.buses; b++) {
+    total->syscalls += devices.bus[b].bus.stats.syscalls;
+    total->messages += devices.bus[b].bus.stats.messages;
+    total->bytes += devices.bus[b].bus.stats.bytes;
+    total->wire_bits += devices.bus[b].bus.stats.wire_bits;
+    total->wire_ns += devices.bus[b].bus.stats.wire_ns;
+    total->elided += devices.bus[b].bus.stats.elided;
+    total->errors += devices.bus[b].bus.stats.errors;
+    total->retries += devices.bus[b].bus.stats.retries;
+    total->failures += devices.bus[b].bus.stats.failures;
+  }
+}
+
+
+const char *devices_write_method(int b) {
+// The write mode in use on bus b - picked, or forced with write_mode (or low_skew)
+  if (low_skew && (devices.bus[b].bus.funcs & I2C_FUNC_I2C)) {
+    return "rdwr, low skew";
+  }
+  return write_mode_names[write_mode == WRITE_AUTO ? devices.bus[b].mode : write_mode];
+}
+
+
+void devices_report(FILE *out) {
+// What each bus is and how it's being written:
+  int b;
+
+  for (b = 0; b < devices.buses; b++) {
+    fprintf(out, "bus %d: %s (%s backend, I2C_FUNCS 0x%08lx), %d chips, writes: %s%s, reads: %s\n",
+            b, devices.bus[b].spec, devices.bus[b].bus.backend->name, devices.bus[b].bus.funcs,
+            devices.bus[b].chips, devices_write_method(b),
+            write_mode == WRITE_AUTO ? " (picked)" : " (forced)",
+            readback_method(&devices.bus[b]));
+  }
+}
+
+
+void devices_error_report(FILE *out) {
+// Per-chip error and mismatch counts - only the chips that had any
+  struct mcp_chip *chip;
+  struct bus_stats total;
+  int b, c;
+
+  devices_stats(&total);
+  fprintf(out, "bus errors: %lu, retried: %lu, given up: %lu\n",
+          total.errors, total.retries, total.failures);
+  for (b = 0; b < devices.buses; b++) {
+    for (c = 0; c < devices.bus[b].chips; c++) {
+      chip = &devices.bus[b].chip[c];
+      if (chip->errors || chip->mismatches) {
+        fprintf(out, "  %s chip 0x%02x: %lu failed writes, %lu readback mismatches\n",
+                devices.bus[b].spec, chip->address, chip->errors, chip->mismatches);
+      }
+    }
+  }
+}
+
+
+void devices_reset_stats(void) {
+  int b, c;
+
+  for (b = 0; b < devices.buses; b++) {
+    memset(&devices.bus[b].bus.stats, 0, sizeof(struct bus_stats));
+    for (c = 0; c < devices.bus[b].chips; c++) {
+      devices.bus[b].chip[c].errors = 0;
+      devices.bus[b].chip[c].mismatches = 0;
+    }
+  }
+}
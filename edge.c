@@ -0,0 +1,413 @@
+/*
+  Edge events from the casting machine's input.
+
+  The input is a GPIO line read through the GPIO character device
+  (/dev/gpiochip0) with the v2 line event API (Linux 5.10 or newer).
+  Every event comes from the kernel with:
+
+  - a timestamp taken in the interrupt handler, on the monotonic clock,
+  - the edge direction (rising or falling),
+
+  so we don't have to read the pin afterwards (by then it may have changed
+  again) and wall clock jumps can't upset the debouncing.
+
+  Debouncing: an edge closer than debounce_ns to the last accepted one
+  is dropped, and so is an edge in the same direction as the last accepted
+  one (a rising edge when the input is already on can only be a bounce
+  or a lost falling edge). The kernel can debounce too - set kernel_debounce
+  before edge_open() and the line is requested with a debounce period.
+
+  Every edge, bounces included, goes into a histogram of intervals
+  between edges - print it with edge_histogram_print() to see how clean
+  the signal is and whether the debounce window fits it.
+
+  This file uses monotonic_ns() from bus.c - include it after bus.c.
+
+  The edge source is chosen with a string, given to edge_open() or taken
+  from the MCP23017_EDGE environment variable:
+
+  /dev/gpiochip0:17, gpio:17   - GPIO line 17 (physical pin 11) on gpiochip0
+                                 (the default)
+  sim                          - edges injected by the program itself
+                                 with edge_inject() - for testing
+  timer:rate[:duty]            - a machine running free: rate cycles a
+                                 second, on for duty percent of each (50)
+
+  The timer source is a timerfd armed for each edge on an absolute
+  CLOCK_MONOTONIC deadline, one cycle period after the same edge of the
+  last cycle - so a late wakeup doesn't push the ones after it back.
+  Each edge is timestamped with its deadline, like the kernel stamps a
+  GPIO edge with the time it happened. An edge read when the next one
+  is already due counts as a missed deadline (source->missed): the output
+  path couldn't keep up. With it, any program here runs - and can be
+  timed - without a casting machine; see benchmark cycles.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <linux/gpio.h>
+
+#define DEFAULT_EDGE "/dev/gpiochip0:17"
+#define DEFAULT_DEBOUNCE_NS 10000000    // 10 ms
+#define EDGE_BUCKETS 24                 // 1 us ... 8 s in powers of 2
+
+struct edge_event {
+  uint64_t timestamp_ns;                // CLOCK_MONOTONIC, when the edge happened
+  int rising;                           // 1 - input turned on, 0 - turned off
+};
+
+struct edge_source;
+
+struct edge_backend {
+  const char *name;
+  int (*open)(struct edge_source *source, const char *where);
+// Read one raw event - 1 if there was one, 0 if none is waiting, -1 on error:
+  int (*read)(struct edge_source *source, struct edge_event *event);
+  void (*close)(struct edge_source *source);
+};
+
+struct edge_source {
+  const struct edge_backend *backend;
+  int fd;                               // poll() this for POLLIN
+  int inject_fd;                        // sim: write end of the pipe
+  uint64_t debounce_ns;                 // minimum time between accepted edges
+  int kernel_debounce;                  // ask the kernel to debounce too
+  int level;                            // last accepted direction, -1 - unknown
+  uint64_t last_ns;                     // timestamp of the last accepted edge
+  uint64_t last_raw_ns;                 // timestamp of the last edge of any kind
+  unsigned long accepted, bounced, repeated;
+  unsigned long histogram[EDGE_BUCKETS];
+// The timer backend:
+  uint64_t period_ns, on_ns;            // a cycle, and how long the input is on in it
+  uint64_t next_ns;                     // the next edge's deadline
+  int next_rising;
+  unsigned long missed;                 // edges read after the next one was due
+};
+
+
+/*
+  The GPIO backend.
+*/
+
+int gpio_open(struct edge_source *source, const char *where) {
+  struct gpio_v2_line_request request;
+  char chip[64];
+  const char *colon;
+  int fd;
+
+  colon = strrchr(where, ':');
+  if (colon == NULL || colon - where >= (int) sizeof(chip)) {
+    fprintf(stderr, "%s: expected chip:line\n", where);
+    return -1;
+  }
+  if (strncmp(where, "gpio:", 5) == 0) {
+    strcpy(chip, "/dev/gpiochip0");
+  }
+  else {
+    memcpy(chip, where, colon - where);
+    chip[colon - where] = 0;
+  }
+
+  memset(&request, 0, sizeof(request));
+  request.offsets[0] = atoi(colon + 1);
+  request.num_lines = 1;
+  strcpy(request.consumer, "mcp23017-interface");
+  request.config.flags = GPIO_V2_LINE_FLAG_INPUT
+                         | GPIO_V2_LINE_FLAG_EDGE_RISING
+                         | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+  if (source->kernel_debounce) {
+    request.config.num_attrs = 1;
+    request.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+    request.config.attrs[0].attr.debounce_period_us = source->debounce_ns / 1000;
+    request.config.attrs[0].mask = 1;
+  }
+
+  fd = open(chip, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    perror(chip);
+    return -1;
+  }
+  if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &request) < 0) {
+    perror("GPIO_V2_GET_LINE_IOCTL");
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+// The line fd is where the events come from - don't block on read():
+  source->fd = request.fd;
+  fcntl(source->fd, F_SETFL, fcntl(source->fd, F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+
+int gpio_read(struct edge_source *source, struct edge_event *event) {
+  struct gpio_v2_line_event line_event;
+
+  if (read(source->fd, &line_event, sizeof(line_event)) != sizeof(line_event)) {
+    return errno == EAGAIN ? 0 : -1;
+  }
+  event->timestamp_ns = line_event.timestamp_ns;
+  event->rising = line_event.id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+  return 1;
+}
+
+
+void gpio_close(struct edge_source *source) {
+  close(source->fd);
+}
+
+
+const struct edge_backend gpio_edge_backend = {
+  "gpio", gpio_open, gpio_read, gpio_close
+};
+
+
+/*
+  The sim backend - a pipe the program writes events to.
+*/
+
+int sim_edge_open(struct edge_source *source, const char *where) {
+  int fds[2];
+
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    return -1;
+  }
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  source->fd = fds[0];
+  source->inject_fd = fds[1];
+  return 0;
+}
+
+
+int sim_edge_read(struct edge_source *source, struct edge_event *event) {
+  ssize_t length = read(source->fd, event, sizeof(*event));
+
+  if (length == sizeof(*event)) {
+    return 1;
+  }
+  if (length < 0 && errno == EAGAIN) {
+    return 0;
+  }
+  if (length >= 0) {
+    errno = EPIPE;                      // the injecting end is closed
+  }
+  return -1;
+}
+
+
+void sim_edge_close(struct edge_source *source) {
+  close(source->fd);
+  close(source->inject_fd);
+}
+
+
+const struct edge_backend sim_edge_backend = {
+  "sim", sim_edge_open, sim_edge_read, sim_edge_close
+};
+
+
+/*
+  The timer backend - a free-running machine on a timerfd.
+*/
+
+int timer_arm(struct edge_source *source) {
+// Wake up at the next edge's deadline (at once, if it's gone by already)
+  struct itimerspec deadline;
+
+  memset(&deadline, 0, sizeof(deadline));
+  deadline.it_value.tv_sec = source->next_ns / 1000000000;
+  deadline.it_value.tv_nsec = source->next_ns % 1000000000;
+  return timerfd_settime(source->fd, TFD_TIMER_ABSTIME, &deadline, NULL);
+}
+
+
+int timer_edge_open(struct edge_source *source, const char *where) {
+// where: "timer:rate[:duty]" - cycles a second, percent of each cycle on
+  double rate, duty = 50;
+  char *end;
+
+  rate = strtod(where + 6, &end);
+  if (*end == ':') {
+    duty = strtod(end + 1, &end);
+  }
+  if (*end || rate <= 0 || rate > 1e6 || duty <= 0 || duty >= 100) {
+    fprintf(stderr, "%s: expected timer:rate[:duty], duty 1...99 percent\n", where);
+    return -1;
+  }
+  source->period_ns = 1e9 / rate;
+  source->on_ns = source->period_ns * duty / 100;
+  source->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (source->fd < 0) {
+    perror("timerfd_create");
+    return -1;
+  }
+// The input starts off - the first cycle starts when an off phase is over:
+  source->next_ns = monotonic_ns() + source->period_ns - source->on_ns;
+  source->next_rising = 1;
+  source->missed = 0;
+  source->debounce_ns = 0;              // nothing bounces here
+  if (timer_arm(source) < 0) {
+    perror("timerfd_settime");
+    close(source->fd);
+    return -1;
+  }
+  return 0;
+}
+
+
+int timer_edge_read(struct edge_source *source, struct edge_event *event) {
+  uint64_t expirations;
+
+  if (read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return errno == EAGAIN ? 0 : -1;
+  }
+  event->timestamp_ns = source->next_ns;
+  event->rising = source->next_rising;
+  source->next_ns += event->rising ? source->on_ns : source->period_ns - source->on_ns;
+  source->next_rising = !event->rising;
+  if (monotonic_ns() >= source->next_ns) {
+    source->missed++;
+  }
+  return timer_arm(source) < 0 ? -1 : 1;
+}
+
+
+void timer_edge_close(struct edge_source *source) {
+  close(source->fd);
+}
+
+
+const struct edge_backend timer_edge_backend = {
+  "timer", timer_edge_open, timer_edge_read, timer_edge_close
+};
+
+
+/*
+  The functions the programs use:
+*/
+
+int edge_open(struct edge_source *source, const char *spec) {
+/*
+  Open the edge source described by spec (see the top of this file).
+  If spec is NULL, use MCP23017_EDGE from the environment, or GPIO 17.
+  Set debounce_ns and kernel_debounce before, if the defaults don't suit.
+  Returns 0 on success, -1 on failure.
+*/
+  if (spec == NULL) {
+    spec = getenv("MCP23017_EDGE");
+  }
+  if (spec == NULL || *spec == 0) {
+    spec = DEFAULT_EDGE;
+  }
+
+  source->fd = -1;
+  source->inject_fd = -1;
+  source->level = -1;
+  source->last_ns = 0;
+  source->last_raw_ns = 0;
+  source->accepted = source->bounced = source->repeated = 0;
+  memset(source->histogram, 0, sizeof(source->histogram));
+
+  if (strcmp(spec, "sim") == 0) {
+    source->backend = &sim_edge_backend;
+  }
+  else if (strncmp(spec, "timer:", 6) == 0) {
+    source->backend = &timer_edge_backend;
+  }
+  else {
+    source->backend = &gpio_edge_backend;
+  }
+  if (source->backend->open(source, spec) < 0) {
+    source->backend = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+
+void edge_close(struct edge_source *source) {
+  if (source->backend != NULL) {
+    source->backend->close(source);
+    source->backend = NULL;
+  }
+}
+
+
+int edge_inject(struct edge_source *source, int rising) {
+// Sim only: make an edge happen now
+  struct edge_event event;
+
+  event.timestamp_ns = monotonic_ns();
+  event.rising = rising;
+  return write(source->inject_fd, &event, sizeof(event)) == sizeof(event) ? 0 : -1;
+}
+
+
+void edge_histogram_add(struct edge_source *source, uint64_t interval_ns) {
+  uint64_t us = interval_ns / 1000;
+  int bucket = 0;
+
+  while (us > 1 && bucket < EDGE_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+  source->histogram[bucket]++;
+}
+
+
+int edge_read(struct edge_source *source, struct edge_event *event) {
+/*
+  Get the next debounced edge. Returns 1 with the event filled in,
+  0 if no (good) edge is waiting - poll source->fd and try again - or -1.
+*/
+  int result;
+
+  while ((result = source->backend->read(source, event)) == 1) {
+    if (source->last_raw_ns) {
+      edge_histogram_add(source, event->timestamp_ns - source->last_raw_ns);
+    }
+    source->last_raw_ns = event->timestamp_ns;
+
+    if (source->last_ns && event->timestamp_ns - source->last_ns < source->debounce_ns) {
+      source->bounced++;
+      continue;
+    }
+    if (event->rising == source->level) {
+      source->repeated++;
+      continue;
+    }
+    source->level = event->rising;
+    source->last_ns = event->timestamp_ns;
+    source->accepted++;
+    return 1;
+  }
+  return result;
+}
+
+
+void edge_histogram_print(struct edge_source *source, FILE *out) {
+// Intervals between consecutive edges, bounces included:
+  int i;
+
+  fprintf(out, "edges: %lu accepted, %lu bounces, %lu repeated direction\n",
+          source->accepted, source->bounced, source->repeated);
+  if (source->backend == &timer_edge_backend) {
+    fprintf(out, "timer: %.1f cycles/s, %lu deadlines missed\n", 1e9 / source->period_ns, source->missed);
+  }
+  for (i = 0; i < EDGE_BUCKETS; i++) {
+    if (source->histogram[i]) {
+      fprintf(out, "  %9llu us+ %10lu\n", i ? 1ull << i : 0ull, source->histogram[i]);
+    }
+  }
+}
@@ -0,0 +1,234 @@
+/*
+  Many interfaces, one thread.
+
+  send_codes() drives one interface: the one input (edge), the chips in
+  the device table, and a thread that sleeps in poll() for the whole
+  cycle. Several casting machines would mean several processes, each
+  with a thread of its own.
+
+  Here, everything an interface needs is in its own context - its input,
+  its bus and chips (with their shadow registers), the word it's sending
+  and where it is in the on-off cycle - and one thread serves them all
+  with epoll: it sleeps until any of the inputs has an edge, moves that
+  interface's cycle along, and goes back to sleep.
+
+  The cycle is send_codes() turned inside out: instead of waiting for the
+  next edge, it returns to the loop and carries on where it left off when
+  the loop brings it one (what a coroutine does, written out by hand):
+
+  CYCLE_WAIT_ON   - waiting for the input to turn on: send the word
+  CYCLE_WAIT_OFF  - waiting for it to turn off: all outputs off, then
+                    ask for the next word (next_word()) - if there's
+                    none, the interface is done
+
+  interface_open(context, bus_spec, addresses, chips, edge_spec)
+  loop_init(loop), loop_add(loop, context), loop_run(loop), loop_free(loop)
+
+  The chips are written on the loop's thread, one interface after another,
+  so an edge waits for the updates of the interfaces ahead of it:
+  with n interfaces, the last one's latency is n updates. Fine for a few
+  interfaces on one bus each; see benchmark interfaces for the numbers.
+
+  Include this after devices.c.
+*/
+
+#include <sys/epoll.h>
+
+#define CYCLE_WAIT_ON 0
+#define CYCLE_WAIT_OFF 1
+#define CYCLE_DONE 2
+
+#define LOOP_EVENTS 64
+
+struct interface_context {
+  struct edge_source edge;
+  struct chip_bus line;                 // this interface's own bus and chips
+  int state;
+  struct output_word word;              // the word for this cycle
+// Where the words come from: fills in the next word, returns 1 - or 0 if that's all:
+  int (*next_word)(struct interface_context *context, struct output_word *word);
+  void *user;
+  unsigned long cycles;
+  struct latency *latency;              // edge to last byte written, if not NULL
+};
+
+struct event_loop {
+  int fd;                               // the epoll instance
+  int active;                           // interfaces not done yet
+  unsigned long wakeups;                // epoll_wait() calls that returned events
+  int failed;                           // interfaces dropped because their input failed
+};
+
+
+int interface_open(struct interface_context *context, const char *bus_spec,
+                   const int *addresses, int chips, const char *edge_spec) {
+/*
+  Open an interface: its bus and chips (set up like mcp_init() does:
+  all pins outputs, all off) and its input. Set context->edge.debounce_ns
+  before, if the default doesn't suit. Returns 0, or -1 - also if any of
+  the chips didn't take the setup.
+*/
+  static const struct output_word off;
+  struct chip_bus *line = &context->line;
+  uint64_t debounce_ns = context->edge.debounce_ns;
+  int c;
+
+  if (chips < 1 || chips > MAX_CHIPS_PER_BUS) {
+    errno = EINVAL;
+    return -1;
+  }
+  memset(line, 0, sizeof(*line));
+  snprintf(line->spec, sizeof(line->spec), "%s", bus_spec);
+  line->chips = chips;
+  for (c = 0; c < chips; c++) {
+    line->chip[c].address = addresses[c];
+    line->order[c] = c;
+  }
+  if (bus_open(&line->bus, bus_spec) < 0) {
+    return -1;
+  }
+  line->mode = pick_write_mode(line);
+  if (line->mode < 0) {
+    fprintf(stderr, "%s: the adapter can't write registers\n", bus_spec);
+    bus_close(&line->bus);
+    return -1;
+  }
+  write_bus_pairs(line, IODIRA, &off);
+  write_bus_pairs(line, GPIOA, &off);
+  drain_uring(line);
+// A chip that didn't take its setup would be served without a word said - don't open:
+  for (c = 0; c < chips; c++) {
+    if (line->chip[c].errors) {
+      fprintf(stderr, "%s: chip 0x%02x doesn't answer\n", bus_spec, line->chip[c].address);
+      uring_free(&line->uring);
+      bus_close(&line->bus);
+      errno = EIO;
+      return -1;
+    }
+  }
+
+  context->edge.debounce_ns = debounce_ns ? debounce_ns : DEFAULT_DEBOUNCE_NS;
+  if (edge_open(&context->edge, edge_spec) < 0) {
+    uring_free(&line->uring);
+    bus_close(&line->bus);
+    return -1;
+  }
+  context->state = CYCLE_WAIT_ON;
+  context->cycles = 0;
+  return 0;
+}
+
+
+void interface_close(struct interface_context *context) {
+  static const struct output_word off;
+
+  write_bus_pairs(&context->line, GPIOA, &off);
+  edge_close(&context->edge);
+  uring_free(&context->line.uring);
+  bus_close(&context->line.bus);
+}
+
+
+void interface_step(struct interface_context *context, const struct edge_event *event) {
+// One edge: move the cycle along - the body of send_word(), a step at a time
+  static const struct output_word off;
+
+  switch (context->state) {
+
+  case CYCLE_WAIT_ON:
+    if (event->rising) {
+      write_bus_pairs(&context->line, GPIOA, &context->word);
+      if (context->latency != NULL) {
+        latency_add(context->latency, monotonic_ns() - event->timestamp_ns);
+      }
+      context->state = CYCLE_WAIT_OFF;
+    }
+    break;
+
+  case CYCLE_WAIT_OFF:
+    if (!event->rising) {
+      write_bus_pairs(&context->line, GPIOA, &off);
+      context->cycles++;
+      context->state = context->next_word(context, &context->word) ? CYCLE_WAIT_ON : CYCLE_DONE;
+    }
+    break;
+  }
+}
+
+
+int loop_init(struct event_loop *loop) {
+  memset(loop, 0, sizeof(*loop));
+  loop->fd = epoll_create1(EPOLL_CLOEXEC);
+  return loop->fd < 0 ? -1 : 0;
+}
+
+
+int loop_add(struct event_loop *loop, struct interface_context *context) {
+// Start serving an interface: its first word now, then one every cycle. Returns 0 or -1.
+  struct epoll_event event;
+
+  if (!context->next_word(context, &context->word)) {
+    context->state = CYCLE_DONE;
+    return 0;
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = context;
+  if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, context->edge.fd, &event) < 0) {
+    return -1;
+  }
+  loop->active++;
+  return 0;
+}
+
+
+int loop_run(struct event_loop *loop) {
+/*
+  Serve the interfaces until every one of them is done. An interface whose
+  input fails (a read error, or the other end gone) is dropped, and the
+  others carry on. Returns 0, or -1 if epoll fails or any input did.
+*/
+  struct epoll_event events[LOOP_EVENTS];
+  struct interface_context *context;
+  struct edge_event edge_event;
+  int count, i, result;
+
+  while (loop->active > 0) {
+    count = epoll_wait(loop->fd, events, LOOP_EVENTS, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    loop->wakeups++;
+    for (i = 0; i < count; i++) {
+      context = events[i].data.ptr;
+      result = 0;
+      while (context->state != CYCLE_DONE && (result = edge_read(&context->edge, &edge_event)) == 1) {
+        trace_at(TRACE_EDGE, edge_event.timestamp_ns, edge_event.rising, 0);
+        record_edge(edge_event.timestamp_ns, edge_event.rising);
+        interface_step(context, &edge_event);
+      }
+// Nothing to read, and never will be - left in, it would wake us up forever:
+      if (result == 0 && context->state != CYCLE_DONE && events[i].events & (EPOLLERR | EPOLLHUP)) {
+        errno = EPIPE;
+        result = -1;
+      }
+      if (result < 0) {
+        fprintf(stderr, "%s: input failed: %s\n", context->line.spec, strerror(errno));
+        context->state = CYCLE_DONE;
+        loop->failed++;
+      }
+      if (context->state == CYCLE_DONE) {
+        epoll_ctl(loop->fd, EPOLL_CTL_DEL, context->edge.fd, NULL);
+        loop->active--;
+      }
+    }
+  }
+  return loop->failed ? -1 : 0;
+}
+
+
+void loop_free(struct event_loop *loop) {
+  close(loop->fd);
+}
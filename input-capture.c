@@ -0,0 +1,208 @@
+/*
+  Input capture demo - reads up to 16 inputs per MCP23017 chip
+  through the chip's interrupt-on-change logic (see capture.c).
+
+  Wire the chip's INT pin (INTA - with IOCON.MIRROR, INTB does the same)
+  to a Pi GPIO; it's open-drain, so enable the Pi's pull-up or add
+  a resistor to +3.3V. Several chips can share that GPIO.
+
+  gcc input-capture.c -o input-capture -lpthread
+  sudo ./input-capture [chip_address...]
+
+  prints every change on chip 0x22 (or the chips given), all 16 pins
+  being inputs. The bus is MCP23017_BUS (see bus.c), the INT line
+  MCP23017_INT (an edge source, see edge.c - GPIO 27 by default).
+
+  ./input-capture bench [events] [rate]
+
+  measures the same thing on a simulated chip at 400 kHz: a generator thread
+  changes the input pins and pulls the simulated INT line down,
+  the main thread waits for INT and reads INTF/INTCAP. First flat out
+  (events/s), then at the given rate (1000/s by default), for the latency
+  from the INT edge to having the captured pins.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "./bus.c"
+#include "./edge.c"
+#include "./latency.c"
+#include "./capture.c"
+
+#define DEFAULT_INT "/dev/gpiochip0:27"
+#define DEFAULT_CHIP 0x22
+
+struct bus bus;
+struct capture capture;
+
+// For the benchmark:
+int bench_events = 100000;
+int bench_rate;                         // events per second, 0 - as fast as they're taken
+atomic_int serviced;                    // events the main thread has read
+
+
+void *generator(void *nothing) {
+/*
+  The outside world: change one input pin at a time, then wait until
+  the event has been read before touching the chip again (the simulated
+  chip isn't thread-safe - and neither is a real one mid-transfer).
+*/
+  struct mcp23017_model *chip = &bus.sim[DEFAULT_CHIP - SIM_FIRST_ADDR];
+  struct timespec deadline;
+  uint8_t levels[2] = { 0xff, 0xff };
+  int i, pin;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  for (i = 0; i < bench_events; i++) {
+    if (bench_rate) {
+      deadline.tv_nsec += 1000000000 / bench_rate;
+      while (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        deadline.tv_sec++;
+      }
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+    pin = i % 16;
+    levels[pin / 8] ^= 1 << (pin % 8);
+    sim_set_pins(chip, pin / 8, levels[pin / 8]);
+    if (sim_interrupt(chip, pin / 8)) {
+      edge_inject(&capture.irq, 0);
+    }
+    while (atomic_load(&serviced) <= i) {
+      sched_yield();
+    }
+    edge_inject(&capture.irq, 1);
+  }
+  return NULL;
+}
+
+
+int bench_run(int rate) {
+// One benchmark pass; returns 0, or -1 if something went wrong
+  struct input_event events[CAPTURE_CHIPS];
+  pthread_t generator_thread;
+  struct bus_stats before = bus.stats;
+  uint64_t start, elapsed;
+  int count;
+
+  bench_rate = rate;
+  atomic_store(&serviced, 0);
+  capture.latency.count = 0;
+  capture.latency.min = UINT64_MAX;
+  capture.latency.max = capture.latency.sum = 0;
+  capture.events = 0;
+
+  start = monotonic_ns();
+  pthread_create(&generator_thread, NULL, generator, NULL);
+  while (atomic_load(&serviced) < bench_events) {
+    count = capture_wait(&capture, events);
+    if (count < 0) {
+      perror("capture_wait");
+      return -1;
+    }
+    if (count) {
+      atomic_fetch_add(&serviced, 1);
+    }
+  }
+  pthread_join(generator_thread, NULL);
+  elapsed = monotonic_ns() - start;
+
+  if (rate) {
+    printf("paced at %d events/s:\n", rate);
+  }
+  else {
+    printf("flat out:\n");
+  }
+  printf("  %lu events in %.3f s: %.0f events/s, %.2f syscalls and %.1f bus bytes per event, %.1f us on the wire\n",
+         capture.events, elapsed / 1e9, capture.events * 1e9 / elapsed,
+         (double) (bus.stats.syscalls - before.syscalls) / capture.events,
+         (double) (bus.stats.bytes - before.bytes) / capture.events,
+         (bus.stats.wire_ns - before.wire_ns) / 1e3 / capture.events);
+  printf("  ");
+  latency_print(&capture.latency, "INT edge to INTF/INTCAP read", stdout);
+  return 0;
+}
+
+
+int bench(int argc, char **argv) {
+  int rate = 1000;
+
+  if (argc > 2) {
+    bench_events = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    rate = atoi(argv[3]);
+  }
+  if (bench_events <= 0 || rate <= 0) {
+    fprintf(stderr, "usage: %s bench [events] [rate]\n", argv[0]);
+    return 1;
+  }
+
+  capture.chips = 1;
+  capture.chip[0].address = DEFAULT_CHIP;
+  capture.chip[0].inputs = 0xffff;
+  if (bus_open(&bus, "sim:400k") < 0 || capture_open(&capture, &bus, "sim") < 0) {
+    return 1;
+  }
+// The generator starts with all the inputs high (pulled up, switches open):
+  sim_set_pins(&bus.sim[DEFAULT_CHIP - SIM_FIRST_ADDR], 0, 0xff);
+  sim_set_pins(&bus.sim[DEFAULT_CHIP - SIM_FIRST_ADDR], 1, 0xff);
+  capture_read(&capture);
+
+  printf("%d events, one input pin changing at a time, simulated bus at %lu Hz\n",
+         bench_events, bus.speed_hz);
+  if (bench_run(0) < 0 || bench_run(rate) < 0) {
+    return 1;
+  }
+  capture_close(&capture);
+  bus_close(&bus);
+  return 0;
+}
+
+
+int main(int argc, char **argv) {
+  struct input_event events[CAPTURE_CHIPS];
+  const char *irq_spec;
+  int i, count;
+
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    return bench(argc, argv);
+  }
+
+  for (i = 1; i < argc && i <= CAPTURE_CHIPS; i++) {
+    capture.chip[i - 1].address = strtol(argv[i], NULL, 0);
+    capture.chip[i - 1].inputs = 0xffff;
+    capture.chips = i;
+  }
+  if (capture.chips == 0) {
+    capture.chip[0].address = DEFAULT_CHIP;
+    capture.chip[0].inputs = 0xffff;
+    capture.chips = 1;
+  }
+
+  irq_spec = getenv("MCP23017_INT");
+  if (irq_spec == NULL || *irq_spec == 0) {
+    irq_spec = DEFAULT_INT;
+  }
+  if (bus_open(&bus, NULL) < 0 || capture_open(&capture, &bus, irq_spec) < 0) {
+    return 1;
+  }
+
+  while ((count = capture_wait(&capture, events)) >= 0) {
+    for (i = 0; i < count; i++) {
+      printf("%llu.%06llu  chip 0x%02x  changed %04x  pins %04x\n",
+             (unsigned long long) events[i].timestamp_ns / 1000000000,
+             (unsigned long long) events[i].timestamp_ns / 1000 % 1000000,
+             events[i].address, events[i].flags, events[i].captured);
+    }
+    fflush(stdout);
+  }
+  perror("capture_wait");
+  return 1;
+}
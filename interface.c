@@ -10,17 +10,20 @@
   You must execute it with "sudo" (for example, "sudo demo").
 
   This program depends on i2c-dev library, so you won't compile it without that.
-  It also uses wiringPi for handling interrupts. wiringPi is available at:
-  http://wiringpi.com
+  It gets the input edges from the GPIO character device (see edge.c),
+  which needs Linux 5.10 or newer.
 
   You MUST compile it with a command:
 
-  gcc input_file.c -o output_file -lwiringPi
+  gcc input_file.c -o output_file
 */
 
-#include <wiringPi.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE                     // for CPU affinity, see realtime_thread()
+#endif
+
 #include <stdio.h>
-#include <sys/time.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -30,6 +33,20 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "./bus.c"
+#include "./edge.c"
+#include "./latency.c"
+#include "./ring.c"
 
 /*
   Define constants for MCP23017 I2C bus addresses
@@ -53,8 +70,8 @@
   0x27  1, 1, 1
 */
 
-// Define the physical pin number for the input we'll handle the interrupts from:
-# define INPUT_NO 11
+// The input we'll handle the interrupts from is GPIO 17 (physical pin 11)
+// on /dev/gpiochip0 - or whatever MCP23017_EDGE says, see edge.c.
 
 // Define I2C addresses for MCP23017 chips:
 #define MCP0_ADDR 0x20
@@ -63,43 +80,129 @@
 // Define constants for MCP23017 register numbers. They'll be explained later.
 #define IODIRA 0x00
 #define IODIRB 0x01
+#define IOCON 0x0A
+#define IOCON_BANK1 0x05                // where IOCON is when IOCON.BANK = 1
 #define GPIOA 0x12
 #define GPIOB 0x13
+#define OLATA 0x14
+#define OLATB 0x15
 
 // Define a constant for output and "low" status:
 #define OUTPUT_BYTE 0x00
 #define ALL_OFF 0x00
 
+/*
+  Output write modes - how set_outputs() puts the bytes on the bus:
+
+  WRITE_SINGLE - 2-byte writes (register, value), one per GPIO register;
+                 that's up to four syscalls and four START/address/STOP sequences.
+  WRITE_BURST  - one 3-byte write per chip (GPIOA, byte A, byte B).
+                 The MCP23017 increments its address pointer after each byte
+                 (IOCON.SEQOP = 0, the power-on default), so the byte following
+                 GPIOA (0x12) lands in GPIOB (0x13).
+  WRITE_RDWR   - the same two 3-byte messages, but both sent to the kernel
+                 in a single I2C_RDWR ioctl: one syscall per update,
+                 chips separated by a repeated START instead of STOP+START.
+  WRITE_SMBUS  - the bursts of WRITE_BURST, sent as SMBus "I2C block write"
+                 ioctls - for adapters that can do SMBus transfers only.
+  WRITE_URING  - the bursts of WRITE_BURST, each a write() to its chip's
+                 descriptor, but all of them handed to the kernel with one
+                 io_uring_enter() (see uring.c). Never picked by itself.
+  WRITE_AUTO   - the default: the cheapest of these that the bus adapter
+                 supports, picked for each bus when it's opened (see devices.c).
+*/
+#define WRITE_SINGLE 0
+#define WRITE_BURST 1
+#define WRITE_RDWR 2
+#define WRITE_SMBUS 3
+#define WRITE_URING 4
+#define WRITE_AUTO -1
+
 // Declare some global variables:
-static const char *device = "/dev/i2c-1";       // Filesystem path to access the I2C bus
-uint8_t buffer[2];                              // Buffer for two bytes to write to the device
-int mcp0, mcp1;                                 // Both MCP23017 chip file descriptors
-static volatile int interrupt, last_state;      // For storing the input's state
-struct timeval last_change;                     // For storing the last state change
+struct edge_source edge = {                     // Where the input edges come from
+  .debounce_ns = DEFAULT_DEBOUNCE_NS
+};
+static volatile sig_atomic_t report_requested;  // Set by SIGUSR1, see edge_report()
 
+/*
+  Measurement mode - set measure_wakeups to 1 before interface_setup()
+  and call wakeup_report() at the end, to see how long it takes
+  from an edge (as timestamped by the kernel) to send_codes() waking up,
+  and how much CPU we use.
+*/
+#define WAKEUP_SAMPLES 65536
 
+int measure_wakeups;
+struct latency wakeup_latency;
+struct latency output_latency;                  // edge to the last output byte written
+struct rusage measure_usage;
+uint64_t measure_start_ns;
 
+/*
+  Real-time mode - for when a missed machine cycle is not an option.
+  Turn it on with the MCP23017_REALTIME environment variable, or by setting
+  realtime.enabled before interface_setup():
+
+  MCP23017_REALTIME=1        - on, output thread on an isolated CPU
+                               (or the last one, if none is isolated)
+  MCP23017_REALTIME=3        - on, output thread on CPU 3
+  MCP23017_REALTIME=3:90     - ...with SCHED_FIFO priority 90 (default 80)
+  MCP23017_REALTIME=1:90     - the CPU picked as for 1, priority 90
+                               (so is :90)
+
+  interface_setup() then locks all memory and faults it in, so that
+  the output path never waits for a page. interface_run() runs the
+  sending loop in a thread pinned to the CPU, under SCHED_FIFO.
+  For best results, boot with isolcpus=3 (or whichever CPU you use),
+  so that nothing else gets scheduled there.
+*/
+#define PREFAULT_STACK (256 * 1024)
 
-void all_off(void) {
-// This function sets all outputs on both chips to 0 (off, low state).
+struct realtime_settings {
+  int enabled;
+  int cpu;                      // -1: pick one
+  int priority;                 // SCHED_FIFO priority, 1...99
+} realtime = { 0, -1, 80 };
 
-// Chip 0
-  buffer[0] = GPIOA;
-  buffer[1] = ALL_OFF;
-  write(mcp0, buffer, 2) ; //GPIOA to all off
+// The chips and buses we drive - and how we write to them:
+#include "./devices.c"
 
-  buffer[0] = GPIOB;
-  buffer[1] = ALL_OFF;
-  write(mcp0, buffer, 2) ; //GPIOB to all off
+// Which output each signal of a code word is wired to (see send_signals()):
+#include "./pinmap.c"
+
+struct pin_map pin_map;
+
+// Whole jobs translated before casting starts (see send_payload()):
+#include "./batch.c"
+
+// Many interfaces served by one thread:
+#include "./eventloop.c"
+
+
+void set_outputs_word(const struct output_word *word) {
+// Send a whole output word - GPIOA, GPIOB of every chip in the device table:
+  write_pairs(GPIOA, word);
+}
+
+
+void set_outputs(int byte1, int byte2, int byte3, int byte4) {
+// This function sends bytes (received as arguments)
+// to the chips' GPIOA, GPIOB registers - of the first two chips;
+// any other chips in the device table are turned off.
+  static struct output_word word;
+
+  word.value[0][0] = byte1;
+  word.value[0][1] = byte2;
+  word.value[1][0] = byte3;
+  word.value[1][1] = byte4;
+  set_outputs_word(&word);
+}
 
-// Chip 1
-  buffer[0] = GPIOA;
-  buffer[1] = ALL_OFF;
-  write(mcp1, buffer, 2) ; //GPIOA to all off
 
-  buffer[0] = GPIOB;
-  buffer[1] = ALL_OFF;
-  write(mcp1, buffer, 2) ; //GPIOB to all off
+void all_off(void) {
+// This function sets all outputs on all chips to 0 (off, low state).
+  static const struct output_word off;
+  set_outputs_word(&off);
 }
 
 
@@ -109,20 +212,22 @@ int mcp_init(void) {
   Chip initialization:
   The system (and kernel in particular) must set up communication
   with the MCP23017 chips over the I2C bus. It's done by opening
-  the device file (/dev/i2c-1) and calling the "ioctl" function.
+  the device file (/dev/i2c-1) and calling the "ioctl" function -
+  bus.c does that for us. It can also open an i2c-stub bus or simulated
+  chips instead, if the MCP23017_BUS environment variable says so.
+  There may be more chips, on more buses - see devices.c.
 
   The chip must also "know" that it's used for providing outputs.
   All the registers used are specified in the chip's datasheet:
   http://ww1.microchip.com/downloads/en/DeviceDoc/21952b.pdf
 */
+  struct output_word directions, outputs;
+  struct bus_stats stats;
 
-// Initialize 1st MCP23017 with 0x20 address:
-mcp0 = open(device, O_RDWR);
-ioctl(mcp0, I2C_SLAVE, MCP0_ADDR);
-
-// Initialize 2nd MCP23017 with 0x21 address:
-mcp1 = open(device, O_RDWR);
-ioctl(mcp1, I2C_SLAVE, MCP1_ADDR);
+// Open the buses - by default, one with the chips at 0x20 and 0x21:
+  if (devices_open() < 0) {
+    return -1;
+  }
 
 
 /*
@@ -151,108 +256,325 @@ ioctl(mcp1, I2C_SLAVE, MCP1_ADDR);
   First, we must set the I/O direction to output.
   Write 0x00 to all IODIRA and IODIRB registers.
 */
-// Chip 0
-  buffer[0] = IODIRA;
-  buffer[1] = OUTPUT_BYTE;
-  write(mcp0, buffer, 2) ;  // set IODIRA to all outputs
+// We've just opened the chips - we don't know what they hold,
+// unless we ask them (warm attach, see devices.c). Then we keep their
+// outputs as they are - except those that aren't outputs yet: they're
+// turned off before they become outputs, so nothing flashes on.
+  if (warm_attach) {
+    probe_bus_chips(&outputs);
+    write_pairs(GPIOA, &outputs);
+  }
+  else {
+    shadow_invalidate();
+  }
 
-  buffer[0] = IODIRB;
-  buffer[1] = OUTPUT_BYTE;
-  write(mcp0, buffer, 2) ;  // set IODIRB to all outputs
+// IODIRA and IODIRB sit next to each other (0x00, 0x01),
+// so write_pairs() sets both with one sequential write per chip
+// (none at all for the chips that warm attach found set up already):
+  memset(&directions, OUTPUT_BYTE, sizeof(directions));
+  write_pairs(IODIRA, &directions);
+
+// If a chip doesn't answer even after retries, better say so now:
+  devices_stats(&stats);
+  if (stats.failures) {
+    devices_error_report(stderr);
+    return -1;
+  }
 
-// Chip 1
-  buffer[0] = IODIRA;
-  buffer[1] = OUTPUT_BYTE;
-  write(mcp1, buffer, 2) ;  // set IODIRA to all outputs
 
-  buffer[0] = IODIRB;
-  buffer[1] = OUTPUT_BYTE;
-  write(mcp1, buffer, 2) ;  // set IODIRB to all outputs
+// Now we should initially set the outputs' state to low - unless
+// we're attaching warm, and the outputs are already what they should be.
+if (!warm_attach) {
+  all_off();
+}
+return 0;
+}
 
 
-// Now we should initially set the outputs' state to low.
-all_off();
+void request_report(int signal) {
+// SIGUSR1: print the edge statistics after the current cycle
+  report_requested = 1;
 }
 
 
-void set_outputs(int byte1, int byte2, int byte3, int byte4) {
-// This function sends bytes (received as arguments)
-// to the chips' GPIOA, GPIOB registers.
+void prefault_stack(void) {
+// Touch a good chunk of stack, so its pages are there before we need them:
+  volatile uint8_t stack[PREFAULT_STACK];
+  int i;
 
-// Chip 0
-  buffer[0] = GPIOA;
-  buffer[1] = byte1;
-  write(mcp0, buffer, 2) ; //GPIOA set byte 1
+  for (i = 0; i < PREFAULT_STACK; i += 4096) {
+    stack[i] = 0;
+  }
+  (void) stack[0];
+}
 
-  buffer[0] = GPIOB;
-  buffer[1] = byte2;
-  write(mcp0, buffer, 2) ; //GPIOB set byte 2
 
-// Chip 1
-  buffer[0] = GPIOA;
-  buffer[1] = byte3;
-  write(mcp1, buffer, 2) ; //GPIOA set byte 3
+void realtime_configure(void) {
+// Read MCP23017_REALTIME, if it's set:
+  const char *setting = getenv("MCP23017_REALTIME");
+  const char *colon;
+  size_t length;
 
-  buffer[0] = GPIOB;
-  buffer[1] = byte4;
-  write(mcp1, buffer, 2) ; //GPIOB set byte 4
+  if (setting != NULL && *setting) {
+    realtime.enabled = 1;
+    colon = strchr(setting, ':');
+    length = colon != NULL ? (size_t) (colon - setting) : strlen(setting);
+// The CPU field: empty or "1" - pick one ourselves
+    if (length > 0 && !(length == 1 && setting[0] == '1')) {
+      realtime.cpu = atoi(setting);
+    }
+    if (colon != NULL) {
+      realtime.priority = atoi(colon + 1);
+    }
+  }
 }
 
 
-void interrupt_handler(void) {
+void realtime_setup(void) {
 /*
-  Here all the magic happens...
-  Upon interrupt, this function sets the "interrupt" variable to 1.
-  This variable is polled in the send_codes function, which catches
-  the interrupt, resets the variable to 0 and checks the input status.
+  Lock all memory - current and future mappings - and make sure malloc()
+  never hands memory back to the system (or gets fresh memory with mmap),
+  so that no page faults happen later.
 */
-  struct timeval now;
-  unsigned long diff;
+  if (!realtime.enabled) {
+    return;
+  }
+
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    perror("mlockall (real-time mode needs root or CAP_IPC_LOCK)");
+  }
+  prefault_stack();
+}
+
+
+int realtime_cpu(void) {
+// The CPU for the output thread: the last isolated one, or the last one
+  char line[256];
+  FILE *isolated;
+  char *last;
+  int cpu = -1;
+
+  isolated = fopen("/sys/devices/system/cpu/isolated", "r");
+  if (isolated != NULL) {
+    if (fgets(line, sizeof(line), isolated) && line[0] >= '0' && line[0] <= '9') {
+      last = line + strlen(line);
+      while (last > line && (last[-1] < '0' || last[-1] > '9')) {
+        last--;
+      }
+      while (last > line && last[-1] >= '0' && last[-1] <= '9') {
+        last--;
+      }
+      cpu = atoi(last);
+    }
+    fclose(isolated);
+  }
+  if (cpu < 0) {
+    cpu = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  }
+  return cpu;
+}
 
-  gettimeofday(&now, NULL);
 
-// Time difference - set 10ms (1/100s)
-  diff = (now.tv_sec * 1000000 + 20000) - (last_change.tv_sec * 1000000 + last_change.tv_usec);
+struct realtime_start {
+  void *(*body)(void *);
+  void *argument;
+};
 
-// Filter any changes in intervals shorter than diff
-// (like contact bouncing etc.).
-// Change the status:
-  if (diff > 10000) {
-    interrupt = 1;
+
+void *realtime_thread(void *argument) {
+// Runs in the new thread: fault in its stack, then do the work
+  struct realtime_start *start = argument;
+  prefault_stack();
+  if (trace_enabled) {
+    trace_thread();
   }
+  return start->body(start->argument);
+}
+
 
-// Store the time for last state change:
-  last_change = now;
+void *interface_run(void *(*body)(void *), void *argument) {
+/*
+  Run body(argument) - the loop that sends the codes - and return
+  what it returns. In real-time mode it runs in its own thread,
+  pinned to one CPU under SCHED_FIFO; otherwise right here.
+  If the system won't let us have real-time scheduling, say so
+  and run it normally.
+*/
+  struct realtime_start start = { body, argument };
+  struct sched_param param;
+  pthread_attr_t attributes;
+  pthread_t thread;
+  cpu_set_t cpus;
+  void *result;
+  int error;
+
+  if (!realtime.enabled) {
+    return body(argument);
+  }
+  if (realtime.cpu < 0) {
+    realtime.cpu = realtime_cpu();
+  }
+
+  pthread_attr_init(&attributes);
+  pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attributes, SCHED_FIFO);
+  param.sched_priority = realtime.priority;
+  pthread_attr_setschedparam(&attributes, &param);
+  CPU_ZERO(&cpus);
+  CPU_SET(realtime.cpu, &cpus);
+  pthread_attr_setaffinity_np(&attributes, sizeof(cpus), &cpus);
+
+  error = pthread_create(&thread, &attributes, realtime_thread, &start);
+  if (error) {
+    fprintf(stderr, "real-time thread on CPU %d: %s - running without it\n",
+            realtime.cpu, strerror(error));
+    pthread_attr_destroy(&attributes);
+    return body(argument);
+  }
+  pthread_attr_destroy(&attributes);
+  pthread_join(thread, &result);
+  return result;
 }
 
 
 void interface_setup(void) {
 // Setup function: initialize all the inputs and outputs first:
+  realtime_configure();
+
+// MCP23017_RECORD=file - record the edges and writes, see record.c and replay.c:
+  record_configure();
 
 // Initialize the chips:
-  mcp_init();
+  if (mcp_init() < 0) {
+    exit(1);
+  }
+
+// Which signal goes to which output - MCP23017_PINMAP, or the bytes in order:
+  if (pinmap_configure(&pin_map) < 0) {
+    exit(1);
+  }
+  if (pin_map.chips > devices.chips) {
+    fprintf(stderr, "pin map: uses %d chips, there are %d\n", pin_map.chips, devices.chips);
+    exit(1);
+  }
 
-// Initialize the interrupt handling by wiringPi:
-  wiringPiSetupPhys();
-  pinMode(INPUT_NO, OUTPUT);
-  wiringPiISR(INPUT_NO, INT_EDGE_BOTH, &interrupt_handler);
-// Initialize the last_change timer
-  gettimeofday(&last_change, NULL);
+// Open the input - the kernel queues its edges for us until we read them:
+  if (edge_open(&edge, NULL) < 0) {
+    exit(1);
+  }
+  signal(SIGUSR1, request_report);
+
+// MCP23017_TRACE=file.json - record what happens, see trace.c:
+  trace_configure();
+  if (trace_enabled) {
+    trace_thread();
+  }
+  if (measure_wakeups) {
+    latency_init(&wakeup_latency, WAKEUP_SAMPLES);
+    latency_init(&output_latency, WAKEUP_SAMPLES);
+    getrusage(RUSAGE_SELF, &measure_usage);
+    measure_start_ns = monotonic_ns();
+  }
+
+// Everything is allocated now - lock it in memory if we're real-time:
+  realtime_setup();
 }
 
 
-void send_codes(int byte0, int byte1, int byte2, int byte3) {
+void clear_edges(void) {
+// Forget any edges that came before we started waiting:
+  struct edge_event event;
+  while (edge_read(&edge, &event) == 1) {
+  }
+}
+
+
+int wait_for_edge_or(int fd, struct edge_event *event) {
+/*
+  Sleep in poll() until the kernel has an edge for us - no CPU is spent
+  waiting. The event tells when the edge happened and which way it went.
+  Poll first: when we get here, the edge usually hasn't come yet,
+  so trying to read first would only cost an extra syscall.
+  Returns 1 - or 0 if fd (if it isn't -1) became readable first,
+  or -1 if the input has failed (a read error, or the other end gone):
+  there will be no more edges, and poll() would only spin.
+*/
+  struct pollfd waiting[2] = { { edge.fd, POLLIN, 0 }, { fd, POLLIN, 0 } };
+  int result;
+
+  do {
+    if (poll(waiting, 2, -1) < 0 && errno != EINTR) {
+      perror("poll");
+      exit(1);
+    }
+    if (waiting[1].revents) {
+      return 0;
+    }
+    result = edge_read(&edge, event);
+    if (result == 0 && waiting[0].revents & (POLLERR | POLLHUP)) {
+      errno = EPIPE;
+      result = -1;
+    }
+    if (result < 0) {
+      perror("edge input");
+      return -1;
+    }
+  } while (result != 1);
+  trace_at(TRACE_EDGE, event->timestamp_ns, event->rising, 0);
+  trace(TRACE_WAKEUP, 0, 0);
+  record_edge(event->timestamp_ns, event->rising);
+  if (measure_wakeups) {
+    latency_add(&wakeup_latency, monotonic_ns() - event->timestamp_ns);
+  }
+  return 1;
+}
+
+
+int wait_for_edge(struct edge_event *event) {
+// Returns 1, or -1 if the input has failed
+  return wait_for_edge_or(-1, event);
+}
+
+
+void wakeup_report(FILE *out) {
+// Print edge-to-wakeup latency and CPU usage since interface_setup():
+  struct rusage usage;
+  double cpu, wall;
+
+  getrusage(RUSAGE_SELF, &usage);
+  cpu = (usage.ru_utime.tv_sec - measure_usage.ru_utime.tv_sec)
+        + (usage.ru_stime.tv_sec - measure_usage.ru_stime.tv_sec)
+        + (usage.ru_utime.tv_usec - measure_usage.ru_utime.tv_usec) / 1e6
+        + (usage.ru_stime.tv_usec - measure_usage.ru_stime.tv_usec) / 1e6;
+  wall = (monotonic_ns() - measure_start_ns) / 1e9;
+
+  fprintf(out, "CPU: %.3f s in %.3f s (%.2f%% of a core)\n", cpu, wall, wall > 0 ? 100 * cpu / wall : 0);
+  latency_print(&wakeup_latency, "edge to wakeup", out);
+  latency_print(&output_latency, "edge to last byte", out);
+}
+
+
+void edge_report(FILE *out) {
+// Edge counts and the histogram of intervals between edges:
+  edge_histogram_print(&edge, out);
+}
+
+
+void send_word(const struct output_word *word) {
 /*
-  Wait until the interrupt, then check the input state and send codes.
+  Wait until the interrupt, then check the input state and send the word.
 
   Reset interrupt status just in case there was an interrupt before
   we called the function. This will prevent erroneous sending
   of signals when there's no actual on-off cycle on input.
 */
-  interrupt = 0;
+  clear_edges();
 
 // Set the busy condition to 1:
   int interface_busy;
+  struct edge_event event;
   interface_busy = 1;
 
 // Hold execution for an entire on-off cycle:
@@ -260,26 +582,702 @@ void send_codes(int byte0, int byte1, int byte2, int byte3) {
   while (interface_busy) {
 
 //  Wait and do nothing until we catch the interrupt
-    for (;!interrupt;) {
-    sleep(0.1);
+//  (no input, no cycles - leave everything off and give up)
+    if (wait_for_edge(&event) < 0) {
+      all_off();
+      exit(1);
     }
-    interrupt = 0;           // Reset the interrupt state
 
 /*
-    Check it the input went on or off (wiringPi can't discriminate
-    between interrupts on rising or falling edge - if we set them
-    to INT_EDGE_BOTH, the same event will be generated when the input
-    is turned on or off. We have to set a last_state variable
-    in software, and check its value each time an interrupt is generated.
+    Check it the input went on or off - the kernel tells us
+    with the event, we don't need to read the input again.
 */
-    if (digitalRead(INPUT_NO)) {   // On turning the input on
-      set_outputs(byte0, byte1, byte2, byte3);
+    if (event.rising) {            // On turning the input on
+      set_outputs_word(word);
+      if (measure_wakeups) {
+        latency_add(&output_latency, monotonic_ns() - event.timestamp_ns);
+      }
     }
     else {                    // On turning the input off
       all_off();              // Turn all outputs off
       interface_busy = 0;     // Release the interface
     }
-//    last_state =! last_state;  // Toggle the last state
   }
+
+  if (report_requested) {
+    report_requested = 0;
+    edge_report(stderr);
+  }
+  trace_poll();
+}
+
+
+void send_codes(int byte0, int byte1, int byte2, int byte3) {
+// One on-off cycle with these bytes on GPIOA, GPIOB of the first two chips
+  static struct output_word word;
+
+  word.value[0][0] = byte0;
+  word.value[0][1] = byte1;
+  word.value[1][0] = byte2;
+  word.value[1][1] = byte3;
+  send_word(&word);
+}
+
+
+void send_signals(uint32_t code) {
+/*
+  One on-off cycle with a logical code word: bit n set - signal n on,
+  wherever the pin map says it's wired. With the default map, that's
+  send_codes() with the code word's bytes 0...3.
+*/
+  static struct output_word word;
+
+  pinmap_translate(&pin_map, code, &word);
+  send_word(&word);
 }
 
+
+void send_payload(const struct payload_batch *batch, uint32_t i) {
+/*
+  One on-off cycle with code word i of a job translated by batch_translate().
+  Only the registers that changed since word i - 1 are copied into the
+  output word - so send the words in order, starting from 0.
+*/
+  static struct output_word word;
+  const uint8_t *payload = batch->payloads + (size_t) batch->index[i] * batch->stride;
+  uint32_t changed = batch->changed[i];
+  int r;
+
+  while (changed) {
+    r = __builtin_ctz(changed);
+    (&word.value[0][0])[batch->target[r]] = payload[r];
+    changed &= changed - 1;
+  }
+  send_word(&word);
+}
+
+
+/*
+  Playing code words from a ring - see job-player.c.
+  A producer thread fills the ring with output_words; on every
+  on-off cycle send_from_ring() pops one and sends it. Nothing is
+  parsed or allocated here. If the input turns on and there's no word
+  ready, that's an underrun: the cycle goes by with the outputs off.
+*/
+struct player_stats {
+  unsigned long cycles;         // words sent
+  unsigned long underruns;      // cycles with no word ready
+  unsigned long depth_sum;      // ring depth seen at each cycle, for the average
+  unsigned long depth_min, depth_max;
+} player_stats = { 0, 0, 0, ~0ul, 0 };
+
+
+int send_from_ring(struct spsc_ring *ring, atomic_int *producer_done) {
+/*
+  Play one on-off cycle. Returns 1 if a word was sent, 0 on an underrun,
+  -1 if the ring is empty and the producer has finished - the job is over,
+  or -2 if the input has failed (the outputs are turned off).
+*/
+  struct output_word word;
+  struct edge_event event;
+  unsigned long depth;
+  int result;
+
+// Wait for the input to turn on:
+  do {
+    if (wait_for_edge(&event) < 0) {
+      all_off();
+      return -2;
+    }
+    if (!event.rising) {
+      all_off();
+    }
+  } while (!event.rising);
+
+  depth = ring_depth(ring);
+  if (!ring_pop(ring, &word)) {
+    if (atomic_load(producer_done) && ring_depth(ring) == 0) {
+      return -1;
+    }
+    player_stats.underruns++;
+    return wait_for_edge(&event) < 0 ? -2 : 0;
+  }
+  set_outputs_word(&word);
+  if (measure_wakeups) {
+    latency_add(&output_latency, monotonic_ns() - event.timestamp_ns);
+  }
+
+  player_stats.cycles++;
+  player_stats.depth_sum += depth;
+  if (depth < player_stats.depth_min) {
+    player_stats.depth_min = depth;
+  }
+  if (depth > player_stats.depth_max) {
+    player_stats.depth_max = depth;
+  }
+
+// Wait for the input to turn off:
+  result = wait_for_edge(&event);
+  all_off();
+  trace_poll();
+  return result < 0 ? -2 : 1;
+}
+
+
+void player_report(FILE *out) {
+  fprintf(out, "words sent: %lu, underruns: %lu, ring depth: min %lu avg %.1f max %lu\n",
+          player_stats.cycles, player_stats.underruns,
+          player_stats.cycles ? player_stats.depth_min : 0,
+          player_stats.cycles ? (double) player_stats.depth_sum / player_stats.cycles : 0.0,
+          player_stats.depth_max);
+}
+
+
+/*
+  Submitting code words ahead - send_codes() without the waiting.
+
+  send_codes() sleeps through a whole on-off cycle and returns after it;
+  if the caller then takes a while over the next word (working it out,
+  logging), the machine's next edge can come with nobody waiting for it,
+  and that cycle is lost. submit_codes() just puts the word in a queue
+  and returns; a thread of its own (real-time, like interface_run()'s, if
+  real-time mode is on) waits for the edges and sends a word from the
+  queue on every cycle. The caller only has to stay ahead on average.
+
+  submit_start(capacity)   - start the thread, with room for this many words
+  submit_codes(b0...b3)    - queue a word, like send_codes(); returns 1, or 0
+  submit_word(word)          if the queue is full (an overrun - the word is
+  submit_signals(code)       dropped, and counted)
+  submit_wait()            - sleep until there's room in the queue
+  submit_flush()           - sleep until every word submitted so far has
+                             gone through its cycle
+  submit_stop()            - stop the thread and turn the outputs off
+
+  If the input fails, the thread turns the outputs off and stops by
+  itself: submit_wait() and submit_flush() return -1 from then on.
+
+  A cycle that comes when the queue is empty is an underrun (cycles before
+  the first word aren't counted - the job hasn't started). What happens
+  then is up to underrun_policy, or MCP23017_UNDERRUN=blank|repeat|hold:
+
+  SUBMIT_BLANK  - the default: the cycle goes by with the outputs off
+  SUBMIT_REPEAT - the last word is sent again
+  SUBMIT_HOLD   - the outputs aren't turned off at the end of a cycle if
+                  there's nothing after it: the last word stays on until
+                  the next one replaces it - for outputs that are levels,
+                  not pulses.
+*/
+#define SUBMIT_BLANK 0
+#define SUBMIT_REPEAT 1
+#define SUBMIT_HOLD 2
+
+static const char *underrun_policies[] = { "blank", "repeat", "hold" };
+int underrun_policy = SUBMIT_BLANK;
+
+struct submit_queue {
+  struct spsc_ring ring;
+  atomic_uint progress;         // bumped when a word is taken or done - waiters sleep on it
+  atomic_int waiting;           // someone's asleep on progress
+  atomic_ulong done;            // words whose cycle is over
+  atomic_int stopping;
+  int stop_fd;                  // an eventfd: wakes the thread up to stop
+  int running;
+  pthread_t thread;
+  unsigned long submitted;      // caller side
+  unsigned long overruns;       // caller side: words dropped, the queue was full
+  unsigned long sent, repeated, held, underruns, depth_max;     // thread side
+} submit;
+
+
+void submit_progress(void) {
+// Thread side: something changed - wake anyone waiting in submit_wait/flush()
+  atomic_fetch_add(&submit.progress, 1);
+  if (atomic_load(&submit.waiting)) {
+    futex(&submit.progress, FUTEX_WAKE_PRIVATE, INT32_MAX);
+  }
+}
+
+
+void *submit_loop(void *nothing) {
+// The edge handler: a word from the queue on every cycle, until submit_stop()
+  static struct output_word word, last;
+  struct edge_event event;
+  unsigned long depth;
+  int started = 0, active = 0, result;
+
+  clear_edges();
+  while ((result = wait_for_edge_or(submit.stop_fd, &event)) > 0) {
+    if (event.rising) {
+      depth = ring_depth(&submit.ring);
+      if (depth > submit.depth_max) {
+        submit.depth_max = depth;
+      }
+      if (ring_pop(&submit.ring, &word)) {
+        set_outputs_word(&word);
+        last = word;
+        started = 1;
+        active = 1;
+        submit.sent++;
+        if (measure_wakeups) {
+          latency_add(&output_latency, monotonic_ns() - event.timestamp_ns);
+        }
+        submit_progress();
+      }
+      else if (started) {
+        submit.underruns++;
+        if (underrun_policy == SUBMIT_REPEAT) {
+          set_outputs_word(&last);
+          submit.repeated++;
+        }
+      }
+      continue;
+    }
+
+// The end of a cycle:
+    if (underrun_policy == SUBMIT_HOLD && started && ring_depth(&submit.ring) == 0) {
+      submit.held++;
+    }
+    else {
+      all_off();
+    }
+    if (active) {
+      active = 0;
+      atomic_fetch_add(&submit.done, 1);
+      submit_progress();
+    }
+    trace_poll();
+  }
+  all_off();
+  if (result < 0) {
+// The input has failed - no one should wait for cycles that won't come:
+    atomic_store(&submit.stopping, 1);
+    submit_progress();
+  }
+  return NULL;
+}
+
+
+void *submit_thread(void *nothing) {
+  return interface_run(submit_loop, NULL);
+}
+
+
+int submit_start(unsigned long capacity) {
+/*
+  Start sending submitted words - after interface_setup(). The capacity
+  must be a power of two. Returns 0, or -1.
+*/
+  const char *policy = getenv("MCP23017_UNDERRUN");
+  int i, error;
+
+  if (policy != NULL && *policy) {
+    for (i = 0; i < 3 && strcmp(policy, underrun_policies[i]) != 0; i++) {
+    }
+    if (i == 3) {
+      fprintf(stderr, "MCP23017_UNDERRUN: blank, repeat or hold, not %s\n", policy);
+      errno = EINVAL;
+      return -1;
+    }
+    underrun_policy = i;
+  }
+
+  memset(&submit, 0, sizeof(submit));
+  if (ring_init(&submit.ring, sizeof(struct output_word), capacity) < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  submit.stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (submit.stop_fd < 0) {
+    ring_free(&submit.ring);
+    return -1;
+  }
+  error = pthread_create(&submit.thread, NULL, submit_thread, NULL);
+  if (error) {
+    close(submit.stop_fd);
+    ring_free(&submit.ring);
+    errno = error;
+    return -1;
+  }
+  submit.running = 1;
+  return 0;
+}
+
+
+int submit_word(const struct output_word *word) {
+// Queue a word for the next free cycle. Returns 1, or 0 if the queue is full.
+  if (!ring_push(&submit.ring, word)) {
+    submit.overruns++;
+    return 0;
+  }
+  submit.submitted++;
+  return 1;
+}
+
+
+int submit_codes(int byte0, int byte1, int byte2, int byte3) {
+// Like send_codes(): these bytes on GPIOA, GPIOB of the first two chips
+  static struct output_word word;
+
+  word.value[0][0] = byte0;
+  word.value[0][1] = byte1;
+  word.value[1][0] = byte2;
+  word.value[1][1] = byte3;
+  return submit_word(&word);
+}
+
+
+int submit_signals(uint32_t code) {
+// Like send_signals(): a logical code word, through the pin map
+  static struct output_word word;
+
+  pinmap_translate(&pin_map, code, &word);
+  return submit_word(&word);
+}
+
+
+int submit_sleep(int (*ready)(void)) {
+// Sleep until ready() - or the thread stops (returns -1)
+  unsigned int seen;
+
+  for (;;) {
+    seen = atomic_load(&submit.progress);
+    if (ready()) {
+      return 0;
+    }
+    if (atomic_load(&submit.stopping)) {
+      return -1;
+    }
+    atomic_store(&submit.waiting, 1);
+    futex(&submit.progress, FUTEX_WAIT_PRIVATE, seen);
+    atomic_store(&submit.waiting, 0);
+  }
+}
+
+
+int submit_has_room(void) {
+  return ring_depth(&submit.ring) <= submit.ring.mask;
+}
+
+
+int submit_all_done(void) {
+  return atomic_load(&submit.done) == submit.submitted;
+}
+
+
+int submit_wait(void) {
+// Sleep until a word can be submitted. Returns 0, or -1 if stopped.
+  return submit_sleep(submit_has_room);
+}
+
+
+int submit_flush(void) {
+// Sleep until every word submitted is through its cycle. Returns 0, or -1 if stopped.
+  return submit_sleep(submit_all_done);
+}
+
+
+void submit_stop(void) {
+// Stop right away - words still queued aren't sent. The outputs are turned off.
+  uint64_t one = 1;
+
+  if (!submit.running) {
+    return;
+  }
+  atomic_store(&submit.stopping, 1);
+  if (write(submit.stop_fd, &one, sizeof(one)) < 0) {
+    perror("submit_stop");
+  }
+  pthread_join(submit.thread, NULL);
+  submit_progress();
+  close(submit.stop_fd);
+  ring_free(&submit.ring);
+  submit.running = 0;
+}
+
+
+void submit_report(FILE *out) {
+  fprintf(out, "submitted: %lu, sent: %lu, overruns: %lu, underruns: %lu (%s: %lu repeated, %lu held), "
+          "queue depth max %lu\n",
+          submit.submitted, submit.sent, submit.overruns, submit.underruns,
+          underrun_policies[underrun_policy], submit.repeated, submit.held, submit.depth_max);
+}
+
+
+/*
+  Pins - outputs set and cleared from any thread, written out together.
+
+  set_outputs() and send_codes() take the whole word at once, from one
+  thread. Control software where several threads each own a few outputs
+  (the pump, the air valve, the justification wedges) would need a lock
+  around a shared word, and a bus write for every change.
+
+  Here, every chip's outputs are an atomic word (bits 0-7 bank A, 8-15
+  bank B), and a change is an atomic fetch_or or fetch_and on it - no
+  lock, no syscall, from any thread. A single flusher then writes out
+  whatever has changed since it last looked: one snapshot of all the
+  words, written like any update (see write_pairs() in devices.c) - the
+  shadow registers leave out every register that hasn't changed, and each
+  bus gets a burst per chip or one transaction for all of them. However
+  many changes came in meanwhile, they cost one update.
+
+  pins_set(chip, mask), pins_clear(chip, mask) - turn outputs on or off
+  pins_assign(chip, mask, bits)                - set the outputs in mask to bits
+  pin_on(pin), pin_off(pin)                    - one output: chip * 16 + bank * 8 + bit,
+                                                 as pin maps number them
+  signals_on(code), signals_off(code)          - signals, through the pin map
+  pins_flush()                                 - write the changes out now
+
+  The changes return 0, or -1 (EINVAL) for a chip that isn't in the
+  device table.
+
+  or let a thread of its own do the flushing:
+
+  pins_start(deadline_us) - flush deadline_us after the first change that
+                            comes in (the changes meanwhile go with it);
+                            0 - flush on every rising edge of the input,
+                            once per machine cycle
+  pins_stop()             - flush what's left and stop
+
+  Outputs set this way are levels: they stay as they are until changed.
+  The flusher is the only writer - don't call set_outputs() or send_codes()
+  while it runs.
+*/
+
+struct pin_state {
+  atomic_uint value[MAX_CHIPS];         // the outputs as they should be - bank A, bank B << 8
+  atomic_ullong dirty;                  // bit n: chip n has changed since the last flush
+  atomic_ulong changes;                 // since pins_start()
+  atomic_uint wake;                     // the flusher sleeps on it: bumped to wake it up
+  atomic_int waiting;                   // the flusher is asleep on wake
+  atomic_int stopping;
+  uint64_t deadline_ns;
+  int stop_fd;                          // an eventfd: stops a flusher waiting for an edge
+  int running;
+  pthread_t thread;
+  unsigned long flushes, chips_written;         // flusher side
+} pins;
+
+
+static inline int pins_changed(int chip) {
+/*
+  After a change: mark the chip, wake the flusher if it's asleep. The flusher
+  says it's going to sleep, then looks at dirty; we mark dirty, then look
+  whether it sleeps - one of us sees the other (sequentially consistent).
+*/
+  atomic_fetch_or(&pins.dirty, 1ull << chip);
+  atomic_fetch_add_explicit(&pins.changes, 1, memory_order_relaxed);
+  if (atomic_load(&pins.waiting)) {
+    atomic_fetch_add(&pins.wake, 1);
+    futex(&pins.wake, FUTEX_WAKE_PRIVATE, 1);
+  }
+  return 0;
+}
+
+
+static inline int pins_set(int chip, unsigned mask) {
+// Returns 0, or -1 (EINVAL) if there's no such chip in the device table - likewise below
+  if (chip < 0 || chip >= devices.chips) {
+    errno = EINVAL;
+    return -1;
+  }
+  atomic_fetch_or_explicit(&pins.value[chip], mask & 0xffff, memory_order_relaxed);
+  return pins_changed(chip);
+}
+
+
+static inline int pins_clear(int chip, unsigned mask) {
+  if (chip < 0 || chip >= devices.chips) {
+    errno = EINVAL;
+    return -1;
+  }
+  atomic_fetch_and_explicit(&pins.value[chip], ~mask, memory_order_relaxed);
+  return pins_changed(chip);
+}
+
+
+static inline int pins_assign(int chip, unsigned mask, unsigned bits) {
+// Some outputs on, some off, in one change - others may be changing the rest meanwhile
+  unsigned old;
+
+  if (chip < 0 || chip >= devices.chips) {
+    errno = EINVAL;
+    return -1;
+  }
+  old = atomic_load_explicit(&pins.value[chip], memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&pins.value[chip], &old, (old & ~mask) | (bits & mask & 0xffff),
+                                                memory_order_relaxed, memory_order_relaxed)) {
+  }
+  return pins_changed(chip);
+}
+
+
+static inline int pin_on(int pin) {
+  return pins_set(pin < 0 ? -1 : pin >> 4, 1u << (pin & 15));
+}
+
+
+static inline int pin_off(int pin) {
+  return pins_clear(pin < 0 ? -1 : pin >> 4, 1u << (pin & 15));
+}
+
+
+int signals_change(uint32_t code, int on) {
+// The signals set in code, wherever the pin map has them - one change per chip. Returns 0, or -1.
+  struct output_word word;
+  unsigned mask;
+  int c, result = 0;
+
+  memset(&word, 0, sizeof(word));
+  pinmap_translate(&pin_map, code, &word);
+  for (c = 0; c < pin_map.chips; c++) {
+    mask = word.value[c][0] | word.value[c][1] << 8;
+    if (mask == 0) {
+      continue;
+    }
+    if ((on ? pins_set(c, mask) : pins_clear(c, mask)) < 0) {
+      result = -1;
+    }
+  }
+  return result;
+}
+
+
+int signals_on(uint32_t code) {
+  return signals_change(code, 1);
+}
+
+
+int signals_off(uint32_t code) {
+  return signals_change(code, 0);
+}
+
+
+int pins_flush(void) {
+/*
+  Write out everything that has changed - from one thread only. Returns
+  the number of chips that had changes (0 - nothing was written).
+*/
+  static struct output_word word;
+  unsigned long long dirty;
+  unsigned value;
+  int c, count = 0;
+
+  dirty = atomic_exchange_explicit(&pins.dirty, 0, memory_order_acquire);
+  if (dirty == 0) {
+    return 0;
+  }
+// A change that comes after this is written now or by the next flush - never lost:
+  for (c = 0; c < devices.chips; c++) {
+    value = atomic_load_explicit(&pins.value[c], memory_order_relaxed);
+    word.value[c][0] = value & 0xff;
+    word.value[c][1] = value >> 8;
+    count += (dirty >> c) & 1;
+  }
+  set_outputs_word(&word);
+  pins.flushes++;
+  pins.chips_written += count;
+  return count;
+}
+
+
+void pins_sleep_until(uint64_t ns) {
+  struct timespec deadline;
+
+  deadline.tv_sec = ns / 1000000000;
+  deadline.tv_nsec = ns % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+  }
+}
+
+
+void *pins_loop(void *nothing) {
+// The flusher: on a deadline after the first change, or on every rising edge
+  struct edge_event event;
+  unsigned int seen;
+
+  if (pins.deadline_ns == 0) {
+    clear_edges();
+// If the input fails, that's the last flush - call pins_flush() yourself from then on:
+    while (wait_for_edge_or(pins.stop_fd, &event) > 0) {
+      if (event.rising) {
+        pins_flush();
+      }
+    }
+    pins_flush();
+    return NULL;
+  }
+
+  while (!atomic_load(&pins.stopping)) {
+    if (atomic_load(&pins.dirty) == 0) {
+      seen = atomic_load(&pins.wake);
+      atomic_store(&pins.waiting, 1);
+      if (atomic_load(&pins.dirty) == 0 && !atomic_load(&pins.stopping)) {
+        futex(&pins.wake, FUTEX_WAIT_PRIVATE, seen);
+      }
+      atomic_store(&pins.waiting, 0);
+      continue;
+    }
+// Something has changed: give whatever else is coming the deadline to come
+    pins_sleep_until(monotonic_ns() + pins.deadline_ns);
+    pins_flush();
+  }
+  pins_flush();
+  return NULL;
+}
+
+
+void *pins_thread(void *nothing) {
+  return interface_run(pins_loop, NULL);
+}
+
+
+int pins_start(unsigned long deadline_us) {
+/*
+  Start the flusher - after interface_setup(). Whatever outputs are on
+  now stay on (warm attach, see devices.c) - it starts from them.
+  Returns 0, or -1.
+*/
+  struct output_word outputs;
+  int c, error;
+
+  devices_outputs(&outputs);
+  for (c = 0; c < MAX_CHIPS; c++) {
+    atomic_store(&pins.value[c], c < devices.chips ? outputs.value[c][0] | outputs.value[c][1] << 8 : 0);
+  }
+  atomic_store(&pins.dirty, 0);
+  atomic_store(&pins.changes, 0);
+  atomic_store(&pins.stopping, 0);
+  pins.deadline_ns = deadline_us * 1000;
+  pins.flushes = pins.chips_written = 0;
+  pins.stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (pins.stop_fd < 0) {
+    return -1;
+  }
+  error = pthread_create(&pins.thread, NULL, pins_thread, NULL);
+  if (error) {
+    close(pins.stop_fd);
+    errno = error;
+    return -1;
+  }
+  pins.running = 1;
+  return 0;
+}
+
+
+void pins_stop(void) {
+// Write out the last changes and stop the flusher - the outputs stay as they are
+  uint64_t one = 1;
+
+  if (!pins.running) {
+    return;
+  }
+  atomic_store(&pins.stopping, 1);
+  atomic_fetch_add(&pins.wake, 1);
+  futex(&pins.wake, FUTEX_WAKE_PRIVATE, 1);
+  if (write(pins.stop_fd, &one, sizeof(one)) < 0) {
+    perror("pins_stop");
+  }
+  pthread_join(pins.thread, NULL);
+  close(pins.stop_fd);
+  pins.running = 0;
+}
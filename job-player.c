@@ -0,0 +1,331 @@
+/*
+  Job player - sends a whole job of code words to the interface,
+  one word per machine cycle.
+
+  A job is a binary file:
+
+  offset  size  contents
+  0       4     "MCPJ"
+  4       2     format version (1), little endian
+  6       2     word size in bytes (4)
+  8       4     number of code words, little endian
+  12      4     reserved (0)
+  16      4*n   code words: byte 0...3, like send_codes() takes them
+                (with a pin map, bit n of the little endian word
+                is signal n - see pinmap.c)
+
+  The player memory-maps the job file (or reads it from standard input, when
+  the file name is "-"). A producer thread translates the code words into
+  register values and keeps a lock-free ring filled with them; the main thread
+  only pops a ready word on every cycle and sends it. So the cycle costs
+  the same whether the job has ten words or a million.
+
+  Make a job file from text - four bytes per line, in any notation C
+  understands (0x11 53 0144 0b10101010):
+
+  job-player -c codes.txt codes.job
+
+  Play it:
+
+  job-player codes.job
+
+  or translate the whole job before the machine starts (see batch.c),
+  and play it without the producer thread:
+
+  job-player -a codes.job
+
+  Compile with:
+
+  gcc job-player.c -o job-player -lpthread
+*/
+
+#include "./interface.c"
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define JOB_MAGIC "MCPJ"
+#define JOB_VERSION 1
+#define JOB_HEADER_SIZE 16
+#define JOB_WORD_SIZE 4
+#define RING_CAPACITY 4096
+
+struct job {
+  const uint8_t *words;         // mapped code words, or NULL when streaming
+  uint32_t count;
+  FILE *stream;                 // standard input, when streaming
+};
+
+struct spsc_ring job_ring;
+atomic_int producer_done;
+
+
+uint32_t read_le32(const uint8_t *bytes) {
+  return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
+
+
+int check_header(const uint8_t *header, const char *name) {
+// Returns 0, or -1 if this isn't a job we can play
+  if (memcmp(header, JOB_MAGIC, 4) != 0
+      || (header[4] | header[5] << 8) != JOB_VERSION
+      || (header[6] | header[7] << 8) != JOB_WORD_SIZE) {
+    fprintf(stderr, "%s: not a version %d job file\n", name, JOB_VERSION);
+    return -1;
+  }
+  return 0;
+}
+
+
+int job_open(struct job *job, const char *name) {
+  uint8_t header[JOB_HEADER_SIZE];
+  struct stat info;
+  const uint8_t *map;
+  int fd;
+
+  memset(job, 0, sizeof(*job));
+
+  if (strcmp(name, "-") == 0) {
+    job->stream = stdin;
+    if (fread(header, 1, JOB_HEADER_SIZE, stdin) != JOB_HEADER_SIZE || check_header(header, name) < 0) {
+      return -1;
+    }
+    job->count = read_le32(header + 8);
+    return 0;
+  }
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &info) < 0) {
+    perror(name);
+    return -1;
+  }
+  if (info.st_size < JOB_HEADER_SIZE) {
+    fprintf(stderr, "%s: too short\n", name);
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  if (check_header(map, name) < 0) {
+    return -1;
+  }
+  job->count = read_le32(map + 8);
+  if ((off_t) job->count * JOB_WORD_SIZE > info.st_size - JOB_HEADER_SIZE) {
+    fprintf(stderr, "%s: truncated - %u words expected\n", name, job->count);
+    return -1;
+  }
+  job->words = map + JOB_HEADER_SIZE;
+  madvise((void *) map, info.st_size, MADV_SEQUENTIAL);
+  return 0;
+}
+
+
+void translate(const uint8_t *code, struct output_word *word) {
+// Signals to outputs, as the pin map says - by default, code word bytes 0...3
+// go to chip 0 GPIOA, GPIOB, chip 1 GPIOA, GPIOB:
+  pinmap_translate(&pin_map, read_le32(code), word);
+}
+
+
+void *producer(void *argument) {
+/*
+  Translate the job's code words and keep the ring full.
+  When the ring is full, nap for a bit - the output thread takes
+  one word per machine cycle, so there's no hurry.
+*/
+  struct job *job = argument;
+  struct timespec nap = { 0, 200000 };
+  struct output_word word;
+  uint8_t code[JOB_WORD_SIZE];
+  uint32_t i;
+
+  memset(&word, 0, sizeof(word));
+
+  for (i = 0; i < job->count; i++) {
+    if (job->stream) {
+      if (fread(code, 1, JOB_WORD_SIZE, job->stream) != JOB_WORD_SIZE) {
+        fprintf(stderr, "job ended after %u words\n", i);
+        break;
+      }
+      translate(code, &word);
+    }
+    else {
+      translate(job->words + i * JOB_WORD_SIZE, &word);
+    }
+    while (!ring_push(&job_ring, &word)) {
+      nanosleep(&nap, NULL);
+    }
+  }
+  atomic_store(&producer_done, 1);
+  return NULL;
+}
+
+
+int convert(const char *text_name, const char *job_name) {
+// Make a binary job file from a text file with four bytes per line
+  uint8_t header[JOB_HEADER_SIZE] = { 'M', 'C', 'P', 'J', JOB_VERSION, 0, JOB_WORD_SIZE, 0 };
+  char line[256];
+  long value;
+  uint8_t code[JOB_WORD_SIZE];
+  uint32_t count = 0;
+  FILE *text, *job;
+  int i;
+
+  text = fopen(text_name, "r");
+  job = fopen(job_name, "wb");
+  if (text == NULL || job == NULL) {
+    perror(text == NULL ? text_name : job_name);
+    return 1;
+  }
+  fwrite(header, 1, JOB_HEADER_SIZE, job);
+
+  while (fgets(line, sizeof(line), text)) {
+    char *next = line, *end;
+    for (i = 0; i < JOB_WORD_SIZE; i++) {
+      if (next[0] == '0' && (next[1] == 'b' || next[1] == 'B')) {
+        value = strtol(next + 2, &end, 2);
+      }
+      else {
+        value = strtol(next, &end, 0);
+      }
+      if (end == next) {
+        break;
+      }
+      next = end + strspn(end, " \t,");
+      code[i] = value;
+    }
+    if (i == 0) {
+      continue;                 // an empty line
+    }
+    if (i < JOB_WORD_SIZE) {
+      fprintf(stderr, "%s: line %u: expected %d bytes\n", text_name, count + 1, JOB_WORD_SIZE);
+      return 1;
+    }
+    fwrite(code, 1, JOB_WORD_SIZE, job);
+    count++;
+  }
+
+  header[8] = count;
+  header[9] = count >> 8;
+  header[10] = count >> 16;
+  header[11] = count >> 24;
+  fseek(job, 0, SEEK_SET);
+  fwrite(header, 1, JOB_HEADER_SIZE, job);
+  fclose(job);
+  fclose(text);
+  printf("%u code words written to %s\n", count, job_name);
+  return 0;
+}
+
+
+struct payload_batch batch;
+
+
+int stage(struct job *job) {
+// Translate the whole job now. Returns 0 or -1.
+  uint32_t *codes, i;
+  uint64_t start;
+
+  if (job->words == NULL) {
+    fprintf(stderr, "-a needs a job file, not standard input\n");
+    return -1;
+  }
+  codes = malloc((size_t) job->count * sizeof(*codes) + 1);
+  if (codes == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  for (i = 0; i < job->count; i++) {
+    codes[i] = read_le32(job->words + i * JOB_WORD_SIZE);
+  }
+  start = monotonic_ns();
+  batch_prepare(&batch, &pin_map);
+  if (batch_translate(&batch, &pin_map, codes, job->count) < 0) {
+    perror("batch_translate");
+    return -1;
+  }
+  printf("%u code words translated in %.1f ms (%s): %u distinct, %d bytes each\n",
+         job->count, (monotonic_ns() - start) / 1e6, batch_method_names[batch.method],
+         batch.unique, batch.registers);
+  free(codes);
+  return 0;
+}
+
+
+void *play_staged(void *nothing) {
+// The output loop for a translated job: one word per on-off cycle
+  uint32_t i;
+
+  for (i = 0; i < batch.count; i++) {
+    send_payload(&batch, i);
+    player_stats.cycles++;
+  }
+  return NULL;
+}
+
+
+void *play(void *nothing) {
+// The output loop - in a real-time thread, if MCP23017_REALTIME is set
+  int result;
+
+  while ((result = send_from_ring(&job_ring, &producer_done)) >= 0) {
+  }
+// No input: the producer may be waiting for room that will never come
+  if (result == -2) {
+    player_report(stdout);
+    exit(1);
+  }
+  return NULL;
+}
+
+
+int main(int argc, char **argv) {
+  struct job job;
+  pthread_t producer_thread;
+
+  if (argc == 4 && strcmp(argv[1], "-c") == 0) {
+    return convert(argv[2], argv[3]);
+  }
+  if (argc == 3 && strcmp(argv[1], "-a") == 0) {
+    if (job_open(&job, argv[2]) < 0) {
+      return 1;
+    }
+    interface_setup();
+    if (stage(&job) < 0) {
+      return 1;
+    }
+    interface_run(play_staged, NULL);
+    player_report(stdout);
+    return 0;
+  }
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s job_file | -\n       %s -a job_file\n       %s -c text_file job_file\n",
+            argv[0], argv[0], argv[0]);
+    return 1;
+  }
+  if (job_open(&job, argv[1]) < 0) {
+    return 1;
+  }
+  if (ring_init(&job_ring, sizeof(struct output_word), RING_CAPACITY) < 0) {
+    perror("ring_init");
+    return 1;
+  }
+
+  interface_setup();
+
+// Let the producer get ahead before the machine starts:
+  pthread_create(&producer_thread, NULL, producer, &job);
+  while (!atomic_load(&producer_done) && ring_depth(&job_ring) < RING_CAPACITY / 2) {
+    usleep(1000);
+  }
+
+  interface_run(play, NULL);
+
+  pthread_join(producer_thread, NULL);
+  player_report(stdout);
+  return 0;
+}
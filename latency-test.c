@@ -0,0 +1,202 @@
+/*
+  Latency test for the edge-to-output path, in the spirit of cyclictest.
+
+  A generator thread makes on-off cycles of the input at a fixed rate,
+  on absolute deadlines; the output loop (send_codes) answers every one
+  of them, and we measure how long it takes from the edge (its kernel
+  timestamp) to the last byte of the code word being written out.
+  Meanwhile, load threads keep all CPUs busy with memory traffic and
+  syscalls, to see what a busy system does to that.
+
+  By default it runs with simulated edges and simulated chips at 400 kHz,
+  so it works on any Linux box; set MCP23017_BUS (and MCP23017_EDGE,
+  with an external signal generator) to test the real thing.
+  Add MCP23017_REALTIME=1 (as root) to see the difference real-time mode makes:
+
+  gcc latency-test.c -o latency-test -lpthread
+  ./latency-test [cycles] [cycle_us] [load_threads]
+  sudo MCP23017_REALTIME=1 ./latency-test 100000 1000 4
+
+  A real caller does something between two words - works out the next
+  one, logs the last. Give it work_us of that per word (and eight times
+  as much every 32nd word, like a log write) to see how many machine
+  cycles go by with nobody waiting - and with -s, how submitting the
+  words ahead (submit_codes(), see interface.c) makes up for it:
+
+  ./latency-test 2000 2000 0 1500
+  ./latency-test -s 2000 2000 0 1500
+*/
+
+#include "./interface.c"
+
+#define LOAD_BUFFER (8 * 1024 * 1024)
+
+int cycles = 10000;
+int cycle_us = 2000;
+int work_us = 0;
+atomic_int running = 1;
+atomic_int started;             // the first word is on its way - count machine cycles
+atomic_int machine_cycles;
+
+
+void *generator(void *nothing) {
+/*
+  The "machine": input on for half a cycle, off for the other half.
+  It keeps going until the output loop is done - if it misses a cycle,
+  it'll need more of them.
+*/
+  struct timespec deadline;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  for (i = 0; atomic_load(&running); i++) {
+    deadline.tv_nsec += cycle_us * 500;
+    while (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_nsec -= 1000000000;
+      deadline.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    edge_inject(&edge, !(i & 1));
+    if (!(i & 1) && atomic_load(&started)) {
+      atomic_fetch_add(&machine_cycles, 1);
+    }
+  }
+  return NULL;
+}
+
+
+void *load(void *nothing) {
+// Synthetic load: stream through a buffer bigger than the caches, make syscalls
+  uint8_t *buffer = malloc(LOAD_BUFFER);
+  int i = 0;
+
+  while (atomic_load(&running)) {
+    memset(buffer, i++, LOAD_BUFFER);
+    getppid();
+    sched_yield();
+  }
+  free(buffer);
+  return NULL;
+}
+
+
+void work(int i) {
+// What the caller does between words
+  struct timespec pause;
+  long us = i % 32 == 31 ? 8 * work_us : work_us;
+
+  if (us > 0) {
+    pause.tv_sec = us / 1000000;
+    pause.tv_nsec = us % 1000000 * 1000;
+    nanosleep(&pause, NULL);
+  }
+}
+
+
+void *output_loop(void *nothing) {
+  int i;
+
+  atomic_store(&started, 1);
+  for (i = 0; i < cycles; i++) {
+    send_codes(i & 0xff, 0x55, (i >> 8) & 0xff, 0xaa);
+    work(i);
+  }
+  return NULL;
+}
+
+
+void submit_loop_words(void) {
+// The same words, submitted ahead: the caller only waits when the queue is full
+  int i;
+
+  atomic_store(&started, 1);
+  for (i = 0; i < cycles; i++) {
+    if (submit_wait() < 0) {
+      break;
+    }
+    submit_codes(i & 0xff, 0x55, (i >> 8) & 0xff, 0xaa);
+    work(i);
+  }
+  submit_flush();
+}
+
+
+int main(int argc, char **argv) {
+  pthread_t generator_thread, *load_threads;
+  int loads, i, simulated_edges, submitting = 0;
+
+  if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+    submitting = 1;
+    argc--;
+    argv++;
+  }
+  loads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc > 1) {
+    cycles = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    cycle_us = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    loads = atoi(argv[3]);
+  }
+  if (argc > 4) {
+    work_us = atoi(argv[4]);
+  }
+  if (cycles <= 0 || cycle_us <= 0 || loads < 0 || work_us < 0) {
+    fprintf(stderr, "usage: %s [-s] [cycles] [cycle_us] [load_threads] [work_us]\n", argv[0]);
+    return 1;
+  }
+
+  setenv("MCP23017_BUS", "sim:400k", 0);
+  setenv("MCP23017_EDGE", "sim", 0);
+  simulated_edges = strcmp(getenv("MCP23017_EDGE"), "sim") == 0;
+
+// The cycles are short - don't mistake them for bounces:
+  edge.debounce_ns = cycle_us * 250;
+  measure_wakeups = 1;
+  interface_setup();
+
+  printf("%d cycles of %d us, %d load threads, %d us of work per word, %s, bus %s at %lu Hz, real-time %s\n",
+         cycles, cycle_us, loads, work_us, submitting ? "submitted ahead" : "send_codes()",
+         devices.bus[0].bus.device, devices.bus[0].bus.speed_hz, realtime.enabled ? "on" : "off");
+
+  load_threads = calloc(loads, sizeof(pthread_t));
+  for (i = 0; i < loads; i++) {
+    pthread_create(&load_threads[i], NULL, load, NULL);
+  }
+  if (simulated_edges) {
+    pthread_create(&generator_thread, NULL, generator, NULL);
+  }
+
+  if (submitting) {
+    if (submit_start(64) < 0) {
+      perror("submit_start");
+      return 1;
+    }
+    submit_loop_words();
+  }
+  else {
+    interface_run(output_loop, NULL);
+  }
+
+  atomic_store(&running, 0);
+  if (simulated_edges) {
+    pthread_join(generator_thread, NULL);
+  }
+  for (i = 0; i < loads; i++) {
+    pthread_join(load_threads[i], NULL);
+  }
+
+  if (submitting) {
+    submit_stop();
+    submit_report(stdout);
+  }
+  if (simulated_edges) {
+    printf("%lu of %d words written, in %d machine cycles\n",
+           output_latency.count, cycles, atomic_load(&machine_cycles));
+  }
+  wakeup_report(stdout);
+  edge_report(stdout);
+  return 0;
+}
@@ -0,0 +1,85 @@
+/*
+  Latency sample collection for the measurement modes and benchmarks.
+
+  Samples (in nanoseconds) go to a preallocated ring, so adding one
+  never allocates - it's safe to call in the output path. When the ring
+  is full, the oldest samples are overwritten; min, max and mean
+  still cover everything that's been added.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+struct latency {
+  uint32_t *samples;            // ring of the most recent samples, in ns
+  unsigned long capacity;
+  unsigned long count;          // samples added so far
+  uint64_t min, max, sum;
+};
+
+
+int latency_init(struct latency *latency, unsigned long capacity) {
+  latency->samples = calloc(capacity, sizeof(uint32_t));
+  latency->capacity = capacity;
+  latency->count = 0;
+  latency->min = UINT64_MAX;
+  latency->max = 0;
+  latency->sum = 0;
+  return latency->samples == NULL ? -1 : 0;
+}
+
+
+void latency_add(struct latency *latency, uint64_t ns) {
+  latency->samples[latency->count % latency->capacity] = ns > UINT32_MAX ? UINT32_MAX : ns;
+  latency->count++;
+  latency->sum += ns;
+  if (ns < latency->min) {
+    latency->min = ns;
+  }
+  if (ns > latency->max) {
+    latency->max = ns;
+  }
+}
+
+
+int compare_samples(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return (x > y) - (x < y);
+}
+
+
+uint64_t latency_percentile(struct latency *latency, double percent) {
+/*
+  Percentile of the samples still in the ring. Sorts them in place,
+  so call it once measuring is over.
+*/
+  unsigned long kept = latency->count < latency->capacity ? latency->count : latency->capacity;
+  unsigned long index;
+
+  if (kept == 0) {
+    return 0;
+  }
+  qsort(latency->samples, kept, sizeof(uint32_t), compare_samples);
+  index = (unsigned long) (percent / 100.0 * (kept - 1) + 0.5);
+  return latency->samples[index];
+}
+
+
+void latency_print(struct latency *latency, const char *name, FILE *out) {
+// One line: count, min, percentiles, max - all in microseconds
+  if (latency->count == 0) {
+    fprintf(out, "%s: no samples\n", name);
+    return;
+  }
+  fprintf(out, "%s: %lu samples, us: min %.1f mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f p99.99 %.1f max %.1f\n",
+          name, latency->count,
+          latency->min / 1e3,
+          (double) latency->sum / latency->count / 1e3,
+          latency_percentile(latency, 50) / 1e3,
+          latency_percentile(latency, 90) / 1e3,
+          latency_percentile(latency, 99) / 1e3,
+          latency_percentile(latency, 99.9) / 1e3,
+          latency_percentile(latency, 99.99) / 1e3,
+          latency->max / 1e3);
+}
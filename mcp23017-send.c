@@ -0,0 +1,131 @@
+/*
+  mcp23017-send - a client of the output daemon (mcp23017d.c).
+
+  mcp23017-send byte0 byte1 byte2 byte3   - set the outputs of the first
+                                            two chips, like send_codes()
+  mcp23017-send off                        - all outputs off
+  mcp23017-send stats                      - what the daemon has done so far
+  mcp23017-send bench [words]              - send words as fast as the daemon
+                                             takes them, and see how it copes
+
+  No bus is opened and no chip initialized here - that's the daemon's job,
+  so this starts and finishes in a fraction of a millisecond.
+
+  gcc mcp23017-send.c -o mcp23017-send
+*/
+
+#include <time.h>
+#include <sched.h>
+
+#include "./daemon.c"
+#include "./latency.c"
+
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void set_bytes(struct daemon_command *command, const uint8_t *bytes) {
+// Bytes 0...3 go to chip 0 GPIOA, GPIOB, chip 1 GPIOA, GPIOB - nothing else changes
+  memset(command, 0, sizeof(*command));
+  memset(command->mask, 0xff, 4);
+  memcpy(command->value, bytes, 4);
+}
+
+
+int bench(struct daemon_client *client, int words) {
+/*
+  Submit words as fast as the ring takes them; every 64th one, wait
+  until it's on the bus, to see how long submit-to-output takes.
+  The daemon's stats show how many commands went into each update.
+*/
+  struct daemon_command command;
+  struct latency flush_latency;
+  char reply[DAEMON_MESSAGE];
+  uint8_t bytes[4];
+  uint64_t start, elapsed, begin;
+  int i;
+
+  latency_init(&flush_latency, words / 64 + 1);
+  start = now_ns();
+  for (i = 0; i < words; i++) {
+    bytes[0] = i;
+    bytes[1] = i >> 8;
+    bytes[2] = ~i;
+    bytes[3] = 0x55;
+    set_bytes(&command, bytes);
+    begin = now_ns();
+    while (!daemon_submit(client, &command)) {
+      sched_yield();
+    }
+    if (i % 64 == 63) {
+      if (daemon_flush(client) < 0) {
+        perror("mcp23017d");
+        return 1;
+      }
+      latency_add(&flush_latency, now_ns() - begin);
+    }
+  }
+  if (daemon_flush(client) < 0) {
+    perror("mcp23017d");
+    return 1;
+  }
+  elapsed = now_ns() - start;
+
+  printf("%d words in %.3f s: %.0f words/s, ring full %lu times\n",
+         words, elapsed / 1e9, words * 1e9 / elapsed, client->slot->full);
+  latency_print(&flush_latency, "submit to written", stdout);
+  if (daemon_request(client, "stats", reply, sizeof(reply)) > 0) {
+    printf("%s", reply);
+  }
+  return 0;
+}
+
+
+int main(int argc, char **argv) {
+  struct daemon_client client;
+  struct daemon_command command;
+  char reply[DAEMON_MESSAGE];
+  uint8_t bytes[4];
+  int i;
+
+  if (argc != 2 && argc != 3 && argc != 5) {
+    fprintf(stderr, "usage: %s byte0 byte1 byte2 byte3 | off | stats | bench [words]\n", argv[0]);
+    return 1;
+  }
+  if (daemon_connect(&client) < 0) {
+    perror("can't reach mcp23017d");
+    return 1;
+  }
+
+  if (strcmp(argv[1], "bench") == 0) {
+    return bench(&client, argc > 2 ? atoi(argv[2]) : 100000);
+  }
+  if (strcmp(argv[1], "off") == 0 || strcmp(argv[1], "stats") == 0) {
+    if (daemon_request(&client, argv[1], reply, sizeof(reply)) < 0) {
+      perror("mcp23017d");
+      return 1;
+    }
+    printf("%s\n", reply);
+    return strncmp(reply, "error", 5) == 0;
+  }
+  if (argc != 5) {
+    fprintf(stderr, "four bytes, please\n");
+    return 1;
+  }
+
+  for (i = 0; i < 4; i++) {
+    bytes[i] = strtol(argv[i + 1], NULL, 0);
+  }
+  set_bytes(&command, bytes);
+  daemon_submit(&client, &command);
+  if (daemon_flush(&client) < 0) {
+    perror("mcp23017d");
+    return 1;
+  }
+  daemon_disconnect(&client);
+  return 0;
+}
@@ -0,0 +1,219 @@
+/*
+  A simulated MCP23017 - the chip's register file, living in memory.
+
+  bus.c uses it for the "sim" bus backend, so that the demos, the interface
+  and the benchmarks can run on any Linux box, without a Raspberry Pi
+  or any chips attached.
+
+  What's modelled (IOCON.BANK = 0 and BANK = 1 register maps):
+
+  IODIR, IPOL, GPPU - plain read/write registers
+  GPIO              - reading returns the pins: output latches for outputs,
+                      the simulated input levels (through IPOL) for inputs;
+                      writing sets OLAT
+  OLAT              - output latches
+  IOCON             - BANK (register map), MIRROR (INTA/INTB tied together),
+                      SEQOP (address pointer increments or not)
+  GPINTEN, DEFVAL,  - interrupt-on-change: compare against the previous pin
+  INTCON              state or DEFVAL
+  INTF, INTCAP      - which pin caused the interrupt, pin state captured then;
+                      reading INTCAP or GPIO clears the port's interrupt
+
+  Register numbers below are the BANK = 0 addresses; the chip stores
+  each register as a pair, [0] for port A and [1] for port B.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#define SIM_IODIR 0
+#define SIM_IPOL 1
+#define SIM_GPINTEN 2
+#define SIM_DEFVAL 3
+#define SIM_INTCON 4
+#define SIM_IOCON 5
+#define SIM_GPPU 6
+#define SIM_INTF 7
+#define SIM_INTCAP 8
+#define SIM_GPIO 9
+#define SIM_OLAT 10
+#define SIM_REGISTERS 11
+
+// IOCON bits:
+#define IOCON_BANK 0x80
+#define IOCON_MIRROR 0x40
+#define IOCON_SEQOP 0x20
+
+struct mcp23017_model {
+  uint8_t reg[SIM_REGISTERS][2];   // register file, [register][port]
+  uint8_t pins[2];                 // levels driven on the input pins from outside
+  uint8_t pointer;                 // address pointer, as sent by the master
+  uint64_t changed_ns[2];          // when each port's outputs last changed
+  unsigned long writes;            // register writes received
+};
+
+
+void sim_reset(struct mcp23017_model *chip) {
+// Power-on reset: all pins are inputs, everything else is zero.
+  memset(chip, 0, sizeof(*chip));
+  chip->reg[SIM_IODIR][0] = 0xff;
+  chip->reg[SIM_IODIR][1] = 0xff;
+}
+
+
+int sim_decode(struct mcp23017_model *chip, uint8_t address, int *port) {
+/*
+  Translate a register address into register and port numbers,
+  according to IOCON.BANK. Returns -1 for unimplemented addresses.
+*/
+  if (chip->reg[SIM_IOCON][0] & IOCON_BANK) {
+    if ((address & 0x0f) >= SIM_REGISTERS || address > 0x1a) {
+      return -1;
+    }
+    *port = address >> 4;
+    return address & 0x0f;
+  }
+  if (address >= 2 * SIM_REGISTERS) {
+    return -1;
+  }
+  *port = address & 1;
+  return address >> 1;
+}
+
+
+void sim_advance(struct mcp23017_model *chip) {
+/*
+  Move the address pointer after a byte has been read or written.
+  SEQOP = 0: go to the next register (wrapping around at the end of the map).
+  SEQOP = 1: with BANK = 0, toggle between the A and B registers of a pair;
+             with BANK = 1, stay on the same register.
+*/
+  int bank = chip->reg[SIM_IOCON][0] & IOCON_BANK;
+
+  if (chip->reg[SIM_IOCON][0] & IOCON_SEQOP) {
+    if (!bank) {
+      chip->pointer ^= 1;
+    }
+    return;
+  }
+  chip->pointer++;
+  if (bank) {
+    if ((chip->pointer & 0x0f) >= SIM_REGISTERS) {
+      chip->pointer = (chip->pointer & 0x10) ? 0x00 : 0x10;
+    }
+  }
+  else if (chip->pointer >= 2 * SIM_REGISTERS) {
+    chip->pointer = 0;
+  }
+}
+
+
+uint8_t sim_gpio(struct mcp23017_model *chip, int port) {
+// What reading GPIO returns: inputs (inverted where IPOL says so), outputs from OLAT
+  uint8_t inputs = chip->reg[SIM_IODIR][port];
+  return ((chip->pins[port] ^ chip->reg[SIM_IPOL][port]) & inputs)
+         | (chip->reg[SIM_OLAT][port] & ~inputs);
+}
+
+
+void sim_check_interrupts(struct mcp23017_model *chip, int port, uint8_t previous) {
+/*
+  Interrupt-on-change: for every enabled input pin, compare with DEFVAL
+  (INTCON bit set) or with its previous state (INTCON bit clear).
+  Like the real chip, INTCAP is only captured when no interrupt is pending.
+*/
+  uint8_t inputs, enabled, reference, fired;
+
+  inputs = chip->reg[SIM_IODIR][port];
+  enabled = chip->reg[SIM_GPINTEN][port] & inputs;
+  reference = (chip->reg[SIM_DEFVAL][port] & chip->reg[SIM_INTCON][port])
+              | (previous & ~chip->reg[SIM_INTCON][port]);
+  fired = (sim_gpio(chip, port) ^ reference) & enabled;
+
+  if (fired && !chip->reg[SIM_INTF][port]) {
+    chip->reg[SIM_INTF][port] = fired;
+    chip->reg[SIM_INTCAP][port] = sim_gpio(chip, port);
+  }
+}
+
+
+void sim_set_pins(struct mcp23017_model *chip, int port, uint8_t levels) {
+// Drive the input pins of a port from outside (the "machine" side):
+  uint8_t previous = sim_gpio(chip, port);
+  chip->pins[port] = levels;
+  sim_check_interrupts(chip, port, previous);
+}
+
+
+int sim_interrupt(struct mcp23017_model *chip, int port) {
+// State of the INTA (port 0) or INTB (port 1) output, active high:
+  if (chip->reg[SIM_IOCON][0] & IOCON_MIRROR) {
+    return chip->reg[SIM_INTF][0] || chip->reg[SIM_INTF][1];
+  }
+  return chip->reg[SIM_INTF][port] != 0;
+}
+
+
+void sim_write_byte(struct mcp23017_model *chip, uint8_t value, uint64_t when_ns) {
+// The master wrote a data byte at the address pointer:
+  int port, reg;
+  uint8_t previous;
+
+  reg = sim_decode(chip, chip->pointer, &port);
+  chip->writes++;
+
+  switch (reg) {
+  case SIM_IOCON:
+// One register seen at two addresses:
+    chip->reg[SIM_IOCON][0] = value;
+    chip->reg[SIM_IOCON][1] = value;
+    break;
+  case SIM_GPIO:
+  case SIM_OLAT:
+    previous = chip->reg[SIM_OLAT][port];
+    chip->reg[SIM_OLAT][port] = value;
+    if ((previous ^ value) & ~chip->reg[SIM_IODIR][port]) {
+      chip->changed_ns[port] = when_ns;
+    }
+    break;
+  case SIM_INTF:
+  case SIM_INTCAP:
+  case -1:
+// Read-only or unimplemented - the chip ignores the write
+    break;
+  default:
+    chip->reg[reg][port] = value;
+    break;
+  }
+  sim_advance(chip);
+}
+
+
+uint8_t sim_read_byte(struct mcp23017_model *chip) {
+// The master reads a byte from the address pointer:
+  int port, reg;
+  uint8_t value;
+
+  reg = sim_decode(chip, chip->pointer, &port);
+
+  switch (reg) {
+  case -1:
+    value = 0;
+    break;
+  case SIM_GPIO:
+    value = sim_gpio(chip, port);
+    chip->reg[SIM_INTF][port] = 0;
+    sim_check_interrupts(chip, port, value);
+    break;
+  case SIM_INTCAP:
+    value = chip->reg[SIM_INTCAP][port];
+    chip->reg[SIM_INTF][port] = 0;
+    sim_check_interrupts(chip, port, sim_gpio(chip, port));
+    break;
+  default:
+    value = chip->reg[reg][port];
+    break;
+  }
+  sim_advance(chip);
+  return value;
+}
@@ -0,0 +1,354 @@
+/*
+  mcp23017d - the output daemon: owns the buses and chips, and writes
+  what its clients send it (see daemon.c for how they talk to it).
+
+  It sets the chips up once, like any other program here (the buses and
+  chips come from MCP23017_DEVICES or MCP23017_BUS, MCP23017_REALTIME
+  works too), then:
+
+  - the output thread sleeps on the shared-memory doorbell, and when
+    it rings, applies every command waiting in the clients' rings
+    and writes the result in one update,
+  - the main thread answers control requests on the Unix socket.
+
+  gcc mcp23017d.c -o mcp23017d -lpthread
+  sudo ./mcp23017d
+
+  and then, for example (see mcp23017-send.c):
+
+  ./mcp23017-send 0x11 0x22 0x33 0x44
+  ./mcp23017-send stats
+
+  Stop it with Ctrl-C or SIGTERM - it turns the outputs off on the way out.
+  With MCP23017_WARM=1 (see devices.c), a daemon restarted after a crash
+  picks up the chips as they are, without turning anything off.
+*/
+
+#include "./interface.c"
+#include "./daemon.c"
+
+#define DAEMON_POLL_MS 500
+
+struct daemon_shm *shm;
+struct output_word daemon_word;         // the outputs as they are now
+pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;   // output thread vs control requests
+volatile sig_atomic_t daemon_stopping;
+
+struct daemon_counters {
+  unsigned long updates;                // bus updates made
+  unsigned long commands;               // client commands applied
+  unsigned long most;                   // most commands in one update
+  unsigned long per_client[DAEMON_CLIENTS];
+} counters;
+
+
+void daemon_stop(int signal) {
+// SIGINT, SIGTERM: wake the output thread, it'll see we're stopping
+  daemon_stopping = 1;
+  atomic_fetch_add(&shm->doorbell, 1);
+  shm_futex(&shm->doorbell, FUTEX_WAKE, 1, NULL);
+}
+
+
+int apply_commands(void) {
+/*
+  Take every command waiting in every ring and apply it to the output word.
+  Returns how many there were. Called with bus_lock held.
+*/
+  struct daemon_command command;
+  struct daemon_slot *slot;
+  unsigned long head, tail;
+  int s, c, bank, applied = 0;
+
+  for (s = 0; s < DAEMON_CLIENTS; s++) {
+    slot = &shm->slot[s];
+    if (!atomic_load(&slot->in_use)) {
+      continue;
+    }
+    tail = atomic_load_explicit(&slot->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&slot->head, memory_order_acquire);
+    while (tail != head) {
+      memcpy(&command, &slot->entries[tail & (DAEMON_RING - 1)], sizeof(command));
+      tail++;
+      atomic_store_explicit(&slot->tail, tail, memory_order_release);
+      for (c = 0; c < devices.chips; c++) {
+        for (bank = 0; bank < 2; bank++) {
+          daemon_word.value[c][bank] = (daemon_word.value[c][bank] & ~command.mask[c][bank])
+                                       | (command.value[c][bank] & command.mask[c][bank]);
+        }
+      }
+      counters.per_client[s]++;
+      applied++;
+    }
+  }
+  return applied;
+}
+
+
+void report_done(void) {
+// After an update: tell the clients how far we've got, wake those waiting
+  struct daemon_slot *slot;
+  int s;
+
+  for (s = 0; s < DAEMON_CLIENTS; s++) {
+    slot = &shm->slot[s];
+    if (!atomic_load(&slot->in_use)) {
+      continue;
+    }
+    atomic_store(&slot->done, (unsigned int) atomic_load(&slot->tail));
+    if (atomic_load(&slot->flushing)) {
+      shm_futex(&slot->done, FUTEX_WAKE, 1, NULL);
+    }
+  }
+}
+
+
+void *output_loop(void *nothing) {
+  unsigned int seen;
+  int applied;
+
+  while (!daemon_stopping) {
+    seen = atomic_load(&shm->doorbell);
+
+    pthread_mutex_lock(&bus_lock);
+    applied = apply_commands();
+    if (applied) {
+      set_outputs_word(&daemon_word);
+      counters.updates++;
+      counters.commands += applied;
+      if (applied > counters.most) {
+        counters.most = applied;
+      }
+      report_done();
+    }
+    pthread_mutex_unlock(&bus_lock);
+    if (applied) {
+      continue;
+    }
+
+// Nothing to do - sleep, unless a client has rung the doorbell meanwhile:
+    atomic_store(&shm->waiting, 1);
+    if (atomic_load(&shm->doorbell) == seen) {
+      shm_futex(&shm->doorbell, FUTEX_WAIT, seen, NULL);
+    }
+    atomic_store(&shm->waiting, 0);
+  }
+  return NULL;
+}
+
+
+int open_shm(void) {
+// Create the shared memory the clients map
+  int fd;
+
+  shm_unlink(DAEMON_SHM);               // left over from a crash
+  fd = shm_open(DAEMON_SHM, O_CREAT | O_EXCL | O_RDWR, 0660);
+  if (fd < 0 || ftruncate(fd, sizeof(struct daemon_shm)) < 0) {
+    perror(DAEMON_SHM);
+    return -1;
+  }
+  shm = mmap(NULL, sizeof(struct daemon_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  memset(shm, 0, sizeof(*shm));
+  shm->magic = DAEMON_MAGIC;
+  shm->version = DAEMON_VERSION;
+  shm->chips = devices.chips;
+  return 0;
+}
+
+
+int open_socket(void) {
+  struct sockaddr_un address;
+  int fd;
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", daemon_socket_path());
+  unlink(address.sun_path);
+  if (bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(fd, 8) < 0) {
+    perror(address.sun_path);
+    close(fd);
+    return -1;
+  }
+  chmod(address.sun_path, 0660);
+  return fd;
+}
+
+
+int attach(void) {
+// Give a client a free slot, emptied. Returns the slot number, or -1.
+  int s;
+
+  for (s = 0; s < DAEMON_CLIENTS; s++) {
+    if (!atomic_load(&shm->slot[s].in_use)) {
+      pthread_mutex_lock(&bus_lock);
+      atomic_store(&shm->slot[s].head, 0);
+      atomic_store(&shm->slot[s].tail, 0);
+      atomic_store(&shm->slot[s].done, 0);
+      atomic_store(&shm->slot[s].flushing, 0);
+      shm->slot[s].full = 0;
+      counters.per_client[s] = 0;
+      atomic_store(&shm->slot[s].in_use, 1);
+      pthread_mutex_unlock(&bus_lock);
+      return s;
+    }
+  }
+  return -1;
+}
+
+
+void detach(int s) {
+  pthread_mutex_lock(&bus_lock);
+  atomic_store(&shm->slot[s].in_use, 0);
+  pthread_mutex_unlock(&bus_lock);
+}
+
+
+void handle_request(int fd, int *slot, const char *request) {
+// One control request - answer it on the same socket
+  char reply[DAEMON_MESSAGE];
+  struct bus_stats stats;
+  int length, s;
+
+  if (strcmp(request, "attach") == 0) {
+    if (*slot < 0) {
+      *slot = attach();
+    }
+    if (*slot < 0) {
+      snprintf(reply, sizeof(reply), "error: all %d slots taken", DAEMON_CLIENTS);
+    }
+    else {
+      snprintf(reply, sizeof(reply), "ok %d %s %d", *slot, DAEMON_SHM, devices.chips);
+    }
+  }
+  else if (strcmp(request, "off") == 0) {
+    pthread_mutex_lock(&bus_lock);
+    memset(&daemon_word, 0, sizeof(daemon_word));
+    all_off();
+    pthread_mutex_unlock(&bus_lock);
+    snprintf(reply, sizeof(reply), "ok");
+  }
+  else if (strcmp(request, "stats") == 0) {
+    pthread_mutex_lock(&bus_lock);
+    devices_stats(&stats);
+    length = snprintf(reply, sizeof(reply),
+                      "chips %d buses %d write %s\n"
+                      "commands %lu updates %lu (%.2f commands per update, %lu at most)\n"
+                      "bus: syscalls %lu messages %lu bytes %lu wire_us %.0f errors %lu\n",
+                      devices.chips, devices.buses, devices_write_method(0),
+                      counters.commands, counters.updates,
+                      counters.updates ? (double) counters.commands / counters.updates : 0.0,
+                      counters.most, stats.syscalls, stats.messages, stats.bytes,
+                      stats.wire_ns / 1e3, stats.errors);
+    for (s = 0; s < DAEMON_CLIENTS && length < (int) sizeof(reply) - 80; s++) {
+      if (atomic_load(&shm->slot[s].in_use)) {
+        length += snprintf(reply + length, sizeof(reply) - length,
+                           "client %d: commands %lu ring full %lu\n",
+                           s, counters.per_client[s], shm->slot[s].full);
+      }
+    }
+    pthread_mutex_unlock(&bus_lock);
+  }
+  else {
+    snprintf(reply, sizeof(reply), "error: unknown request \"%s\"", request);
+  }
+  send(fd, reply, strlen(reply), MSG_NOSIGNAL);
+}
+
+
+void control_loop(int listener) {
+// Answer control requests until we're told to stop
+  struct pollfd fds[1 + DAEMON_CLIENTS];
+  int slots[1 + DAEMON_CLIENTS];
+  char request[DAEMON_MESSAGE];
+  int count = 1, i, fd, length;
+
+  fds[0].fd = listener;
+  fds[0].events = POLLIN;
+
+  while (!daemon_stopping) {
+// With every connection taken, leave new ones waiting - a ready listener would only spin poll():
+    fds[0].events = count < 1 + DAEMON_CLIENTS ? POLLIN : 0;
+    if (poll(fds, count, DAEMON_POLL_MS) <= 0) {
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+      if (fd >= 0) {
+        fds[count].fd = fd;
+        fds[count].events = POLLIN;
+        slots[count] = -1;
+        count++;
+      }
+    }
+    for (i = 1; i < count; i++) {
+      if (!fds[i].revents) {
+        continue;
+      }
+      length = recv(fds[i].fd, request, sizeof(request) - 1, 0);
+      if (length > 0) {
+        request[length] = 0;
+        handle_request(fds[i].fd, &slots[i], request);
+        continue;
+      }
+// The client has gone - free its slot, forget the connection:
+      if (slots[i] >= 0) {
+        detach(slots[i]);
+      }
+      close(fds[i].fd);
+      count--;
+      fds[i] = fds[count];
+      slots[i] = slots[count];
+      i--;
+    }
+  }
+}
+
+
+void *control_thread(void *argument) {
+  control_loop(*(int *) argument);
+  return NULL;
+}
+
+
+int main(void) {
+  pthread_t control;
+  int listener;
+
+  realtime_configure();
+  if (mcp_init() < 0 || open_shm() < 0) {
+    return 1;
+  }
+// Attaching warm, the outputs are what the last daemon left - start from there:
+  devices_outputs(&daemon_word);
+  listener = open_socket();
+  if (listener < 0) {
+    shm_unlink(DAEMON_SHM);
+    return 1;
+  }
+  signal(SIGINT, daemon_stop);
+  signal(SIGTERM, daemon_stop);
+  realtime_setup();
+
+  devices_report(stderr);
+  fprintf(stderr, "listening on %s\n", daemon_socket_path());
+
+  pthread_create(&control, NULL, control_thread, &listener);
+  interface_run(output_loop, NULL);
+  pthread_join(control, NULL);
+
+  all_off();
+  close(listener);
+  unlink(daemon_socket_path());
+  shm_unlink(DAEMON_SHM);
+  return 0;
+}
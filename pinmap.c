@@ -0,0 +1,247 @@
+/*
+  Pin maps - from logical signals to chip outputs.
+
+  The casting machine doesn't know about chips and banks: a code is a set
+  of signals (the 31 perforation positions of the ribbon), and which output
+  each one is wired to differs from one installation to another.
+  A pin map says it: signal n goes to chip c, bank A or B, bit b.
+  A code word is then a 32-bit number with bit n set for signal n.
+
+  The map is given as a list of outputs, signal 0 first, separated by commas
+  or spaces: chip number (in device table order, see devices.c), bank letter
+  and bit number - or "-" for a signal that isn't wired:
+
+  MCP23017_PINMAP="0A0,0A1,0A2,0A3,0A4,0A5,0A6,0A7,0B0,..."
+
+  Without a map, signals 0...31 go to chip 0 GPA0...GPB7 and chip 1
+  GPA0...GPB7 in order - exactly the bytes send_codes() takes, so code
+  bytes 0...3 are the code word's bytes 0...3.
+
+  Looking at every signal for every code word would be a loop of 32 tests
+  and branches. Instead, pinmap_compile() turns the map into a short list
+  of steps, once. The output word is taken 8 bytes (4 chips) at a time,
+  as a 64-bit number, and for each such window the cheaper way is used:
+
+  shift - signals whose distance from their output bit is the same move
+          together: one shift and one mask. The default map is one step:
+          the code word itself.
+  table - one 256-entry table per code word byte: the byte indexes a table
+          with its signals already in place, in all 8 bytes of the window.
+          Never more than 4 steps per window, however scrambled the wiring.
+
+  pinmap_translate() then only runs the steps - 1 for the default map,
+  4 for a messy one on up to 4 chips - with no work per signal.
+
+  Include this after devices.c.
+*/
+
+#define PINMAP_SIGNALS 32
+#define PINMAP_UNUSED 0xffff
+#define PINMAP_WINDOWS (MAX_CHIPS / 4)
+#define PINMAP_STEPS PINMAP_SIGNALS     // every step takes at least one signal
+
+// Where output byte n of a window is in the window's 64-bit number:
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define PINMAP_BYTE_SHIFT(n) (8 * (7 - (n)))
+#else
+#define PINMAP_BYTE_SHIFT(n) (8 * (n))
+#endif
+
+struct pinmap_step {
+  const uint64_t *table;        // table step; NULL - a shift step
+  uint64_t mask;                // shift: window bits kept after shifting
+  uint64_t store;               // the window's last step: its bytes the map uses; else 0
+  int8_t shift;                 // shift: code word >> shift (<< -shift if negative)
+  uint8_t byte;                 // table: which code word byte is the index
+  uint8_t window;               // output bytes 8 * window ... 8 * window + 7
+};
+
+struct pin_map {
+  uint16_t output[PINMAP_SIGNALS];      // chip * 16 + bank * 8 + bit, or PINMAP_UNUSED
+  int chips;                            // chips the map uses
+  int steps;
+  struct pinmap_step step[PINMAP_STEPS];
+  int table_count;
+  uint64_t tables[PINMAP_STEPS][256];
+};
+
+
+void pinmap_default(struct pin_map *map) {
+// Signal n goes to output n: chip 0 GPA0...GPB7, then chip 1
+  int signal;
+
+  memset(map, 0, sizeof(*map));
+  for (signal = 0; signal < PINMAP_SIGNALS; signal++) {
+    map->output[signal] = signal;
+  }
+}
+
+
+int pinmap_parse(struct pin_map *map, const char *spec) {
+/*
+  Fill the map from a string like "0A0,0A1,-,1B7" (see above).
+  Signals beyond the list aren't wired. Returns 0, or -1 if it doesn't make sense.
+*/
+  char *end;
+  long chip;
+  int signal = 0, bank, bit;
+
+  memset(map, 0, sizeof(*map));
+  for (signal = 0; signal < PINMAP_SIGNALS; signal++) {
+    map->output[signal] = PINMAP_UNUSED;
+  }
+
+  signal = 0;
+  for (;;) {
+    spec += strspn(spec, " \t\n,");
+    if (*spec == 0) {
+      return 0;
+    }
+    if (signal == PINMAP_SIGNALS) {
+      fprintf(stderr, "pin map: more than %d signals\n", PINMAP_SIGNALS);
+      return -1;
+    }
+    if (*spec == '-') {
+      spec++;
+      signal++;
+      continue;
+    }
+    chip = strtol(spec, &end, 10);
+    bank = end[0] == 'A' || end[0] == 'a' ? 0 : end[0] == 'B' || end[0] == 'b' ? 1 : -1;
+    bit = bank < 0 ? -1 : end[1] - '0';
+    if (end == spec || chip < 0 || chip >= MAX_CHIPS || bit < 0 || bit > 7) {
+      fprintf(stderr, "pin map: signal %d: expected chip, bank and bit, like 0A7\n", signal);
+      return -1;
+    }
+    map->output[signal++] = chip * 16 + bank * 8 + bit;
+    spec = end + 2;
+  }
+}
+
+
+struct pinmap_step *pinmap_add_step(struct pin_map *map, int window) {
+  struct pinmap_step *step = &map->step[map->steps++];
+
+  memset(step, 0, sizeof(*step));
+  step->window = window;
+  return step;
+}
+
+
+void pinmap_compile(struct pin_map *map) {
+/*
+  Turn the map into steps: for every window of the output word the map
+  uses, shift steps (one per distinct signal-to-bit distance) or table
+  steps (one per code word byte with signals for it), whichever are fewer.
+*/
+  uint64_t shift_masks[PINMAP_SIGNALS + 64];    // per distance + 63
+  struct pinmap_step *step = NULL;
+  uint64_t store, *table;
+  int position[PINMAP_SIGNALS];                 // bit in the window, -1 - not in this one
+  int window, signal, output, distance, byte, bytes, shifts, value;
+
+  map->steps = 0;
+  map->table_count = 0;
+  map->chips = 0;
+  for (window = 0; window < PINMAP_WINDOWS; window++) {
+    memset(shift_masks, 0, sizeof(shift_masks));
+    store = 0;
+    bytes = 0;
+    for (signal = 0; signal < PINMAP_SIGNALS; signal++) {
+      output = map->output[signal];
+      position[signal] = -1;
+      if (output == PINMAP_UNUSED || output / 64 != window) {
+        continue;
+      }
+      position[signal] = PINMAP_BYTE_SHIFT(output / 8 % 8) + output % 8;
+      shift_masks[signal - position[signal] + 63] |= 1ull << position[signal];
+      store |= 0xffull << PINMAP_BYTE_SHIFT(output / 8 % 8);
+      bytes |= 1 << (signal / 8);
+      if (output / 16 + 1 > map->chips) {
+        map->chips = output / 16 + 1;
+      }
+    }
+    if (bytes == 0) {
+      continue;
+    }
+
+    shifts = 0;
+    for (distance = 0; distance < PINMAP_SIGNALS + 64; distance++) {
+      shifts += shift_masks[distance] != 0;
+    }
+    if (shifts <= __builtin_popcount(bytes)) {
+      for (distance = 0; distance < PINMAP_SIGNALS + 64; distance++) {
+        if (shift_masks[distance]) {
+          step = pinmap_add_step(map, window);
+          step->shift = distance - 63;
+          step->mask = shift_masks[distance];
+        }
+      }
+    }
+    else {
+      for (byte = 0; byte < 4; byte++) {
+        if (!(bytes & (1 << byte))) {
+          continue;
+        }
+        table = map->tables[map->table_count++];
+        for (value = 0; value < 256; value++) {
+          table[value] = 0;
+          for (signal = byte * 8; signal < byte * 8 + 8; signal++) {
+            if ((value & (1 << signal % 8)) && position[signal] >= 0) {
+              table[value] |= 1ull << position[signal];
+            }
+          }
+        }
+        step = pinmap_add_step(map, window);
+        step->table = table;
+        step->byte = byte;
+      }
+    }
+    step->store = store;
+  }
+}
+
+
+static inline void pinmap_translate(const struct pin_map *map, uint32_t code, struct output_word *word) {
+/*
+  A code word to register values. Only the registers the map uses are set
+  (in full - an output no signal is wired to is off); the rest of the word
+  is left as it is, so keep it zeroed.
+*/
+  uint8_t *out = (uint8_t *) word;
+  const struct pinmap_step *step, *last = map->step + map->steps;
+  uint64_t bits = 0, window;
+
+  for (step = map->step; step < last; step++) {
+    if (step->table) {
+      bits |= step->table[(code >> (8 * step->byte)) & 0xff];
+    }
+    else {
+      bits |= (step->shift >= 0 ? (uint64_t) code >> step->shift : (uint64_t) code << -step->shift)
+              & step->mask;
+    }
+    if (step->store) {
+      memcpy(&window, out + 8 * step->window, 8);
+      window = (window & ~step->store) | bits;
+      memcpy(out + 8 * step->window, &window, 8);
+      bits = 0;
+    }
+  }
+}
+
+
+int pinmap_configure(struct pin_map *map) {
+// The map from MCP23017_PINMAP, or the default one, compiled. Returns 0 or -1.
+  const char *spec = getenv("MCP23017_PINMAP");
+
+  if (spec != NULL && *spec) {
+    if (pinmap_parse(map, spec) < 0) {
+      return -1;
+    }
+  }
+  else {
+    pinmap_default(map);
+  }
+  pinmap_compile(map);
+  return 0;
+}
@@ -0,0 +1,266 @@
+/*
+  The recorder - every edge and every register write, to a file.
+
+  A timing problem on the machine can't be looked into at the bench
+  unless we know exactly what happened: when the edges came, and what
+  was written to which chip, and when. With MCP23017_RECORD=file, the
+  programs keep a record of it:
+
+  edge   - the time the kernel stamped the edge, and its direction
+  write  - chip address, register and value, and the time the transfer
+           that carried it was done (one record per register - a 3-byte
+           burst is two of them)
+
+  and replay.c can play the edges back to the simulated chips, at the
+  original speed or faster, and tell how what gets written then (and how
+  quickly) differs from the recording.
+
+  The file is a 32-byte header and 16-byte records, mapped into memory
+  whole: recording is a clock read, an atomic add to claim a slot (and
+  two more to tell record_close() it's being written) and a 16-byte
+  store - no syscalls, no locks, from any thread. The file is made as
+  big as MCP23017_RECORD_MB says (64 MB - 4 million records - by
+  default) but sparse, so it only takes the disk space that's been
+  written; it's cut down to size by record_close(), or when the program
+  exits. Threads may still be recording then - record_close() turns
+  recording off and waits for the records being written to be done
+  before it touches the file. If the program dies first, the records are
+  still there (the page cache has them) - the reader stops at the first
+  empty one. When the file is full, recording stops. In real-time mode,
+  the whole mapping is locked in memory with everything else - keep
+  MCP23017_RECORD_MB down to what a job needs.
+
+  Include this before anything that records - bus.c does.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RECORD_MAGIC 0x5243504d         // "MPCR"
+#define RECORD_VERSION 1
+#define RECORD_DEFAULT_MB 64
+
+// Record types - 0 is an empty slot, the end of the recording:
+#define RECORD_EDGE 1                   // value: 1 - rising, 0 - falling
+#define RECORD_WRITE 2                  // address, reg, value
+
+struct record_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t records;                     // written at the end; 0 - look for the first empty slot
+  uint64_t start_ns;                    // CLOCK_MONOTONIC when recording started
+  uint64_t reserved;
+};
+
+struct record {
+  uint64_t ns;
+  uint8_t type;
+  uint8_t address;
+  uint8_t reg;
+  uint8_t value;
+  uint32_t reserved;
+};
+
+struct recorder {
+  atomic_int enabled;
+  atomic_int writing;                   // record_at() calls in progress
+  int fd;
+  struct record_header *header;
+  struct record *records;
+  uint64_t capacity;
+  atomic_ulong count;
+  size_t size;                          // of the mapping
+} recorder;
+
+
+static inline void record_at(uint64_t ns, int type, int address, int reg, int value) {
+// Add a record, if we're recording and there's room
+  struct record *slot;
+  unsigned long index;
+
+  if (!atomic_load_explicit(&recorder.enabled, memory_order_relaxed)) {
+    return;
+  }
+// Say we're writing, then look again - record_close() does it the other way round:
+  atomic_fetch_add(&recorder.writing, 1);
+  if (!atomic_load(&recorder.enabled)) {
+    atomic_fetch_sub(&recorder.writing, 1);
+    return;
+  }
+  index = atomic_fetch_add_explicit(&recorder.count, 1, memory_order_relaxed);
+  if (index >= recorder.capacity) {
+    atomic_store(&recorder.enabled, 0);
+    atomic_store(&recorder.count, recorder.capacity);
+    atomic_fetch_sub(&recorder.writing, 1);
+    return;
+  }
+  slot = &recorder.records[index];
+  slot->ns = ns;
+  slot->address = address;
+  slot->reg = reg;
+  slot->value = value;
+  slot->reserved = 0;
+  atomic_store_explicit((_Atomic uint8_t *) &slot->type, type, memory_order_release);
+  atomic_fetch_sub_explicit(&recorder.writing, 1, memory_order_release);
+}
+
+
+static inline void record_edge(uint64_t ns, int rising) {
+  record_at(ns, RECORD_EDGE, 0, 0, rising);
+}
+
+
+static inline void record_message(int address, const uint8_t *data, int length) {
+/*
+  A write message that went through: register data[0] got data[1],
+  the next one data[2] (the chip's address pointer moves on by itself).
+*/
+  struct timespec ts;
+  uint64_t ns;
+  int i;
+
+  if (!atomic_load_explicit(&recorder.enabled, memory_order_relaxed) || length < 2) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  for (i = 1; i < length; i++) {
+    record_at(ns, RECORD_WRITE, address, data[0] + i - 1, data[i]);
+  }
+}
+
+
+void record_close(void) {
+/*
+  Stop recording and cut the file down to what's been recorded. Other
+  threads may go on running - they just don't record any more.
+*/
+  uint64_t count;
+
+  if (recorder.header == NULL) {
+    return;
+  }
+  atomic_store(&recorder.enabled, 0);
+  while (atomic_load_explicit(&recorder.writing, memory_order_acquire)) {
+    sched_yield();
+  }
+  count = atomic_load(&recorder.count);
+  if (count > recorder.capacity) {
+    count = recorder.capacity;
+  }
+  recorder.header->records = count;
+  munmap(recorder.header, recorder.size);
+  if (ftruncate(recorder.fd, sizeof(struct record_header) + count * sizeof(struct record)) < 0) {
+    perror("recording");
+  }
+  close(recorder.fd);
+  recorder.header = NULL;
+}
+
+
+int record_open(const char *name, unsigned long megabytes) {
+// Start recording to a file (replaced if it's there). Returns 0, or -1.
+  struct timespec ts;
+  int error;
+
+  recorder.capacity = (uint64_t) megabytes * 1024 * 1024 / sizeof(struct record);
+  recorder.size = sizeof(struct record_header) + recorder.capacity * sizeof(struct record);
+  recorder.fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (recorder.fd < 0) {
+    return -1;
+  }
+  if (ftruncate(recorder.fd, recorder.size) < 0) {
+    error = errno;
+    close(recorder.fd);
+    errno = error;
+    return -1;
+  }
+  recorder.header = mmap(NULL, recorder.size, PROT_READ | PROT_WRITE, MAP_SHARED, recorder.fd, 0);
+  if (recorder.header == MAP_FAILED) {
+    error = errno;
+    close(recorder.fd);
+    recorder.header = NULL;
+    errno = error;
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  recorder.header->magic = RECORD_MAGIC;
+  recorder.header->version = RECORD_VERSION;
+  recorder.header->start_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  recorder.records = (struct record *) (recorder.header + 1);
+  atomic_store(&recorder.count, 0);
+  atomic_store(&recorder.enabled, 1);
+  return 0;
+}
+
+
+void record_configure(void) {
+// MCP23017_RECORD=file: record from now until exit (MCP23017_RECORD_MB - how much at most)
+  const char *name = getenv("MCP23017_RECORD");
+  const char *size = getenv("MCP23017_RECORD_MB");
+  unsigned long megabytes = size != NULL && atol(size) > 0 ? atol(size) : RECORD_DEFAULT_MB;
+
+  if (name == NULL || *name == 0 || recorder.header != NULL) {
+    return;
+  }
+  if (record_open(name, megabytes) < 0) {
+    perror(name);
+    return;
+  }
+  atexit(record_close);
+}
+
+
+const struct record *record_load(const char *name, uint64_t *count, size_t *size) {
+/*
+  Map a recording for reading. Returns its records and how many there are,
+  or NULL. Unmap it with munmap(records - header, size) - or just exit.
+*/
+  const struct record_header *header;
+  const struct record *records;
+  struct stat status;
+  uint64_t slots, i;
+  int fd;
+
+  fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &status) < 0 || status.st_size < (off_t) sizeof(*header)) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  *size = status.st_size;
+  header = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) {
+    return NULL;
+  }
+  if (header->magic != RECORD_MAGIC || header->version != RECORD_VERSION) {
+    munmap((void *) header, *size);
+    errno = EINVAL;
+    return NULL;
+  }
+  records = (const struct record *) (header + 1);
+  slots = (*size - sizeof(*header)) / sizeof(struct record);
+  if (header->records && header->records <= slots) {
+    *count = header->records;
+    return records;
+  }
+// Not closed properly - the records go on until the first empty slot:
+  for (i = 0; i < slots && records[i].type != 0; i++) {
+  }
+  *count = i;
+  return records;
+}
@@ -0,0 +1,361 @@
+/*
+  Replay - play a recording (see record.c) back to simulated chips,
+  and tell how what comes out differs from what was recorded.
+
+  A recording made on the machine has the edge train - when the input
+  went on and off - and every register write. From the writes we know
+  which word each cycle sent: the GPIOA/GPIOB values the chips had when
+  the input turned off. The replay feeds the same edges, at the same
+  intervals (or speed times faster), to the sim edge source, submits
+  the same words ahead (submit_word(), see interface.c) and records the
+  writes that come out. Then the two recordings are compared cycle by
+  cycle:
+
+  - cycles whose writes (chip, register, value, in order) aren't the same,
+    the first few of them printed in full
+  - edge to last on-phase write, for the recording and for the replay
+
+  A program change that alters what gets written, or a bus that's too
+  slow for the cycle, shows up as differing cycles; a change that only
+  makes things slower shows up in the latencies.
+
+  gcc replay.c -o replay -lpthread
+  MCP23017_RECORD=job.rec job-player codes.job
+  ./replay job.rec [speed] [bus_spec] [output]
+
+  speed: 1 - as recorded (the default), 10 - ten times faster
+  bus_spec: what the chips are on (see bus.c) - sim:400k by default;
+  the recorded chip addresses are put on it (so a recording made with
+  several buses can't be replayed if their addresses overlap)
+  output: where the replay's own recording goes - replay.rec by default
+*/
+
+#include "./interface.c"
+
+#define REPLAY_LEAD_NS 100000000        // before the first edge: let the output thread start
+#define REPLAY_SHOWN 5                  // differing cycles printed in full
+#define REPLAY_QUEUE 1024
+
+struct recording {
+  const char *name;
+  const struct record *records;
+  uint64_t count;
+  size_t size;
+};
+
+// Walking a recording, one cycle (rising edge to the next rising edge) at a time:
+struct cycle {
+  uint64_t first, end;                  // its records, first to end - 1
+  uint64_t rising_ns;                   // 0 - cycle 0, the writes before the first edge
+  uint64_t last_on_ns;                  // the last write before the input turned off, or 0
+  unsigned long writes;
+};
+
+struct cycle_cursor {
+  uint64_t next;
+  int started;
+};
+
+// Reconstructing the words, as the writes go by:
+struct word_cursor {
+  uint64_t next;
+  uint8_t gpio[128][2];                 // GPIOA, GPIOB of every address
+};
+
+int addresses[MAX_CHIPS_PER_BUS];
+int chips;
+double speed = 1;
+
+
+int recording_open(struct recording *recording, const char *name) {
+  recording->name = name;
+  recording->records = record_load(name, &recording->count, &recording->size);
+  if (recording->records == NULL) {
+    perror(name);
+    return -1;
+  }
+  return 0;
+}
+
+
+int recorded_chips(const struct recording *recording) {
+// The chip addresses written to, lowest first. Returns how many, or -1 if more than a bus takes.
+  int seen[128] = { 0 };
+  uint64_t i;
+  int a;
+
+  for (i = 0; i < recording->count; i++) {
+    if (recording->records[i].type == RECORD_WRITE) {
+      seen[recording->records[i].address & 0x7f] = 1;
+    }
+  }
+  chips = 0;
+  for (a = 0; a < 128; a++) {
+    if (seen[a]) {
+      if (chips == MAX_CHIPS_PER_BUS) {
+        return -1;
+      }
+      addresses[chips++] = a;
+    }
+  }
+  return chips;
+}
+
+
+int next_word(const struct recording *recording, struct word_cursor *cursor, struct output_word *word) {
+/*
+  The word of the next cycle: what GPIOA, GPIOB of every chip held when
+  the input turned off. Returns 1, or 0 at the end of the recording.
+*/
+  const struct record *record;
+  int c;
+
+  for (; cursor->next < recording->count; cursor->next++) {
+    record = &recording->records[cursor->next];
+    if (record->type == RECORD_WRITE && (record->reg == GPIOA || record->reg == GPIOB)) {
+      cursor->gpio[record->address & 0x7f][record->reg - GPIOA] = record->value;
+    }
+    else if (record->type == RECORD_EDGE && !record->value) {
+      for (c = 0; c < chips; c++) {
+        word->value[c][0] = cursor->gpio[addresses[c]][0];
+        word->value[c][1] = cursor->gpio[addresses[c]][1];
+      }
+      cursor->next++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+void replay_edges(const struct recording *recording) {
+/*
+  Inject the recorded edges at the recorded intervals (divided by speed),
+  on absolute deadlines, keeping the submit queue topped up with words
+  in between - never waiting for room, so that a replay that falls behind
+  shows up as differing cycles, not as a replay that slows down to match.
+*/
+  static struct output_word word;
+  struct word_cursor cursor;
+  const struct record *record;
+  struct timespec deadline;
+  uint64_t i, first_ns = 0, start_ns, at;
+  int have_word;
+
+  memset(&cursor, 0, sizeof(cursor));
+  have_word = next_word(recording, &cursor, &word);
+  start_ns = monotonic_ns() + REPLAY_LEAD_NS;
+  for (i = 0; i < recording->count; i++) {
+    record = &recording->records[i];
+    if (record->type != RECORD_EDGE) {
+      continue;
+    }
+    while (have_word && submit_has_room()) {
+      submit_word(&word);
+      have_word = next_word(recording, &cursor, &word);
+    }
+
+    if (first_ns == 0) {
+      first_ns = record->ns;
+    }
+    at = start_ns + (uint64_t) ((record->ns - first_ns) / speed);
+    deadline.tv_sec = at / 1000000000;
+    deadline.tv_nsec = at % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+    if (edge_inject(&edge, record->value) < 0) {
+      perror("edge_inject");
+    }
+  }
+}
+
+
+int next_cycle(const struct recording *recording, struct cycle_cursor *cursor, struct cycle *cycle) {
+/*
+  The next cycle of a recording: cycle 0 is everything before the first
+  rising edge (setting the chips up), then each rising edge starts one.
+  Returns 1, or 0 at the end.
+*/
+  const struct record *record;
+  uint64_t i = cursor->next;
+  int on = 0;
+
+  if (cursor->started && i >= recording->count) {
+    return 0;
+  }
+  memset(cycle, 0, sizeof(*cycle));
+  cycle->first = i;
+  for (; i < recording->count; i++) {
+    record = &recording->records[i];
+    if (record->type == RECORD_EDGE) {
+      if (record->value && (i > cycle->first || !cursor->started)) {
+        break;                          // the next cycle's edge
+      }
+      if (record->value) {
+        cycle->rising_ns = record->ns;
+      }
+      on = record->value;
+    }
+    else {
+      cycle->writes++;
+      if (on) {
+        cycle->last_on_ns = record->ns;
+      }
+    }
+  }
+  cycle->end = cursor->next = i;
+  cursor->started = 1;
+  return 1;
+}
+
+
+int same_writes(const struct recording *a, const struct cycle *x,
+                const struct recording *b, const struct cycle *y) {
+  uint64_t i = x->first, j = y->first;
+
+  if (x->writes != y->writes) {
+    return 0;
+  }
+  for (;;) {
+    while (i < x->end && a->records[i].type != RECORD_WRITE) {
+      i++;
+    }
+    while (j < y->end && b->records[j].type != RECORD_WRITE) {
+      j++;
+    }
+    if (i == x->end || j == y->end) {
+      return i == x->end && j == y->end;
+    }
+    if (a->records[i].address != b->records[j].address || a->records[i].reg != b->records[j].reg
+        || a->records[i].value != b->records[j].value) {
+      return 0;
+    }
+    i++;
+    j++;
+  }
+}
+
+
+void print_writes(const char *name, const struct recording *recording, const struct cycle *cycle) {
+  const struct record *record;
+  uint64_t i;
+
+  printf("  %-9s", name);
+  for (i = cycle->first; i < cycle->end; i++) {
+    record = &recording->records[i];
+    if (record->type == RECORD_EDGE) {
+      printf(" %s", record->value ? "ON" : "OFF");
+    }
+    else {
+      printf(" %02x:%02x=%02x", record->address, record->reg, record->value);
+    }
+  }
+  printf("\n");
+}
+
+
+int compare(const struct recording *recorded, const struct recording *replayed) {
+// Cycle by cycle: the writes, and how long after the edge the word was out. Returns the differing cycles.
+  struct latency recorded_latency, replayed_latency;
+  struct cycle_cursor i = { 0, 0 }, j = { 0, 0 };
+  struct cycle x, y;
+  unsigned long n, cycles[2] = { 0, 0 }, differing = 0;
+  int more_x, more_y;
+
+  latency_init(&recorded_latency, 1 << 20);
+  latency_init(&replayed_latency, 1 << 20);
+  for (n = 0;; n++) {
+    more_x = next_cycle(recorded, &i, &x);
+    more_y = next_cycle(replayed, &j, &y);
+    if (!more_x && !more_y) {
+      break;
+    }
+    cycles[0] += more_x;
+    cycles[1] += more_y;
+    if (more_x && x.rising_ns && x.last_on_ns) {
+      latency_add(&recorded_latency, x.last_on_ns - x.rising_ns);
+    }
+    if (more_y && y.rising_ns && y.last_on_ns) {
+      latency_add(&replayed_latency, y.last_on_ns - y.rising_ns);
+    }
+    if (more_x && more_y && same_writes(recorded, &x, replayed, &y)) {
+      continue;
+    }
+    if (++differing <= REPLAY_SHOWN) {
+      printf("cycle %lu differs:\n", n);
+      if (more_x) {
+        print_writes("recorded", recorded, &x);
+      }
+      if (more_y) {
+        print_writes("replayed", replayed, &y);
+      }
+    }
+  }
+
+  printf("cycles: %lu recorded, %lu replayed (cycle 0 - before the first edge), %lu differ\n",
+         cycles[0], cycles[1], differing);
+  latency_print(&recorded_latency, "recorded edge to last write", stdout);
+  latency_print(&replayed_latency, "replayed edge to last write", stdout);
+  return differing;
+}
+
+
+int main(int argc, char **argv) {
+  struct recording recorded, replayed;
+  const char *bus_spec = argc > 3 ? argv[3] : "sim:400k";
+  const char *output = argc > 4 ? argv[4] : "replay.rec";
+  char devices_spec[256];
+  int c, length, waited;
+
+  if (argc > 2) {
+    speed = atof(argv[2]);
+  }
+  if (argc < 2 || speed <= 0) {
+    fprintf(stderr, "usage: %s recording [speed] [bus_spec] [output]\n", argv[0]);
+    return 1;
+  }
+  if (strcmp(argv[1], output) == 0) {
+    fprintf(stderr, "%s: the replay would record over it - give another output\n", output);
+    return 1;
+  }
+  if (recording_open(&recorded, argv[1]) < 0) {
+    return 1;
+  }
+  if (recorded_chips(&recorded) < 1) {
+    fprintf(stderr, "%s: %s\n", argv[1], chips ? "more chips than one bus takes" : "no writes recorded");
+    return 1;
+  }
+
+// The recorded chips on the bus, the sim edge source, and our own recording:
+  length = snprintf(devices_spec, sizeof(devices_spec), "%s@", bus_spec);
+  for (c = 0; c < chips; c++) {
+    length += snprintf(devices_spec + length, sizeof(devices_spec) - length, "%s0x%02x",
+                       c ? "," : "", addresses[c]);
+  }
+  setenv("MCP23017_DEVICES", devices_spec, 1);
+  setenv("MCP23017_EDGE", "sim", 1);
+  setenv("MCP23017_RECORD", output, 1);
+// The recorded edges have been debounced already - and a late wakeup here could look like a bounce:
+  edge.debounce_ns = 0;
+  interface_setup();
+
+  printf("%s: %lu records, %d chips, replayed at %gx to %s (%s)\n",
+         argv[1], (unsigned long) recorded.count, chips, speed, devices_spec, output);
+  if (submit_start(REPLAY_QUEUE) < 0) {
+    perror("submit_start");
+    return 1;
+  }
+  replay_edges(&recorded);
+
+// Give the cycles still queued time to finish (a second at most), then compare:
+  for (waited = 0; waited < 1000 && !submit_all_done(); waited++) {
+    usleep(1000);
+  }
+  submit_stop();
+  submit_report(stdout);
+  record_close();
+  if (recording_open(&replayed, output) < 0) {
+    return 1;
+  }
+  return compare(&recorded, &replayed) > 0 ? 2 : 0;
+}
@@ -0,0 +1,78 @@
+/*
+  A lock-free single-producer, single-consumer ring buffer.
+
+  One thread pushes entries, another one pops them; neither ever waits
+  for a lock or calls into the kernel. The producer only writes "head",
+  the consumer only writes "tail", and each sits in its own cache line,
+  so the two threads don't keep stealing the line from each other.
+
+  Entries are fixed-size and copied in and out. The capacity must be
+  a power of two.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+struct spsc_ring {
+  _Alignas(64) atomic_ulong head;       // next slot to write - producer only
+  _Alignas(64) atomic_ulong tail;       // next slot to read - consumer only
+  _Alignas(64) unsigned long mask;      // capacity - 1
+  size_t entry_size;
+  uint8_t *entries;
+};
+
+
+int ring_init(struct spsc_ring *ring, size_t entry_size, unsigned long capacity) {
+  if (capacity == 0 || (capacity & (capacity - 1))) {
+    return -1;
+  }
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->mask = capacity - 1;
+  ring->entry_size = entry_size;
+  ring->entries = calloc(capacity, entry_size);
+  return ring->entries == NULL ? -1 : 0;
+}
+
+
+void ring_free(struct spsc_ring *ring) {
+  free(ring->entries);
+  ring->entries = NULL;
+}
+
+
+int ring_push(struct spsc_ring *ring, const void *entry) {
+// Producer: add an entry. Returns 1, or 0 if the ring is full.
+  unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  if (head - tail > ring->mask) {
+    return 0;
+  }
+  memcpy(ring->entries + (head & ring->mask) * ring->entry_size, entry, ring->entry_size);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return 1;
+}
+
+
+int ring_pop(struct spsc_ring *ring, void *entry) {
+// Consumer: take the oldest entry. Returns 1, or 0 if the ring is empty.
+  unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  if (head == tail) {
+    return 0;
+  }
+  memcpy(entry, ring->entries + (tail & ring->mask) * ring->entry_size, ring->entry_size);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return 1;
+}
+
+
+unsigned long ring_depth(struct spsc_ring *ring) {
+// How many entries are waiting - exact for either side, a snapshot for others
+  return atomic_load_explicit(&ring->head, memory_order_acquire)
+         - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
@@ -22,6 +22,8 @@ This program depends on i2c-dev library, so you won't compile it without that.
 #include <sys/ioctl.h>
 #include <linux/i2c-dev.h>
 
+#include "./bus.c"
+
 /*  Define constants for MCP23017 I2C bus addresses
 
   This address is set by pulling the pins A0, A1, A2 up (to +3.3V) or down (to GND).
@@ -58,32 +60,23 @@ This program depends on i2c-dev library, so you won't compile it without that.
 #define OUTPUT 0x00
 #define ALL_OFF 0x00
 
-static const char *device = "/dev/i2c-1";	// Filesystem path to access the I2C bus
+struct bus i2c;                                 // The I2C bus with both chips (see bus.c)
 uint8_t buffer[2];                              // Initialize a buffer for two bytes to write to the device
-int mcp0, mcp1;
-
+int errors;                                     // Writes that didn't get through
 
+int all_off(void);
 
-void all_off(void) {
-  // This function sets all outputs on both chips to 0 (off, low state).
-
-  // Chip 0
-  buffer[0] = GPIOA;
-  buffer[1] = ALL_OFF;
-  write(mcp0, buffer, 2) ; //GPIOA to all off
 
-  buffer[0] = GPIOB;
-  buffer[1] = ALL_OFF;
-  write(mcp0, buffer, 2) ; //GPIOB to all off
-
-  // Chip 1
-  buffer[0] = GPIOA;
-  buffer[1] = ALL_OFF;
-  write(mcp1, buffer, 2) ; //GPIOA to all off
-
-  buffer[0] = GPIOB;
-  buffer[1] = ALL_OFF;
-  write(mcp1, buffer, 2) ; //GPIOB to all off
+int write_checked(int address, uint8_t *data, int length) {
+// Every write can fail - a chip not answering, a loose wire.
+// bus_write_retry() tries again a few times (see bus.c); if it still
+// fails, we say so instead of carrying on with wrong outputs.
+  if (bus_write_retry(&i2c, address, data, length) < 0) {
+    fprintf(stderr, "chip 0x%02x, register 0x%02x: %s\n", address, data[0], strerror(errno));
+    errors++;
+    return -1;
+  }
+  return 0;
 }
 
 
@@ -92,19 +85,18 @@ int mcp_init(void) {
 // Chip initialization:
 // The system (and kernel in particular) must set up communication
 // with the MCP23017 chips over the I2C bus. It's done by opening
-// the device file (/dev/i2c-1) and calling the "ioctl" function.
+// the device file (/dev/i2c-1) and calling the "ioctl" function
+// for each chip address - bus_open() and bus_write() in bus.c do that.
+// (Set MCP23017_BUS=sim to try this program with simulated chips.)
 
 // The chip must also "know" that it's used for providing outputs.
 // All the registers used are specified in the chip's datasheet:
 // http://ww1.microchip.com/downloads/en/DeviceDoc/21952b.pdf
 
-// Initialize 1st MCP23017 with 0x20 address:
-mcp0 = open(device, O_RDWR);
-ioctl(mcp0, I2C_SLAVE, MCP0_ADDR);
-
-// Initialize 2nd MCP23017 with 0x21 address:
-mcp1 = open(device, O_RDWR);
-ioctl(mcp1, I2C_SLAVE, MCP1_ADDR);
+// Open the bus with the chips at 0x20 and 0x21:
+if (bus_open(&i2c, NULL) < 0) {
+  return -1;
+}
 
 
 
@@ -141,20 +133,28 @@ ioctl(mcp1, I2C_SLAVE, MCP1_ADDR);
   // Chip 0
   buffer[0] = IODIRA;
   buffer[1] = OUTPUT;
-  write(mcp0, buffer, 2) ;  // set IODIRA to all outputs
+  if (write_checked(MCP0_ADDR, buffer, 2) < 0) {  // set IODIRA to all outputs
+    return -1;
+  }
 
   buffer[0] = IODIRB;
   buffer[1] = OUTPUT;
-  write(mcp0, buffer, 2) ;  // set IODIRB to all outputs
+  if (write_checked(MCP0_ADDR, buffer, 2) < 0) {  // set IODIRB to all outputs
+    return -1;
+  }
 
   // Chip 1
   buffer[0] = IODIRA;
   buffer[1] = OUTPUT;
-  write(mcp1, buffer, 2) ;  // set IODIRA to all outputs
+  if (write_checked(MCP1_ADDR, buffer, 2) < 0) {  // set IODIRA to all outputs
+    return -1;
+  }
 
   buffer[0] = IODIRB;
   buffer[1] = OUTPUT;
-  write(mcp1, buffer, 2) ;  // set IODIRB to all outputs
+  if (write_checked(MCP1_ADDR, buffer, 2) < 0) {  // set IODIRB to all outputs
+    return -1;
+  }
 
 
   // Now we should initially set the outputs' state to low
@@ -162,32 +162,50 @@ ioctl(mcp1, I2C_SLAVE, MCP1_ADDR);
   // Do the same whenever you want to turn all outputs off at once.
   // It should be easier to do this with a "for" loop (DRY principle).
 
-all_off();
-
+return all_off();
 }
 
 
-void send_bytes(int byte1, int byte2, int byte3, int byte4) {
+int send_bytes(int byte1, int byte2, int byte3, int byte4) {
   // This function sends bytes (received as arguments) 
   // to the chips' GPIOA, GPIOB registers.
+  // Returns 0, or -1 if a chip couldn't be written.
 
-  // Chip 0
-  buffer[0] = GPIOA;
-  buffer[1] = byte1;
-  write(mcp0, buffer, 2) ; //GPIOA set byte 1
+  // We could write each register separately, like in mcp_init():
+  // (GPIOA, byte1), (GPIOB, byte2) - but that's two writes per chip,
+  // each with its own START, address and STOP on the bus.
+  //
+  // The MCP23017 can do better: after each byte it receives, it moves
+  // its register pointer to the next address (that's the "sequential
+  // operation" mode, on by default - IOCON.SEQOP = 0). GPIOB (0x13)
+  // comes right after GPIOA (0x12), so we send three bytes in one go:
+  // register address, byte for bank A, byte for bank B.
 
-  buffer[0] = GPIOB;
-  buffer[1] = byte2;
-  write(mcp0, buffer, 2) ; //GPIOB set byte 2
+  uint8_t burst[3];
+  int result;
+
+  // Chip 0
+  burst[0] = GPIOA;
+  burst[1] = byte1;
+  burst[2] = byte2;
+  result = write_checked(MCP0_ADDR, burst, 3); //GPIOA set byte 1, GPIOB set byte 2
 
   // Chip 1
-  buffer[0] = GPIOA;
-  buffer[1] = byte3;
-  write(mcp1, buffer, 2) ; //GPIOA set byte 3
+  burst[0] = GPIOA;
+  burst[1] = byte3;
+  burst[2] = byte4;
+  // Try the second chip even if the first one failed:
+  if (write_checked(MCP1_ADDR, burst, 3) < 0) { //GPIOA set byte 3, GPIOB set byte 4
+    result = -1;
+  }
+  return result;
+}
+
 
-  buffer[0] = GPIOB;
-  buffer[1] = byte4;
-  write(mcp1, buffer, 2) ; //GPIOB set byte 4
+
+int all_off(void) {
+  // This function sets all outputs on both chips to 0 (off, low state).
+  return send_bytes(ALL_OFF, ALL_OFF, ALL_OFF, ALL_OFF);
 }
 
 
@@ -198,20 +216,29 @@ int main(void) {
   // Main loop: 
 
   // Initialize the chips:
-  mcp_init();
+  if (mcp_init() < 0) {
+    return 1;
+  }
 
   // Send four bytes to the chips:
 
   // Call a function send_bytes(byte0, byte1, byte2, byte3).
   // You can send them as hex, decimal, octal or bin values.
-  send_bytes(0x11, 53, 0144, 0b10101010);
+  if (send_bytes(0x11, 53, 0144, 0b10101010) < 0) {
+    all_off();
+    return 1;
+  }
 
   // Wait 5s so that you see the outputs turned on:
   sleep(5) ;
 
   // Now turn all the outputs off - write 0x00 to GPIOA, GPIOB
   // on both chips:
-  all_off();
+  // If that fails, the outputs may still be on - tell the user.
+  if (all_off() < 0) {
+    fprintf(stderr, "%d writes failed - check the outputs!\n", errors);
+    return 1;
+  }
 
   // This will be the end of our demonstration program.
   return 0 ;
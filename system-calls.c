@@ -6,6 +6,12 @@ connected to the Raspberry Pi I2C interface.
 This program uses a system call to the i2cset program from i2c-tools package.
 It initializes two MCP23017 chips and sends bytes to registers.
 
+Calling i2cset for every register is slow, though - each call starts a shell
+and an i2cset process. So by default the same writes are queued and sent
+from this program itself (see BACKEND_NATIVE below); i2cset stays available
+as a fallback. Run "system-calls i2cset" to use it, or "system-calls bench"
+to see the difference.
+
 This program uses the i2cset utility from the i2c-tools package. It is recommended
 to set up the I2C write access for regular users as described in README.md,
 and run the program under a regular user account (add yourself to the i2c group before).
@@ -21,7 +27,7 @@ Any Raspberry Pi more recent than the old 256MB B rev 1 (i.e., B rev 2, A+, B+ a
 uses I2C bus 1 for interfacing with devices by GPIO.
 Earlier models - RPi B rev 1 (and probably some RPi A's too) - used I2C bus 0.
 This program assumes you have B rev 2 or newer; you can change this by setting
-the bus_id value to 0 in the write_data function.
+the bus_id value to 0 (near the top of this file).
 
 You can probe for I2C devices on the bus 1 by typing a command:
 i2cdetect -y 1
@@ -67,6 +73,17 @@ and this would provide 128 additional input/outputs.
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+
+#include "./bus.c"
 
 #define MCP0 0x20    // I2C address for chip 0
 #define MCP1 0x21    // I2C address for chip 1
@@ -75,18 +92,140 @@ and this would provide 128 additional input/outputs.
 #define GPIOA 0x12   // hex address for GPIOA register - bank A input/outputs
 #define GPIOB 0x13   // hex address for GPIOB register - bank B input/outputs
 
-void write_data(int chip_address, int register_address, int value) {
+/*
+Two ways of getting the bytes to the chips:
+
+BACKEND_I2CSET - the original method: every write_data() call runs
+                 "i2cset" through system(). That's a shell and an i2cset
+                 process per register - milliseconds per write. It works
+                 with nothing but i2c-tools installed, so it stays as a fallback.
+BACKEND_NATIVE - write_data() only puts the write in a queue. flush_data()
+                 sends the whole queue from this process, in one I2C_RDWR
+                 ioctl on a bus opened once. Consecutive registers on the same
+                 chip (GPIOA then GPIOB) are merged into one sequential write.
+                 The bus is opened by bus.c - so setting MCP23017_BUS=sim
+                 runs it on simulated chips.
+*/
+#define BACKEND_I2CSET 0
+#define BACKEND_NATIVE 1
+
+#define QUEUE_SIZE 32          // no more than I2C_RDWR_IOCTL_MAX_MSGS (42) messages
+
+int backend = BACKEND_NATIVE;
+int bus_id = 1;                // change this to 0 if you use an old RPi mod B rev 1, or early mod A
+struct bus i2c;                // the bus, opened on first flush
+int bus_state;                 // 0 - not opened yet, 1 - open, -1 - failed to open
+
+struct pending_write {
+  uint8_t chip_address;
+  uint8_t register_address;
+  uint8_t value;
+} queue[QUEUE_SIZE];
+int queued;
+int errors;                    // writes that didn't get through, even after retrying
+
+void flush_data(void);
+
+int i2cset(int chip_address, int register_address, int value) {
 /* Wrapper function for "system" call to "i2cset" utility.
 Arguments:
 chip_address     - MCP23017 I2C bus address (0x20, 0x21)
 register_address - hex or decimal int for register address, it's convenient to use constants as above
 value            - byte we want to write to the register (hex, decimal, bin)
+Returns 0, or -1 if i2cset couldn't be run or reported an error.
 */
-int bus_id;
-bus_id = 1;                // change this to 0 if you use an old RPi mod B rev 1, or early mod A
 char command[50];
+int status;
 sprintf(command, "i2cset -y %i %i %i %i", bus_id, chip_address, register_address, value);
-system(command);
+status = system(command);
+if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+  fprintf(stderr, "%s: failed\n", command);
+  errors++;
+  return -1;
+}
+return 0;
+}
+
+void write_data(int chip_address, int register_address, int value) {
+/* Write a byte to a chip's register.
+With the native backend, the write waits in the queue until flush_data()
+(or until the queue is full). With i2cset, it's done right away.
+*/
+if (backend == BACKEND_I2CSET) {
+  i2cset(chip_address, register_address, value);
+  return;
+}
+if (queued == QUEUE_SIZE) {
+  flush_data();
+}
+queue[queued].chip_address = chip_address;
+queue[queued].register_address = register_address;
+queue[queued].value = value;
+queued++;
+}
+
+int open_bus(void) {
+// Open the bus once and keep it open for the whole program:
+char spec[20];
+if (bus_state == 0) {
+  sprintf(spec, "%i", bus_id);
+  bus_state = bus_open(&i2c, getenv("MCP23017_BUS") ? NULL : spec) < 0 ? -1 : 1;
+}
+return bus_state;
+}
+
+void flush_data(void) {
+/* Send all queued writes at once.
+Each run of writes to consecutive registers of one chip becomes one
+I2C message: register address first, then the values. The messages go
+to the kernel in a single I2C_RDWR ioctl. Adapters that can't do that
+get the same messages as plain writes. Failed transfers are retried
+(see bus.c); a write that fails for good is reported and counted.
+*/
+uint8_t data[QUEUE_SIZE * 2];
+struct i2c_msg messages[QUEUE_SIZE];
+int i, count, used;
+
+if (queued == 0) {
+  return;
+}
+if (open_bus() < 0) {
+  errors += queued;
+  queued = 0;
+  return;
+}
+
+count = 0;
+used = 0;
+for (i = 0; i < queued; i++) {
+  if (count > 0
+      && messages[count - 1].addr == queue[i].chip_address
+      && queue[i - 1].register_address + 1 == queue[i].register_address) {
+    // Continue the sequential write - the chip moves to the next register
+    data[used++] = queue[i].value;
+    messages[count - 1].len++;
+    continue;
+  }
+  messages[count].addr = queue[i].chip_address;
+  messages[count].flags = 0;
+  messages[count].len = 2;
+  messages[count].buf = &data[used];
+  data[used++] = queue[i].register_address;
+  data[used++] = queue[i].value;
+  count++;
+}
+queued = 0;
+
+if (bus_transfer_retry(&i2c, messages, count) == count) {
+  return;
+}
+for (i = 0; i < count; i++) {
+  if (bus_write_retry(&i2c, messages[i].addr, messages[i].buf, messages[i].len) < 0) {
+    fprintf(stderr, "chip 0x%02x, register 0x%02x: %s\n",
+            messages[i].addr, messages[i].buf[0], strerror(errno));
+    errors++;
+  }
+}
 }
 
 void all_off(void) {
@@ -95,6 +234,7 @@ write_data(MCP0, GPIOA, 0x00);
 write_data(MCP0, GPIOB, 0x00);
 write_data(MCP1, GPIOA, 0x00);
 write_data(MCP1, GPIOB, 0x00);
+flush_data();
 }
 
 void mcp_init(void) {
@@ -115,13 +255,51 @@ write_data(MCP0, GPIOA, byte0);
 write_data(MCP0, GPIOB, byte1);
 write_data(MCP1, GPIOA, byte2);
 write_data(MCP1, GPIOB, byte3);
+flush_data();
+}
+
+double benchmark(int use_backend, int updates) {
+// Send a number of updates (code word and all off) and return updates per second:
+struct timespec start, end;
+double seconds;
+int i;
+
+backend = use_backend;
+clock_gettime(CLOCK_MONOTONIC, &start);
+for (i = 0; i < updates; i++) {
+  send_bytes(i & 0xff, 0x55, 0xaa, 0x0f);
+  all_off();
+}
+clock_gettime(CLOCK_MONOTONIC, &end);
+seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+return updates / seconds;
 }
 
-void main(void) {
+int main(int argc, char **argv) {
+/* Run without arguments for the demonstration.
+"system-calls i2cset" does the same with the old i2cset method.
+"system-calls bench [updates]" compares the two methods.
+*/
+int updates;
      
 // Declare some arbitrary bytes that we'll send to outputs
 int byte0, byte1, byte2, byte3;
 
+if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+  updates = argc > 2 ? atoi(argv[2]) : 100;
+  if (updates <= 0) {
+    updates = 100;
+  }
+  mcp_init();
+  // i2cset is slow - give it a tenth of the updates
+  printf("i2cset: %10.1f updates/s\n", benchmark(BACKEND_I2CSET, updates / 10 + 1));
+  printf("native: %10.1f updates/s\n", benchmark(BACKEND_NATIVE, updates));
+  return 0;
+}
+if (argc > 1 && strcmp(argv[1], "i2cset") == 0) {
+  backend = BACKEND_I2CSET;
+}
+
 // These bytes can be hex, octal, decimal or binary values:
 byte0 = 0x11;                  // hex
 byte1 = 0177;                  // octal
@@ -132,4 +310,9 @@ mcp_init();                                      // Call mcp_init() to initializ
 send_bytes(byte0, byte1, byte2, byte3);          // Send these bytes!
 sleep(5);                                        // Wait 5 seconds, keep the outputs on
 all_off();                                       // Turn all lines off
+if (errors) {
+  fprintf(stderr, "%d writes failed - check the outputs!\n", errors);
+  return 1;
+}
+return 0;
 }
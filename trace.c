@@ -0,0 +1,262 @@
+/*
+  Tracing - what happened when, to the nanosecond, in every thread.
+
+  When a machine cycle goes wrong, the counters say that it did, but not
+  why. The trace keeps the last TRACE_EVENTS events of every thread
+  that records any:
+
+  edge      - an input edge, at the time the kernel stamped it
+  wakeup    - the output loop got the edge
+  write     - a bus transfer: begins, ends (with the result)
+  errno     - a transfer failed, and why
+  elided    - a register write the shadow registers made unnecessary
+
+  and trace_dump() writes them out in the Chrome trace format - load the
+  file in chrome://tracing or https://ui.perfetto.dev to see every cycle,
+  thread by thread, on one time line.
+
+  Every thread records into its own ring - no locks, no atomic
+  read-modify-write, nothing shared but the list of rings. The ring
+  overwrites its oldest events; a record is a clock read and a 16-byte
+  store, a few tens of nanoseconds. With tracing off (trace_enabled = 0)
+  it's a test and a branch.
+
+  Turn it on with MCP23017_TRACE=file.json: recording starts right away,
+  SIGUSR2 pauses it (and writes the file) or resumes it, and the file is
+  written when the program exits. Or set trace_enabled yourself and call
+  trace_dump() when you like.
+
+  Include this before anything that records events - bus.c does.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#define TRACE_EVENTS 65536              // per thread, a power of two (1 MB)
+#define TRACE_THREADS 32
+
+// Event types:
+#define TRACE_EDGE 0                    // arg: 1 - rising, 0 - falling
+#define TRACE_WAKEUP 1
+#define TRACE_WRITE_BEGIN 2             // arg: chip address | kind << 8; extra: bytes or messages
+#define TRACE_WRITE_END 3               // arg: the result
+#define TRACE_ERRNO 4                   // arg: errno; extra: chip address
+#define TRACE_ELIDED 5                  // arg: chip address; extra: register
+
+// What kind of transfer a write is:
+#define TRACE_KIND_WRITE 0
+#define TRACE_KIND_TRANSFER 1
+#define TRACE_KIND_SMBUS 2
+
+struct trace_event {
+  uint64_t ns;                          // CLOCK_MONOTONIC, like the kernel's edge timestamps
+  uint32_t arg;
+  uint16_t type;
+  uint16_t extra;
+};
+
+struct trace_ring {
+  atomic_ulong head;                    // events recorded so far
+  long tid;
+  char name[16];
+  struct trace_event events[TRACE_EVENTS];
+};
+
+volatile sig_atomic_t trace_enabled;
+const char *trace_file;                 // where trace_dump_file() writes, from MCP23017_TRACE
+
+struct trace_ring *trace_rings[TRACE_THREADS];
+atomic_int trace_ring_count;
+static _Thread_local struct trace_ring *trace_ring;
+
+
+struct trace_ring *trace_thread(void) {
+/*
+  This thread's ring - made on the first event. Real-time threads should
+  call this when they start, so that it isn't made (and its pages faulted
+  in) in the middle of a cycle. Returns NULL if there are too many threads.
+*/
+  struct trace_ring *ring;
+  int slot;
+
+  if (trace_ring != NULL) {
+    return trace_ring;
+  }
+  slot = atomic_fetch_add(&trace_ring_count, 1);
+  if (slot >= TRACE_THREADS) {
+    atomic_fetch_sub(&trace_ring_count, 1);
+    return NULL;
+  }
+  ring = calloc(1, sizeof(*ring));
+  if (ring == NULL) {
+    return NULL;
+  }
+  ring->tid = syscall(SYS_gettid);
+  if (prctl(PR_GET_NAME, ring->name) != 0) {
+    snprintf(ring->name, sizeof(ring->name), "thread %ld", ring->tid);
+  }
+  trace_ring = ring;
+  trace_rings[slot] = ring;
+  return ring;
+}
+
+
+static inline void trace_at(int type, uint64_t ns, uint32_t arg, int extra) {
+// Record an event that happened at a known time
+  struct trace_ring *ring = trace_ring;
+  struct trace_event *event;
+  unsigned long head;
+
+  if (!trace_enabled || (ring == NULL && (ring = trace_thread()) == NULL)) {
+    return;
+  }
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  event = &ring->events[head & (TRACE_EVENTS - 1)];
+  event->ns = ns;
+  event->arg = arg;
+  event->type = type;
+  event->extra = extra;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+static inline void trace(int type, uint32_t arg, int extra) {
+// Record an event happening now
+  struct timespec ts;
+
+  if (!trace_enabled) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  trace_at(type, (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec, arg, extra);
+}
+
+
+int trace_dump(const char *name) {
+/*
+  Write every ring out as a Chrome trace (JSON). Best done with tracing
+  paused: a thread recording meanwhile may overwrite the events being written.
+  Returns the number of events written, or -1.
+*/
+  static const char *kinds[] = { "write", "transfer", "smbus" };
+  struct trace_ring *ring;
+  struct trace_event *event;
+  unsigned long head, first, i;
+  const char *separator = "";
+  int r, count = 0, rings = atomic_load(&trace_ring_count);
+  FILE *out;
+
+  out = fopen(name, "w");
+  if (out == NULL) {
+    return -1;
+  }
+  fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  for (r = 0; r < rings && trace_rings[r] != NULL; r++) {
+    ring = trace_rings[r];
+    fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %ld, "
+            "\"args\": {\"name\": \"%s\"}}", separator, getpid(), ring->tid, ring->name);
+    separator = ",\n";
+
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    for (i = first; i < head; i++) {
+      event = &ring->events[i & (TRACE_EVENTS - 1)];
+      fprintf(out, ",\n{\"pid\": %d, \"tid\": %ld, \"ts\": %llu.%03u, ",
+              getpid(), ring->tid, (unsigned long long) event->ns / 1000, (unsigned) (event->ns % 1000));
+      switch (event->type) {
+      case TRACE_EDGE:
+        fprintf(out, "\"name\": \"edge %s\", \"ph\": \"i\", \"s\": \"p\"}",
+                event->arg ? "rising" : "falling");
+        break;
+      case TRACE_WAKEUP:
+        fprintf(out, "\"name\": \"wakeup\", \"ph\": \"i\", \"s\": \"t\"}");
+        break;
+      case TRACE_WRITE_BEGIN:
+        fprintf(out, "\"name\": \"%s\", \"ph\": \"B\", \"args\": {\"address\": \"0x%02x\", \"%s\": %u}}",
+                kinds[(event->arg >> 8) % 3], event->arg & 0xff,
+                event->arg >> 8 == TRACE_KIND_TRANSFER ? "messages" : "bytes", event->extra);
+        break;
+      case TRACE_WRITE_END:
+        fprintf(out, "\"ph\": \"E\", \"args\": {\"result\": %d}}", (int) event->arg);
+        break;
+      case TRACE_ERRNO:
+        fprintf(out, "\"name\": \"errno %u\", \"ph\": \"i\", \"s\": \"t\", "
+                "\"args\": {\"address\": \"0x%02x\", \"error\": \"%s\"}}",
+                event->arg, event->extra, strerror(event->arg));
+        break;
+      default:
+        fprintf(out, "\"name\": \"elided\", \"ph\": \"i\", \"s\": \"t\", "
+                "\"args\": {\"address\": \"0x%02x\", \"register\": \"0x%02x\"}}",
+                event->arg, event->extra);
+      }
+      count++;
+    }
+  }
+  fprintf(out, "\n]}\n");
+  if (fclose(out) != 0) {
+    return -1;
+  }
+  return count;
+}
+
+
+void trace_dump_file(void) {
+// At exit, and when SIGUSR2 pauses tracing: write MCP23017_TRACE
+  int count;
+
+  if (trace_file == NULL) {
+    return;
+  }
+  count = trace_dump(trace_file);
+  if (count < 0) {
+    perror(trace_file);
+  }
+  else {
+    fprintf(stderr, "trace: %d events written to %s\n", count, trace_file);
+  }
+}
+
+
+void trace_toggle(int signal) {
+// SIGUSR2: pause or resume - trace_poll() writes the file once paused
+  trace_enabled = !trace_enabled;
+}
+
+
+void trace_poll(void) {
+// Between cycles: if SIGUSR2 has paused tracing, write the file (once)
+  static int written;
+
+  if (trace_file == NULL) {
+    return;
+  }
+  if (trace_enabled) {
+    written = 0;
+  }
+  else if (!written) {
+    trace_dump_file();
+    written = 1;
+  }
+}
+
+
+void trace_configure(void) {
+// MCP23017_TRACE=file.json: trace from now on, write the file at exit
+  const char *name = getenv("MCP23017_TRACE");
+
+  if (name == NULL || *name == 0) {
+    return;
+  }
+  trace_file = name;
+  trace_enabled = 1;
+  signal(SIGUSR2, trace_toggle);
+  atexit(trace_dump_file);
+}
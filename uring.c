@@ -0,0 +1,188 @@
+/*
+  io_uring - many writes, one syscall.
+
+  With one file descriptor per chip, an update of n chips is n write()
+  calls, one after another, each a trip into the kernel and back.
+  io_uring lets us put all n writes in a ring shared with the kernel
+  (submission queue entries - SQEs) and hand them over with a single
+  io_uring_enter(); the results come back in another shared ring
+  (completion queue entries - CQEs), where we can pick them up later
+  without any syscall at all.
+
+  This is just enough of it for devices.c (see WRITE_URING there), done
+  with the raw syscalls and the kernel's linux/io_uring.h - no liburing
+  needed. It needs Linux 5.5 or newer (IORING_OP_WRITE); on older kernels,
+  or where io_uring is turned off, uring_init() fails with ENOSYS or EPERM.
+
+  uring_init(ring, n)         - a ring with room for n writes in flight
+  uring_write(ring, fd, ...)  - queue a write (no syscall)
+  uring_submit(ring, wait)    - hand the queued writes to the kernel, and
+                                wait until that many have completed (0 - don't)
+  uring_reap(ring, done, arg) - call done() for every completed write (no syscall)
+  uring_free(ring)
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring {
+  int fd;
+  unsigned entries;
+// The submission queue - we move the tail, the kernel the head:
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+// The completion queue - the kernel moves the tail, we the head:
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *rings;
+  size_t rings_size, sqes_size;
+  unsigned queued;                      // writes queued, not submitted yet
+  unsigned inflight;                    // submitted, not reaped yet
+  unsigned long enters;                 // io_uring_enter() calls
+};
+
+
+int uring_init(struct uring *ring, unsigned entries) {
+// Set up the rings and map them. Returns 0, or -1 with errno.
+  struct io_uring_params params;
+  size_t sq_size, cq_size;
+  uint8_t *rings;
+  int error;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    return -1;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(ring->fd);
+    errno = ENOSYS;                     // Linux < 5.4 - not worth the extra mapping
+    return -1;
+  }
+
+// Both rings live in one mapping; the SQEs in another:
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring->fd, IORING_OFF_SQ_RING);
+  if (ring->rings == MAP_FAILED) {
+    error = errno;
+    close(ring->fd);
+    errno = error;
+    return -1;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    error = errno;
+    munmap(ring->rings, ring->rings_size);
+    close(ring->fd);
+    errno = error;
+    return -1;
+  }
+
+  rings = ring->rings;
+  ring->entries = params.sq_entries;
+  ring->sq_head = (unsigned *) (rings + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (rings + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (rings + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (rings + params.sq_off.array);
+  ring->cq_head = (unsigned *) (rings + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (rings + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (rings + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+  return 0;
+}
+
+
+void uring_free(struct uring *ring) {
+  if (ring->rings == NULL) {
+    return;
+  }
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->rings, ring->rings_size);
+  close(ring->fd);
+  ring->rings = NULL;
+}
+
+
+int uring_write(struct uring *ring, int fd, const void *data, unsigned length, uint64_t user_data) {
+/*
+  Queue a write of data to fd - at the current file position, like write().
+  The data must stay put until the write has completed. Returns 0, or -1
+  if there's no room (submit, and reap what has completed).
+*/
+  unsigned tail = *ring->sq_tail, index;
+  struct io_uring_sqe *sqe;
+
+  if (ring->queued + ring->inflight >= ring->entries) {
+    errno = EBUSY;
+    return -1;
+  }
+  index = tail & *ring->sq_mask;
+  sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->off = (uint64_t) -1;
+  sqe->addr = (uintptr_t) data;
+  sqe->len = length;
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+// The kernel may read the entry as soon as it sees the new tail:
+  atomic_store_explicit((_Atomic unsigned *) ring->sq_tail, tail + 1, memory_order_release);
+  ring->queued++;
+  return 0;
+}
+
+
+int uring_submit(struct uring *ring, unsigned wait) {
+/*
+  Hand the queued writes to the kernel, and wait for this many completions
+  (0 - don't wait) - all in one syscall. Returns the number submitted, or -1.
+*/
+  int submitted;
+
+  if (ring->queued == 0 && wait == 0) {
+    return 0;
+  }
+  do {
+    submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    ring->enters++;
+  } while (submitted < 0 && errno == EINTR);
+  if (submitted < 0) {
+    return -1;
+  }
+  ring->queued -= submitted;
+  ring->inflight += submitted;
+  return submitted;
+}
+
+
+int uring_reap(struct uring *ring, void (*done)(uint64_t user_data, int result, void *arg), void *arg) {
+// Pass every completion waiting in the ring to done(). Returns how many there were.
+  unsigned head = *ring->cq_head;
+  unsigned tail = atomic_load_explicit((_Atomic unsigned *) ring->cq_tail, memory_order_acquire);
+  struct io_uring_cqe *cqe;
+  int count = 0;
+
+  while (head != tail) {
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    done(cqe->user_data, cqe->res, arg);
+    head++;
+    count++;
+  }
+  atomic_store_explicit((_Atomic unsigned *) ring->cq_head, head, memory_order_release);
+  ring->inflight -= count;
+  return count;
+}